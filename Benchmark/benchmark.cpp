@@ -13,8 +13,23 @@ int main(int argc, char *argv[])
 
     QActiveResource::Resource resource(QUrl(getenv("AR_BASE")), getenv("AR_RESOURCE"));
 
+    if(getenv("AR_FORMAT") && QString(getenv("AR_FORMAT")) == "json")
+    {
+        resource.setFormat(QActiveResource::JsonFormat);
+    }
+
     const QString field = getenv("AR_FIELD");
 
+    if(getenv("AR_PROJECT"))
+    {
+        resource.setFields(QStringList() << field);
+    }
+
+    if(getenv("AR_LAZY"))
+    {
+        resource.setLazy(true);
+    }
+
     for(int i = 1; i <= count; i++)
     {
         printf("%i\n", i);
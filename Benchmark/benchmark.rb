@@ -13,6 +13,9 @@ when 'nokogiri'
 when 'qar'
   require 'QAR'
   extend = 'extend QAR'
+when 'qar-json'
+  require 'QAR'
+  extend = 'extend QAR ; self.format = :json'
 end
 
 resource = ENV['AR_RESOURCE'].capitalize
@@ -0,0 +1,79 @@
+#!/usr/bin/ruby
+
+# Measures how long QAR takes to turn a response into Ruby objects and how many
+# objects it allocates for it.  A WEBrick server in the same process serves a
+# collection of generated products, each with a nested record and datetimes,
+# so no web server is needed.
+#
+# To see the effect of a change to the conversion, run it against builds of QAR
+# from before and after it with the same arguments.  No results have been
+# recorded for the cached conversion of classes and keys yet.
+#
+# Usage: conversion.rb [iterations] [records]
+
+require 'rubygems'
+require 'active_resource'
+require 'webrick'
+require 'benchmark'
+require 'QAR'
+
+iterations = (ARGV.shift || 50).to_i
+count = (ARGV.shift || 250).to_i
+
+product = lambda do |i|
+  <<-EOS
+  <product>
+    <id type="integer">#{i}</id>
+    <title>Product #{i}</title>
+    <price type="decimal">#{i}.99</price>
+    <available type="boolean">true</available>
+    <created-at type="datetime">2012-03-04T05:06:07Z</created-at>
+    <updated-at type="datetime">2013-03-04T05:06:07Z</updated-at>
+    <vendor>
+      <name>Vendor #{i % 10}</name>
+      <country>DE</country>
+    </vendor>
+  </product>
+  EOS
+end
+
+body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<products type=\"array\">\n" +
+  (1..count).map(&product).join + "</products>\n"
+
+server = WEBrick::HTTPServer.new(:BindAddress => '127.0.0.1', :Port => 0,
+                                 :Logger => WEBrick::Log.new(nil, 0),
+                                 :AccessLog => [])
+
+server.mount_proc('/products.xml') do |request, response|
+  response['Content-Type'] = 'application/xml'
+  response.body = body
+end
+
+thread = Thread.new { server.start }
+
+class Product < ActiveResource::Base
+  extend QAR
+end
+
+Product.site = "http://127.0.0.1:#{server.config[:Port]}/"
+
+# Warm up the connection and the classes of the nested records.
+
+Product.find(:all)
+
+GC.start
+allocated = GC.stat[:total_allocated_objects]
+
+time = Benchmark.realtime do
+  iterations.times { Product.find(:all) }
+end
+
+allocated = GC.stat[:total_allocated_objects] - allocated
+
+puts "records:            #{count}"
+puts "iterations:         #{iterations}"
+puts "ms per find:        #{'%.3f' % (time * 1000 / iterations)}"
+puts "objects per record: #{'%.1f' % (allocated.to_f / iterations / count)}"
+
+server.shutdown
+thread.join
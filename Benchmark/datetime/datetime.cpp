@@ -0,0 +1,87 @@
+/*
+ * Compares the datetime parser against the QDateTime::fromString() based one
+ * that it replaced, using the datetimes from the benchmark's tests.xml.  The
+ * library's source is included directly since its parser is file static.
+ */
+
+#include "../../QActiveResource.cpp"
+
+#include <QFile>
+#include <QTime>
+
+static QDateTime fromStringToDateTime(const QString &s)
+{
+    QDateTime time = QDateTime::fromString(s.left(s.length() - 6), Qt::ISODate);
+
+    time.setTimeSpec(Qt::UTC);
+
+    int zoneHours = s.mid(s.length() - 6, 3).toInt();
+    int zoneMinutes = s.right(2).toInt();
+
+    return time.addSecs(-1 * (60 * zoneHours + zoneMinutes) * 60);
+}
+
+template <class Parser> static int run(const char *title, Parser parse,
+                                       const QStringList &values, int count)
+{
+    QTime timer;
+    timer.start();
+
+    uint checksum = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        foreach(QString value, values)
+        {
+            checksum += parse(value).toTime_t();
+        }
+    }
+
+    int elapsed = timer.elapsed();
+
+    printf("%-12s %6i ms  %8.1f ns/value  (checksum %u)\n", title, elapsed,
+           elapsed * 1000000.0 / (double(count) * values.size()), checksum);
+
+    return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    QFile file(argc > 1 ? argv[1] : "../tests.xml");
+
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        fprintf(stderr, "Couldn't open %s\n", qPrintable(file.fileName()));
+        return 1;
+    }
+
+    int count = argc > 2 ? QString(argv[2]).toInt() : 10000;
+
+    QStringList values;
+    QXmlStreamReader xml(&file);
+
+    while(!xml.atEnd())
+    {
+        if(xml.readNext() == QXmlStreamReader::StartElement &&
+           xml.attributes().value(QLatin1String("type")) == QLatin1String("datetime"))
+        {
+            values.append(xml.readElementText());
+        }
+    }
+
+    foreach(QString value, values)
+    {
+        if(toDateTime(value) != fromStringToDateTime(value))
+        {
+            fprintf(stderr, "Mismatch for %s\n", qPrintable(value));
+            return 1;
+        }
+    }
+
+    printf("%i datetimes x %i\n", values.size(), count);
+
+    run("fromString", fromStringToDateTime, values, count);
+    run("toDateTime", toDateTime, values, count);
+
+    return 0;
+}
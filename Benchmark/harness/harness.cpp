@@ -0,0 +1,345 @@
+/*
+ * A self-contained benchmark.  A loopback HTTP server in the same process
+ * serves tests.xml, tests.json and a generated collection, so no web server is
+ * needed.  Each fixture is measured in stages:
+ *
+ *   - transport:  downloading the body without decoding it
+ *   - decode:     feeding the body to the decoder
+ *   - records:    turning the decoded document into a RecordList
+ *   - find:       Resource::find(), i.e. all of the above overlapped
+ *
+ * Afterwards the generated collection is fetched by an Executor with 1, 2, 4,
+ * ... threads up to one per core (the "scaling" stage).  The efficiency is
+ * only reported: the server shares the process's cores, so it depends on the
+ * machine's load too much to fail on.
+ *
+ * Results are written as one JSON object per line to stdout.
+ *
+ * Usage: harness [iterations] [generated records] [fixture directory]
+ *
+ * The library's source is included directly so that the stages can be run on
+ * their own.
+ */
+
+#include "../../QActiveResource.cpp"
+#include "../../Tests/Server.h"
+
+#include <QFile>
+#include <QThread>
+#include <QElapsedTimer>
+
+#include <algorithm>
+
+/*
+ * Allocation counting.  With glibc, malloc and friends are replaced with
+ * versions that count calls per thread, so that the server's allocations
+ * aren't included.
+ */
+
+#ifdef __GLIBC__
+
+static __thread qint64 allocations = 0;
+
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+
+    void *malloc(size_t size)
+    {
+        allocations++;
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t count, size_t size)
+    {
+        allocations++;
+        return __libc_calloc(count, size);
+    }
+
+    void *realloc(void *ptr, size_t size)
+    {
+        allocations++;
+        return __libc_realloc(ptr, size);
+    }
+}
+
+static qint64 allocationCount()
+{
+    return allocations;
+}
+
+#else
+
+static qint64 allocationCount()
+{
+    return -1;
+}
+
+#endif
+
+/*
+ * Measurements
+ */
+
+struct Stats
+{
+    Stats() : records(0), bytes(0), allocations(0) {}
+
+    QVector<double> times;
+    int records;
+    qint64 bytes;
+    qint64 allocations;
+};
+
+static double percentile(QVector<double> times, double p)
+{
+    if(times.isEmpty())
+    {
+        return 0;
+    }
+
+    std::sort(times.begin(), times.end());
+    return times[qMin(times.size() - 1, int(times.size() * p))];
+}
+
+static void report(const char *stage, const QString &fixture, const Stats &stats)
+{
+    double total = 0;
+
+    foreach(double time, stats.times)
+    {
+        total += time;
+    }
+
+    int iterations = stats.times.size();
+    double seconds = total / 1000;
+    double records = double(stats.records) * iterations;
+
+    printf("{\"stage\": \"%s\", \"fixture\": \"%s\", \"iterations\": %i, "
+           "\"records\": %i, \"bytes\": %lli, \"requests_per_sec\": %.1f, "
+           "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"bytes_per_sec\": %.0f, "
+           "\"allocations_per_record\": %.2f}\n",
+           stage, qPrintable(fixture), iterations, stats.records, stats.bytes,
+           seconds > 0 ? iterations / seconds : 0,
+           percentile(stats.times, 0.5), percentile(stats.times, 0.99),
+           seconds > 0 ? stats.bytes * iterations / seconds : 0,
+           stats.allocations >= 0 && records > 0 ? stats.allocations / records : -1.0);
+
+    fflush(stdout);
+}
+
+static double milliseconds(const QElapsedTimer &timer)
+{
+    return timer.nsecsElapsed() / 1000000.0;
+}
+
+static void benchmark(const QUrl &base, const QString &name, Format format,
+                      const QByteArray &body, int iterations)
+{
+    QString fixture = name + (format == JsonFormat ? ".json" : ".xml");
+    QUrl url = base.resolved(QUrl(fixture));
+
+    Stats transport;
+    Stats decode;
+    Stats records;
+    Stats find;
+
+    Resource resource(base, name);
+    resource.setFormat(format);
+
+    for(int i = 0; i < iterations; i++)
+    {
+        QElapsedTimer timer;
+        qint64 start = allocationCount();
+
+        timer.start();
+        QByteArray data = HTTP::get(url);
+        transport.times.append(milliseconds(timer));
+        transport.allocations += allocationCount() - start;
+        transport.bytes = data.size();
+
+        QScopedPointer<Decoder> decoder(createDecoder(format, name, 0));
+
+        start = allocationCount();
+        timer.start();
+        decoder->addData(body.constData(), body.size());
+        decoder->finish();
+        decode.times.append(milliseconds(timer));
+        decode.allocations += allocationCount() - start;
+        decode.bytes = body.size();
+
+        start = allocationCount();
+        timer.start();
+        RecordList list = decoder->records();
+        records.times.append(milliseconds(timer));
+        records.allocations += allocationCount() - start;
+        records.bytes = body.size();
+
+        start = allocationCount();
+        timer.start();
+        RecordList found = resource.find();
+        find.times.append(milliseconds(timer));
+        find.allocations += allocationCount() - start;
+        find.bytes = body.size();
+
+        transport.records = decode.records = records.records = list.size();
+        find.records = found.size();
+    }
+
+    report("transport", fixture, transport);
+    report("decode", fixture, decode);
+    report("records", fixture, records);
+    report("find", fixture, find);
+}
+
+/*!
+ * Runs \a requests concurrent finds of \a name with increasing numbers of
+ * threads and reports the throughput and its efficiency relative to a single
+ * thread.
+ */
+
+static void scaling(const QUrl &base, const QString &name, int requests)
+{
+    Resource resource(base, name);
+    QList<int> counts;
+
+    for(int threads = 1; threads < QThread::idealThreadCount(); threads *= 2)
+    {
+        counts.append(threads);
+    }
+
+    counts.append(qMax(1, QThread::idealThreadCount()));
+
+    double single = 0;
+
+    foreach(int threads, counts)
+    {
+        Executor executor(threads);
+        QElapsedTimer timer;
+
+        timer.start();
+
+        for(int i = 0; i < requests; i++)
+        {
+            executor.add(resource);
+        }
+
+        executor.waitForDone();
+
+        for(int i = 0; i < requests; i++)
+        {
+            try
+            {
+                executor.result(i);
+            }
+            catch(const Exception &exception)
+            {
+                fprintf(stderr, "Find failed: %s\n", qPrintable(exception.message()));
+                return;
+            }
+        }
+
+        double seconds = milliseconds(timer) / 1000;
+        double rate = seconds > 0 ? requests / seconds : 0;
+
+        if(threads == 1)
+        {
+            single = rate;
+        }
+
+        printf("{\"stage\": \"scaling\", \"fixture\": \"%s.xml\", \"threads\": %i, "
+               "\"requests\": %i, \"requests_per_sec\": %.1f, \"efficiency\": %.2f}\n",
+               qPrintable(name), threads, requests, rate,
+               single > 0 ? rate / (single * threads) : 0);
+
+        fflush(stdout);
+    }
+}
+
+/*!
+ * \return tests.xml with its records repeated until there are \a count of them.
+ */
+
+static QByteArray generate(const QByteArray &xml, const QByteArray &root, int count)
+{
+    QByteArray open = "<" + root + " type=\"array\">";
+    QByteArray close = "</" + root + ">";
+
+    int start = xml.indexOf(open) + open.size();
+    int end = xml.lastIndexOf(close);
+    QByteArray element = "<" + root.left(root.size() - 1) + ">";
+
+    QList<QByteArray> items;
+
+    for(int i = xml.indexOf(element, start); i >= 0 && i < end; )
+    {
+        int next = xml.indexOf(element, i + element.size());
+        items.append(xml.mid(i, (next < 0 || next > end ? end : next) - i));
+        i = next;
+    }
+
+    QByteArray result = xml.left(start);
+
+    for(int i = 0; i < count && !items.isEmpty(); i++)
+    {
+        result += items[i % items.size()];
+    }
+
+    return result + xml.mid(end);
+}
+
+static QByteArray readFile(const QString &path)
+{
+    QFile file(path);
+
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        fprintf(stderr, "Couldn't open %s\n", qPrintable(path));
+        exit(1);
+    }
+
+    return file.readAll();
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? QString(argv[1]).toInt() : 200;
+    int generated = argc > 2 ? QString(argv[2]).toInt() : 1000;
+    QString directory = argc > 3 ? argv[3] : "..";
+
+    QByteArray xml = readFile(directory + "/tests.xml");
+    QByteArray json = readFile(directory + "/tests.json");
+    QByteArray large = generate(xml, "products", generated);
+    QString largeName = QString("generated-%1").arg(generated);
+
+    QHash<QByteArray, QByteArray> files;
+    files["/tests.xml"] = xml;
+    files["/tests.json"] = json;
+    files["/" + largeName.toLatin1() + ".xml"] = large;
+
+    Server server(files);
+
+    if(!server.port())
+    {
+        fprintf(stderr, "Couldn't start the server\n");
+        return 1;
+    }
+
+    server.start();
+
+    QUrl base(QString("http://127.0.0.1:%1/").arg(server.port()));
+
+    benchmark(base, "tests", XmlFormat, xml, iterations);
+    benchmark(base, "tests", JsonFormat, json, iterations);
+    benchmark(base, largeName, XmlFormat, large, qMax(1, iterations / 10));
+    scaling(base, largeName, qMax(QThread::idealThreadCount() * 4, iterations / 2));
+
+    // Close the pooled keep-alive connections so that the server's connection
+    // threads finish.
+
+    ConnectionPool::clear();
+
+    return 0;
+}
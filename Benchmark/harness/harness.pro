@@ -0,0 +1,11 @@
+TEMPLATE = app
+CONFIG -= app_bundle
+TARGET = harness
+QT += xml
+DEPENDPATH += .
+INCLUDEPATH += . ../..
+LIBS += -lcurl
+QMAKE_CXXFLAGS += -O3
+
+# Input
+SOURCES += harness.cpp
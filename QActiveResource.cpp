@@ -5,214 +5,225 @@
 #include "QActiveResource.h"
 #include <QXmlStreamReader>
 #include <QStringList>
+#include <QVector>
+#include <QScopedPointer>
 #include <QDateTime>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QFile>
+#include <QTemporaryFile>
+#include <QDir>
+#include <QDataStream>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadStorage>
+#include <QSocketNotifier>
+#include <QTimerEvent>
+#include <QFutureInterface>
 #include <QDebug>
 #include <curl/curl.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
 
 #define QAR_DEBUG "QAR_DEBUG"
 #define DEFAULT_TIMEOUT 60
+#define DEFAULT_POOL_SIZE 8
+#define DEFAULT_POOL_IDLE_TIMEOUT 60
+#define DEFAULT_CONCURRENCY 8
+#define MAX_PRESIZE (64 * 1024 * 1024)
+#define CACHE_MAGIC 0x51415243
+#define CACHE_VERSION 1
+#define HEDGE_WINDOW 128
+#define HEDGE_MIN_SAMPLES 16
+#define RETRY_PAUSE_SLICE 50
+#define ASYNC_CANCEL_INTERVAL 100
 
 using namespace QActiveResource;
 
 static const QString QActiveResourceClassKey = "QActiveResource Class";
 
-static size_t writer(void *ptr, size_t size, size_t nmemb, void *stream)
+/*!
+ * The types of the "type" attribute.  The table is constant so that it can be
+ * read from several threads without any initialization.
+ */
+
+static const struct
 {
-    reinterpret_cast<QByteArray *>(stream)->append(QByteArray((const char *)(ptr),
-                                                              int(size * nmemb)));
-    return size * nmemb;
-}
+    const char *name;
+    QVariant::Type type;
+} types[] =
+{
+    { "integer", QVariant::Int },
+    { "decimal", QVariant::Double },
+    { "datetime", QVariant::DateTime },
+    { "boolean", QVariant::Bool }
+};
 
-static size_t header(void *ptr, size_t size, size_t nmemb, void *stream)
+static QVariant::Type lookupType(const QString &name)
 {
-    QByteArray header((const char *) ptr, int(size * nmemb));
+    for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if(name == QLatin1String(types[i].name))
+        {
+            return types[i].type;
+        }
+    }
 
-    int index = header.indexOf(": ");
+    return QVariant::String;
+}
 
-    if(index >= 0)
+/*!
+ * \return \a text as an int, or as a qlonglong if it's too large for an int.
+ * Like QString::toInt(), text that isn't a number is 0.
+ */
+
+static QVariant toInteger(const QString &text)
+{
+    bool ok = false;
+    int value = text.toInt(&ok);
+
+    if(ok)
     {
-        QByteArray key = header.left(index).trimmed();
-        QByteArray value = header.mid(index + 2).trimmed();
-        (*reinterpret_cast<Response::Headers *>(stream))[key] = value;
+        return value;
     }
 
-    return size * nmemb;
+    qlonglong longValue = text.toLongLong(&ok);
+
+    return ok ? QVariant(longValue) : QVariant(0);
 }
 
-namespace HTTP
+static void assign(Record *record, QString name, const QVariant &value)
 {
-    void handleError(int result, const Response &response, const QString &message)
+    (*record)[name.replace('-', '_')] = value;
+}
+
+/*!
+ * \return The value of the \a count decimal digits at \a c.  \a ok is set to
+ * false if any of them isn't a digit.
+ */
+
+static inline int toDigits(const QChar *c, int count, bool *ok)
+{
+    int value = 0;
+
+    for(int i = 0; i < count; i++)
     {
-        Exception::Type type = Exception::ConnectionError;
+        uint digit = uint(c[i].unicode()) - '0';
 
-        if(result == CURLE_OPERATION_TIMEOUTED)
-        {
-            type = Exception::TimeoutError;
-        }
-        else if(result == CURLE_SSL_CONNECT_ERROR)
-        {
-            type = Exception::SSLError;
-        }
-        else if(response.code() >= 400 && response.code() <= 499)
-        {
-            if(response.code() == 400)
-            {
-                type = Exception::BadRequest;
-            }
-            else if(response.code() == 401)
-            {
-                type = Exception::UnauthorizedAccess;
-            }
-            else if(response.code() == 403)
-            {
-                type = Exception::ForbiddenAccess;
-            }
-            else if(response.code() == 404)
-            {
-                type = Exception::ResourceNotFound;
-            }
-            else if(response.code() == 405)
-            {
-                type = Exception::MethodNotAllowed;
-            }
-            else if(response.code() == 409)
-            {
-                type = Exception::ResourceConflict;
-            }
-            else if(response.code() == 410)
-            {
-                type = Exception::ResourceGone;
-            }
-            else
-            {
-                type = Exception::ClientError;
-            }
-        }
-        else if(response.code() >= 500 && response.code() < 600)
+        if(digit > 9)
         {
-            type = Exception::ServerError;
+            *ok = false;
         }
 
-        throw Exception(type, response, message);
+        value = value * 10 + int(digit);
     }
 
-    QByteArray get(QUrl url, bool followRedirects = false, int timeout = DEFAULT_TIMEOUT,
-                   const QHash<QString, QString> &requestHeaders = QHash<QString, QString>())
-    {
-        QByteArray data;
-        CURL *curl = curl_easy_init();
+    return value;
+}
 
-        int result = 0;
+/*!
+ * Parses the xmlschema format that Rails uses for datetimes,
+ * YYYY-MM-DDTHH:MM:SS optionally followed by fractional seconds and then by
+ * either Z or a +HH:MM / -HH:MM offset.  A missing offset is taken to be UTC.
+ * The fields are read in place and the offset is applied arithmetically, so
+ * no temporary strings are created.
+ *
+ * \return The time in UTC, or an invalid QDateTime if \a s isn't in that
+ * format or isn't a valid date.
+ */
 
-        if(curl)
-        {
-            QByteArray encodedUrl = url.toEncoded();
-            QByteArray errorBuffer(CURL_ERROR_SIZE, 0);
-            Response::Headers headers;
+static QDateTime toDateTime(const QString &s)
+{
+    const QChar *c = s.unicode();
+    const int length = s.length();
 
-            struct curl_slist *requestHeaderList = NULL;
-            QHash<QString, QString>::const_iterator it = requestHeaders.constBegin();
-            while(it != requestHeaders.constEnd())
-            {
-                QString header = it.key() + ": " + it.value();
-                requestHeaderList = curl_slist_append(requestHeaderList, header.toUtf8());
-                ++it;
-            }
+    if(length < 19 || c[4] != '-' || c[7] != '-' || (c[10] != 'T' && c[10] != ' ') ||
+       c[13] != ':' || c[16] != ':')
+    {
+        return QDateTime();
+    }
 
-            curl_easy_setopt(curl, CURLOPT_URL, encodedUrl.data());
-            curl_easy_setopt(curl, CURLOPT_WRITEHEADER, (void *) &headers);
-            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writer);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &data);
-            curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
-            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-            curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer.data());
-            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, requestHeaderList);
+    bool ok = true;
 
-            result = curl_easy_perform(curl);
+    int year = toDigits(c, 4, &ok);
+    int month = toDigits(c + 5, 2, &ok);
+    int day = toDigits(c + 8, 2, &ok);
+    int hour = toDigits(c + 11, 2, &ok);
+    int minute = toDigits(c + 14, 2, &ok);
+    int second = toDigits(c + 17, 2, &ok);
+    int msec = 0;
+    int offset = 0;
+    int i = 19;
 
-            long httpCode = 0;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+    if(i < length && c[i] == '.')
+    {
+        int start = ++i;
 
-            if(httpCode >= 300 && httpCode < 400)
-            {
-                if(getenv(QAR_DEBUG))
-                {
-                    qDebug() << (followRedirects ? "Following" : "Not following")
-                             << "redirect from" << url.toString(QUrl::RemoveUserInfo)
-                             << "to" << headers["Location"];
-                }
+        // Digits past milliseconds are accepted, but ignored.
 
-                curl_easy_cleanup(curl);
+        for(int scale = 100; i < length && uint(c[i].unicode()) - '0' <= 9; i++, scale /= 10)
+        {
+            msec += (c[i].unicode() - '0') * scale;
+        }
 
-                if(!followRedirects || headers["Location"].isEmpty())
-                {
-                    Response response(httpCode, headers, data);
-                    throw Exception(Exception::Redirection, response, headers["Location"]);
-                }
-                else
-                {
-                    QString user = url.userName();
-                    QString pass = url.password();
-                    url = headers["Location"];
-                    url.setUserName(user);
-                    url.setPassword(pass);
-                    return get(url);
-                }
-            }
-            else if(result != 0 || httpCode >= 400)
-            {
-                QString message;
+        ok = ok && i > start;
+    }
 
-                if(result != 0)
-                {
-                    QString::fromUtf8(errorBuffer);
-                }
+    if(i < length && c[i] == 'Z')
+    {
+        i++;
+    }
+    else if(i < length && (c[i] == '+' || c[i] == '-'))
+    {
+        int sign = c[i] == '-' ? -1 : 1;
+        int minutesAt = (i + 3 < length && c[i + 3] == ':') ? i + 4 : i + 3;
 
-                curl_easy_cleanup(curl);
-                handleError(result, Response(httpCode, headers, data), message);
-            }
-            else
-            {
-                curl_easy_cleanup(curl);
-            }
+        if(minutesAt + 2 > length)
+        {
+            return QDateTime();
         }
 
-        return data;
-    }
-}
+        int zoneHours = toDigits(c + i + 1, 2, &ok);
+        int zoneMinutes = toDigits(c + minutesAt, 2, &ok);
 
-static QVariant::Type lookupType(const QString &name)
-{
-    static QHash<QString, QVariant::Type> types;
+        ok = ok && zoneHours < 24 && zoneMinutes < 60;
+        offset = sign * (zoneHours * 60 + zoneMinutes) * 60;
+        i = minutesAt + 2;
+    }
 
-    if(types.isEmpty())
+    if(!ok || i != length || hour > 23 || minute > 59 || second > 59)
     {
-        types["integer"] = QVariant::Int;
-        types["decimal"] = QVariant::Double;
-        types["datetime"] = QVariant::DateTime;
-        types["boolean"] = QVariant::Bool;
+        return QDateTime();
     }
 
-    return types.contains(name) ? types[name] : QVariant::String;
-}
+    QDate date(year, month, day);
 
-static void assign(Record *record, QString name, const QVariant &value)
-{
-    (*record)[name.replace('-', '_')] = value;
-}
+    if(!date.isValid())
+    {
+        return QDateTime();
+    }
 
-static QDateTime toDateTime(const QString &s)
-{
-    QDateTime time = QDateTime::fromString(s.left(s.length() - 6), Qt::ISODate);
+    // Offsets are less than a day, so converting to UTC moves the date by at
+    // most one day in either direction.
 
-    time.setTimeSpec(Qt::UTC);
+    int seconds = hour * 3600 + minute * 60 + second - offset;
 
-    int zoneHours = s.mid(s.length() - 6, 3).toInt();
-    int zoneMinutes = s.right(2).toInt();
+    if(seconds < 0)
+    {
+        date = date.addDays(-1);
+        seconds += 86400;
+    }
+    else if(seconds >= 86400)
+    {
+        date = date.addDays(1);
+        seconds -= 86400;
+    }
 
-    return time.addSecs(-1 * (60 * zoneHours + zoneMinutes) * 60);
+    return QDateTime(date, QTime(seconds / 3600, seconds / 60 % 60, seconds % 60, msec), Qt::UTC);
 }
 
 static QString toClassName(QString name)
@@ -234,458 +245,7010 @@ static QString toClassName(QString name)
     return name;
 }
 
-static QVariant extractFromRecord(const QVariant &record)
+/*!
+ * A naive English singular, enough for resource names like "products",
+ * "categories" or "addresses".
+ */
+static QString toSingular(const QString &name)
 {
-    QVariantHash hash = record.toHash();
-    QStringList keys = hash.keys();
-    keys.removeOne(QActiveResourceClassKey);
-    return hash[keys.front()];
+    if(name.endsWith("ies"))
+    {
+        return name.left(name.length() - 3) + "y";
+    }
+    else if(name.endsWith("sses") || name.endsWith("xes") || name.endsWith("ches") ||
+            name.endsWith("shes"))
+    {
+        return name.left(name.length() - 2);
+    }
+    else if(name.endsWith("s") && !name.endsWith("ss"))
+    {
+        return name.left(name.length() - 1);
+    }
+
+    return name;
 }
 
-static bool hasNext(const QXmlStreamReader &xml)
+static bool isRecord(const QVariant &value)
 {
-    return (xml.tokenType() == QXmlStreamReader::StartElement ||
-            (xml.tokenType() == QXmlStreamReader::Characters && xml.isWhitespace()));
+    return value.userType() == qMetaTypeId<Record>();
 }
 
-static QVariant reader(QXmlStreamReader &xml, bool advance, bool isHash)
+static RecordList toRecords(const QVariant &value)
 {
-    Record record;
-    QString elementName;
+    RecordList records;
 
-    while(!xml.atEnd())
+    if(value.type() == QVariant::List)
     {
-        if(advance)
+        foreach(QVariant v, value.toList())
         {
-            xml.readNext();
+            records.append(v);
         }
-        if(xml.tokenType() == QXmlStreamReader::StartElement)
+    }
+    else if(isRecord(value))
+    {
+        Record record = value;
+
+        if(record.size() == 1 && record.begin().value().type() == QVariant::List)
         {
-            if(elementName.isNull())
+            foreach(QVariant v, record.begin().value().toList())
             {
-                elementName = xml.name().toString();
+                records.append(v);
             }
+        }
+        else
+        {
+            records.append(record);
+        }
+    }
+
+    return records;
+}
+
+/*!
+ * The fields selected with Resource::setFields() as a tree of keys.  Decoders
+ * walk it alongside the document: each record or list is at a node of the
+ * tree, and the fields of a record that aren't children of its node are
+ * skipped.  Fields whose whole subtree is selected and everything below them
+ * are at All, so they need no lookups.  The elements of a list are at the
+ * list's node.
+ */
+
+class Projection
+{
+public:
+    enum
+    {
+        All = -1,
+        Skip = -2
+    };
+
+    Projection(const QStringList &fields = QStringList())
+    {
+        if(fields.isEmpty())
+        {
+            return;
+        }
+
+        nodes.append(Node());
 
-            QString type = xml.attributes().value("type").toString();
+        foreach(QString field, fields)
+        {
+            QStringList keys = field.split('.', QString::SkipEmptyParts);
+            int node = 0;
 
-            if(type == "array")
+            for(int i = 0; i < keys.size() && node != All; i++)
             {
-                QString name = xml.name().toString();
-                QVariantList array;
+                QString key = keys[i];
+                key.replace('-', '_');
 
-                while(xml.readNext() && hasNext(xml))
+                if(i == keys.size() - 1)
                 {
-                    if(!xml.isWhitespace())
-                    {
-                        array.append(reader(xml, false, false));
-                    }
+                    nodes[node].children[key] = All;
+                }
+                else if(!nodes[node].children.contains(key))
+                {
+                    nodes.append(Node());
+                    nodes[node].children[key] = nodes.size() - 1;
+                    node = nodes.size() - 1;
+                }
+                else
+                {
+                    node = nodes[node].children[key];
                 }
+            }
+        }
+    }
+
+    /*!
+     * \return The node of the top level records.
+     */
+    int root() const
+    {
+        return nodes.isEmpty() ? All : 0;
+    }
+
+    /*!
+     * \return The node of the field \a key of a record at \a node, or Skip if
+     * it isn't selected.
+     */
+    int child(int node, const QString &key) const
+    {
+        if(node == All)
+        {
+            return All;
+        }
+
+        return nodes[node].children.value(key, Skip);
+    }
+
+private:
+    struct Node
+    {
+        QHash<QString, int> children;
+    };
+
+    QVector<Node> nodes;
+};
+
+/*!
+ * Turns a response body, which is added chunk by chunk as it arrives, into
+ * records.
+ */
+
+class Decoder
+{
+public:
+    virtual ~Decoder()
+    {
+
+    }
+
+    /*!
+     * Called with the body's expected size before any data is added, if the
+     * server sent a Content-Length.
+     */
+    virtual void reserve(int size)
+    {
+        Q_UNUSED(size);
+    }
+
+    /*!
+     * Decodes the \a length bytes at \a data, which are only valid for the
+     * duration of the call.  \return False if the record handler asked to stop.
+     */
+    virtual bool addData(const char *data, int length) = 0;
+
+    /*!
+     * Called once the complete body has been added.
+     */
+    virtual void finish()
+    {
+
+    }
+
+    /*!
+     * \return The decoded records that weren't passed to a record handler.
+     */
+    virtual RecordList records() const = 0;
+};
+
+/*!
+ * Passes \a value to \a builder as events.
+ */
+
+static void build(const QVariant &value, Builder *builder)
+{
+    if(isRecord(value))
+    {
+        Record record = value;
+
+        builder->beginRecord(record.className().toUtf8());
+
+        for(Record::ConstIterator it = record.begin(), last = record.end(); it != last; ++it)
+        {
+            builder->key(it.key().toUtf8());
+            build(it.value(), builder);
+        }
+
+        builder->endRecord();
+        return;
+    }
+
+    switch(value.type())
+    {
+    case QVariant::List:
+        builder->beginList();
+
+        foreach(QVariant element, value.toList())
+        {
+            build(element, builder);
+        }
+
+        builder->endList();
+        break;
+    case QVariant::Invalid:
+        builder->nullValue();
+        break;
+    case QVariant::Bool:
+        builder->boolValue(value.toBool());
+        break;
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+        builder->intValue(value.toLongLong());
+        break;
+    case QVariant::ULongLong:
+        if(value.toULongLong() > quint64(Q_INT64_C(0x7fffffffffffffff)))
+        {
+            builder->doubleValue(value.toDouble());
+        }
+        else
+        {
+            builder->intValue(value.toLongLong());
+        }
+        break;
+    case QVariant::Double:
+        builder->doubleValue(value.toDouble());
+        break;
+    case QVariant::DateTime:
+        builder->dateTimeValue(value.toDateTime());
+        break;
+    default:
+        builder->stringValue(value.toString().toUtf8());
+    }
+}
+
+namespace XML
+{
+    /*!
+     * The same few element names are repeated for every record of a response.
+     * The table converts each distinct name to its key (with dashes replaced by
+     * underscores) and its class name only once; later occurrences are looked up
+     * straight from the reader's QStringRef and get shared copies of the strings.
+     * Each name also remembers the last record decoded for it as a prototype, so
+     * that the following records of the same type share its key shape.  A table
+     * is used by a single decoder, so it needs no locking.
+     */
+
+    class NameTable
+    {
+    public:
+        struct Name
+        {
+            int index;
+            QString raw;
+            QString key;
+            QString className;
+        };
+
+        NameTable() :
+            slots(64, -1)
+        {
+
+        }
+
+        Name lookup(const QStringRef &raw)
+        {
+            uint hash = hashName(raw);
+            int mask = slots.size() - 1;
+
+            for(int i = int(hash) & mask; ; i = (i + 1) & mask)
+            {
+                int index = slots[i];
+
+                if(index < 0)
+                {
+                    return insert(raw, hash, i);
+                }
+
+                const Entry &entry = entries[index];
+
+                if(entry.hash == hash && entry.raw.size() == raw.size() &&
+                   memcmp(entry.raw.unicode(), raw.unicode(), raw.size() * sizeof(QChar)) == 0)
+                {
+                    return entry.name;
+                }
+            }
+        }
+
+        /*!
+         * \return An empty record with the key shape of the last record that
+         * was decoded for \a name.
+         */
+        Record prototype(const Name &name) const
+        {
+            return entries[name.index].prototype.emptyCopy();
+        }
+
+        void learn(const Name &name, const Record &record)
+        {
+            Entry &entry = entries[name.index];
+
+            if(record.size() != entry.fields)
+            {
+                entry.prototype = record.emptyCopy();
+                entry.fields = record.size();
+            }
+        }
+
+    private:
+        struct Entry
+        {
+            QString raw;
+            uint hash;
+            Name name;
+            Record prototype;
+            int fields;
+        };
+
+        static uint hashName(const QStringRef &raw)
+        {
+            uint hash = 2166136261u;
+            const QChar *c = raw.unicode();
+
+            for(int i = 0; i < raw.size(); i++)
+            {
+                hash = (hash ^ c[i].unicode()) * 16777619u;
+            }
+
+            return hash;
+        }
+
+        Name insert(const QStringRef &raw, uint hash, int slot)
+        {
+            Entry entry;
+            entry.raw = raw.toString();
+            entry.hash = hash;
+            entry.fields = 0;
+            entry.name.index = entries.size();
+            entry.name.raw = entry.raw;
+            entry.name.key = entry.raw;
+            entry.name.key.replace('-', '_');
+            entry.name.className = toClassName(entry.raw);
+
+            entries.append(entry);
+            slots[slot] = entries.size() - 1;
+
+            if(entries.size() * 2 > slots.size())
+            {
+                rehash();
+            }
+
+            return entry.name;
+        }
+
+        void rehash()
+        {
+            slots = QVector<int>(slots.size() * 2, -1);
+            int mask = slots.size() - 1;
+
+            for(int index = 0; index < entries.size(); index++)
+            {
+                int i = int(entries[index].hash) & mask;
+
+                while(slots[i] >= 0)
+                {
+                    i = (i + 1) & mask;
+                }
+
+                slots[i] = index;
+            }
+        }
+
+        QVector<int> slots;
+        QVector<Entry> entries;
+    };
+
+    /*!
+     * The UTF-8 bytes of a document that a lazy decoder has read so far, which
+     * its subtrees are decoded from.  Records are handed out while the decoder
+     * is still appending to it, so it's locked.
+     */
+
+    struct Buffer : public QSharedData
+    {
+        QMutex mutex;
+        QByteArray data;
+    };
+
+    /*!
+     * Receives the contents of a document from Decoder in document order.  A
+     * field is key() followed by its value: a scalar passed to value(), a
+     * record between beginRecord() and endRecord() or a list of records between
+     * beginList() and endList().  Top level records, i.e. the root element or
+     * the elements of a root array, are passed without a key.  Names are passed
+     * as they are in the name table, so that each distinct one only needs to be
+     * converted once.
+     */
+
+    class Sink
+    {
+    public:
+        virtual ~Sink()
+        {
+
+        }
+
+        virtual void beginRecord(const NameTable::Name &name) = 0;
+
+        /*!
+         * \return False to stop decoding.
+         */
+        virtual bool endRecord() = 0;
+
+        virtual void beginList() = 0;
+        virtual void endList() = 0;
+        virtual void key(const NameTable::Name &name) = 0;
+        virtual void value(const QVariant &value) = 0;
+    };
+
+    /*!
+     * Builds Records from the contents of a document.  Each record starts out
+     * with the key shape of the last record of the same name.  Top level records
+     * are passed to the handler, if there is one, as soon as they're complete,
+     * but only if they're the elements of a root array: a root record may turn
+     * out to be a wrapper around a list of records (see toRecords()).
+     */
+
+    class RecordSink : public Sink
+    {
+    public:
+        RecordSink(NameTable *table, RecordHandler *recordHandler) :
+            rootIsArray(false),
+            names(table),
+            handler(recordHandler)
+        {
+
+        }
+
+        void beginRecord(const NameTable::Name &name)
+        {
+            Level level;
+            level.name = name;
+            level.field = field;
+            level.isList = false;
+            level.record = names->prototype(name);
+            levels.append(level);
+        }
+
+        bool endRecord()
+        {
+            Level &level = levels.last();
+
+            names->learn(level.name, level.record);
+            level.record.setClassName(level.name.className);
+
+            Record record = level.record;
+            field = level.field;
+            levels.pop_back();
+
+            if(!levels.isEmpty())
+            {
+                add(record);
+            }
+            else if(handler && rootIsArray)
+            {
+                return handler->handle(record);
+            }
+            else
+            {
+                top.append(record);
+            }
+
+            return true;
+        }
+
+        void beginList()
+        {
+            Level level;
+            level.field = field;
+            level.isList = true;
+            levels.append(level);
+        }
+
+        void endList()
+        {
+            QVariantList list = levels.last().list;
+            field = levels.last().field;
+            levels.pop_back();
+            add(list);
+        }
+
+        void key(const NameTable::Name &name)
+        {
+            field = name;
+        }
+
+        void value(const QVariant &value)
+        {
+            add(value);
+        }
+
+        /*!
+         * Sets the field \a name of the current record to \a subtree.
+         */
+        void subtree(const NameTable::Name &name, Record::Subtree *subtree)
+        {
+            levels.last().record.setSubtree(name.key, subtree);
+        }
+
+        /*!
+         * \return The root record, or the records of a root array as a list.
+         */
+        QVariant value() const
+        {
+            if(rootIsArray)
+            {
+                QVariantList list;
+
+                foreach(Record record, top)
+                {
+                    list.append(record);
+                }
+
+                return list;
+            }
+
+            return top.isEmpty() ? QVariant() : QVariant(top.front());
+        }
+
+        RecordList records() const
+        {
+            return rootIsArray ? top : toRecords(value());
+        }
+
+        bool rootIsArray;
+
+    private:
+        struct Level
+        {
+            NameTable::Name name;
+            NameTable::Name field;
+            bool isList;
+            Record record;
+            QVariantList list;
+        };
+
+        void add(const QVariant &value)
+        {
+            Level &level = levels.last();
+
+            if(level.isList)
+            {
+                level.list.append(value);
+            }
+            else
+            {
+                level.record[field.key] = value;
+            }
+        }
+
+        NameTable *names;
+        RecordHandler *handler;
+        QVector<Level> levels;
+        NameTable::Name field;
+        RecordList top;
+    };
+
+    /*!
+     * Passes the contents of a document on to a Builder.  The UTF-8 keys and
+     * class names are converted once per name, indexed by the name's place in
+     * the name table.
+     */
+
+    class BuilderSink : public Sink
+    {
+    public:
+        BuilderSink(Builder *b) :
+            builder(b)
+        {
+
+        }
+
+        void beginRecord(const NameTable::Name &name)
+        {
+            builder->beginRecord(utf8(name).className);
+        }
+
+        bool endRecord()
+        {
+            builder->endRecord();
+            return true;
+        }
+
+        void beginList()
+        {
+            builder->beginList();
+        }
+
+        void endList()
+        {
+            builder->endList();
+        }
+
+        void key(const NameTable::Name &name)
+        {
+            builder->key(utf8(name).key);
+        }
+
+        void value(const QVariant &value)
+        {
+            build(value, builder);
+        }
+
+    private:
+        struct Names
+        {
+            QByteArray key;
+            QByteArray className;
+        };
+
+        const Names &utf8(const NameTable::Name &name)
+        {
+            if(name.index >= names.size())
+            {
+                names.resize(name.index + 1);
+            }
+
+            Names &converted = names[name.index];
+
+            if(converted.key.isNull())
+            {
+                converted.key = name.key.toUtf8();
+                converted.className = name.className.toUtf8();
+            }
+
+            return converted;
+        }
+
+        Builder *builder;
+        QVector<Names> names;
+    };
+
+    /*!
+     * An incremental decoder for ActiveResource's XML format.  Data may be added
+     * in arbitrarily sized chunks as it arrives from the network.  Since the state
+     * of the elements that are currently open is kept on an explicit stack rather
+     * than the call stack, decoding simply stops when the reader runs out of data
+     * and picks up where it left off once more is added.
+     *
+     * The document's contents are passed to a Sink: a RecordSink, or with a
+     * Builder a BuilderSink.  A root record is always built as a Record, so
+     * that it can be unwrapped like with find(), and then returned by
+     * records().
+     *
+     * A lazy decoder doesn't decode the nested records and lists of records.  It
+     * skips their elements and stores a Subtree with their range of the
+     * document's bytes in the record instead.  The reader's character offsets
+     * may be ahead of the current token, so the tags are located by scanning
+     * the bytes in step with the reader's tokens: each element that the reader
+     * starts or ends is the next start or end tag in the bytes.  Documents that
+     * aren't UTF-8 are decoded eagerly.
+     */
+
+    class Decoder : public ::Decoder
+    {
+    public:
+        Decoder(RecordHandler *recordHandler = 0, const Projection &p = Projection(),
+                bool lazy = false) :
+            projection(p),
+            root(p.root()),
+            recordSink(&names, recordHandler),
+            sink(&recordSink),
+            skipDepth(0),
+            stopped(false),
+            scanned(0),
+            tagBegin(-1),
+            tagEnd(-1),
+            selfClosingEnd(-1)
+        {
+            if(lazy)
+            {
+                buffer = new Buffer;
+            }
+        }
+
+        Decoder(Builder *builder, const Projection &p = Projection()) :
+            projection(p),
+            root(p.root()),
+            recordSink(&names, 0),
+            builderSink(new BuilderSink(builder)),
+            sink(&recordSink),
+            skipDepth(0),
+            stopped(false),
+            scanned(0),
+            tagBegin(-1),
+            tagEnd(-1),
+            selfClosingEnd(-1)
+        {
+
+        }
+
+        /*!
+         * Decodes the document as the value at \a node of the projection rather
+         * than as its top level.
+         */
+        void setNode(int node)
+        {
+            root = node;
+        }
+
+        /*!
+         * Decodes the document as if \a namespaces had been declared around it.
+         */
+        void addNamespaceDeclarations(const QXmlStreamNamespaceDeclarations &namespaces)
+        {
+            xml.addExtraNamespaceDeclarations(namespaces);
+        }
+
+        void reserve(int size)
+        {
+            if(buffer)
+            {
+                buffer->data.reserve(size);
+            }
+        }
+
+        /*!
+         * Decodes \a data.  \return False if the handler asked to stop.
+         */
+        bool addData(const char *data, int length)
+        {
+            if(!stopped)
+            {
+                if(buffer)
+                {
+                    buffer->mutex.lock();
+                    buffer->data.append(data, length);
+                    buffer->mutex.unlock();
+                }
+
+                xml.addData(QByteArray(data, length));
+                parse();
+            }
+
+            return !stopped;
+        }
+
+        /*!
+         * \return The root record, or the records of a root array as a list,
+         * if they weren't passed to a handler or builder.
+         */
+        QVariant value() const
+        {
+            return recordSink.value();
+        }
+
+        RecordList records() const
+        {
+            return sink == &recordSink ? recordSink.records() : RecordList();
+        }
+
+    private:
+        struct Frame
+        {
+            enum Type
+            {
+                /*!
+                 * An element whose children are the fields of a record, i.e. an
+                 * array's item or the root element.
+                 */
+                RecordFrame,
+
+                /*!
+                 * An element with type="array".
+                 */
+                ArrayFrame,
+
+                /*!
+                 * A field of a record.  This is a scalar unless it turns out to
+                 * have children, in which case it's a nested record.
+                 */
+                ValueFrame
+            };
+
+            Type type;
+            NameTable::Name name;
+            int node;
+            QString valueType;
+            QString text;
+            bool hasChildren;
+
+            /*!
+             * The offset of the start tag in a lazy decoder's buffer.
+             */
+            int begin;
+
+            /*!
+             * The namespaces declared by the element, kept by a lazy decoder.
+             */
+            QXmlStreamNamespaceDeclarations namespaces;
+        };
+
+        /*!
+         * The nested element that a lazy decoder is skipping.
+         */
+        struct Pending
+        {
+            Pending() : node(0), begin(-1) {}
+            NameTable::Name name;
+            int node;
+            int begin;
+            QXmlStreamNamespaceDeclarations namespaces;
+        };
+
+        void parse()
+        {
+            while(!stopped && !xml.atEnd())
+            {
+                switch(xml.readNext())
+                {
+                case QXmlStreamReader::StartDocument:
+                    if(buffer && !isUtf8())
+                    {
+                        buffer.reset();
+                    }
+                    break;
+                case QXmlStreamReader::DTD:
+                    if(buffer)
+                    {
+                        scanDoctype();
+                    }
+                    break;
+                case QXmlStreamReader::StartElement:
+                    if(!buffer || scanTag(false))
+                    {
+                        startElement();
+                    }
+                    break;
+                case QXmlStreamReader::EndElement:
+                    if(!buffer || scanTag(true))
+                    {
+                        endElement();
+                    }
+                    break;
+                case QXmlStreamReader::Characters:
+                    if(skipDepth == 0 && !stack.isEmpty() && stack.last().type == Frame::ValueFrame)
+                    {
+                        stack.last().text += xml.text();
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            if(xml.hasError() && xml.error() != QXmlStreamReader::PrematureEndOfDocumentError &&
+               getenv(QAR_DEBUG))
+            {
+                qDebug() << "Invalid XML:" << xml.errorString();
+            }
+        }
+
+        void startElement()
+        {
+            if(skipDepth > 0)
+            {
+                skipDepth++;
+                return;
+            }
+
+            QXmlStreamAttributes attributes = xml.attributes();
+            QStringRef type = attributes.value(QLatin1String("type"));
+            bool isArray = type == QLatin1String("array");
+
+            Frame frame;
+            frame.name = names.lookup(xml.name());
+            frame.hasChildren = false;
+            frame.begin = tagBegin;
+
+            if(buffer)
+            {
+                frame.namespaces = xml.namespaceDeclarations();
+            }
+
+            if(stack.isEmpty())
+            {
+                frame.type = isArray ? Frame::ArrayFrame : Frame::RecordFrame;
+                frame.node = root;
+                recordSink.rootIsArray = isArray;
+
+                if(isArray && builderSink)
+                {
+                    sink = builderSink.data();
+                }
+            }
+            else if(stack.last().type == Frame::ArrayFrame)
+            {
+                frame.type = Frame::RecordFrame;
+                frame.node = stack.last().node;
+            }
+            else
+            {
+                Frame &parent = stack.last();
+
+                if(buffer && parent.type == Frame::ValueFrame && !parent.hasChildren &&
+                   stack[stack.size() - 2].type == Frame::RecordFrame)
+                {
+                    // The parent turned out to be a nested record: skip it
+                    // along with this child.
+
+                    pending.name = parent.name;
+                    pending.node = parent.node;
+                    pending.begin = parent.begin;
+                    pending.namespaces = namespaces(stack.size() - 1);
+
+                    stack.pop_back();
+                    skipDepth = 2;
+                    return;
+                }
+
+                if(!parent.hasChildren)
+                {
+                    parent.hasChildren = true;
+
+                    if(parent.type == Frame::ValueFrame)
+                    {
+                        sink->key(parent.name);
+                        sink->beginRecord(parent.name);
+                    }
+                }
+
+                frame.node = projection.child(parent.node, frame.name.key);
+
+                if(frame.node == Projection::Skip)
+                {
+                    skipDepth = 1;
+                    return;
+                }
+
+                if(isArray && buffer && parent.type == Frame::RecordFrame)
+                {
+                    pending.name = frame.name;
+                    pending.node = frame.node;
+                    pending.begin = tagBegin;
+                    pending.namespaces = namespaces(stack.size());
+
+                    skipDepth = 1;
+                    return;
+                }
+
+                if(isArray)
+                {
+                    frame.type = Frame::ArrayFrame;
+                    sink->key(frame.name);
+                    sink->beginList();
+                }
+                else if(attributes.value(QLatin1String("nil")) == QLatin1String("true"))
+                {
+                    sink->key(frame.name);
+                    sink->value(QVariant());
+                    skipDepth = 1;
+                    return;
+                }
+                else
+                {
+                    frame.type = Frame::ValueFrame;
+                    frame.valueType = type.toString();
+                }
+            }
+
+            if(frame.type == Frame::RecordFrame)
+            {
+                sink->beginRecord(frame.name);
+            }
+
+            stack.append(frame);
+        }
+
+        void endElement()
+        {
+            if(skipDepth > 0)
+            {
+                if(--skipDepth == 0 && pending.begin >= 0)
+                {
+                    endPending();
+                }
+
+                return;
+            }
+
+            if(stack.isEmpty())
+            {
+                return;
+            }
+
+            Frame &frame = stack.last();
+
+            if(frame.type == Frame::ArrayFrame)
+            {
+                // The elements of a root array are the top level records.
+
+                if(stack.size() > 1)
+                {
+                    sink->endList();
+                }
+            }
+            else if(frame.type == Frame::RecordFrame || frame.hasChildren)
+            {
+                stopped = !sink->endRecord();
+            }
+            else
+            {
+                sink->key(frame.name);
+                sink->value(toValue(frame.text, frame.valueType));
+            }
+
+            stack.pop_back();
+        }
+
+        /*!
+         * \return The scalar value of an element with \a text whose type
+         * attribute is \a type.  Whitespace is treated as an empty value.
+         */
+        static QVariant toValue(QString &text, const QString &type)
+        {
+            if(isWhitespace(text))
+            {
+                text.clear();
+            }
+
+            switch(lookupType(type))
+            {
+            case QVariant::Int:
+                return toInteger(text);
+            case QVariant::Double:
+                return text.toDouble();
+            case QVariant::DateTime:
+                return toDateTime(text);
+            case QVariant::Bool:
+                return bool(text == "true");
+            default:
+                return text.isEmpty() ? QVariant() : text;
+            }
+        }
+
+        static bool isWhitespace(const QString &text)
+        {
+            for(int i = 0; i < text.length(); i++)
+            {
+                if(!text[i].isSpace())
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        /*!
+         * Stores the element that was just skipped as a subtree of the record
+         * that it's a field of.
+         */
+        void endPending();
+
+        /*!
+         * \return The namespaces declared by the first \a count elements on
+         * the stack.  A subtree is cut out of those elements, so it's decoded
+         * with their declarations in scope.
+         */
+        QXmlStreamNamespaceDeclarations namespaces(int count) const
+        {
+            QXmlStreamNamespaceDeclarations declarations;
+
+            for(int i = 0; i < count; i++)
+            {
+                declarations += stack[i].namespaces;
+            }
+
+            return declarations;
+        }
+
+        /*!
+         * \return True if the document's declared encoding, or the encoding
+         * implied by its first bytes, is UTF-8.
+         */
+        bool isUtf8() const
+        {
+            QString encoding = xml.documentEncoding().toString();
+
+            if(!encoding.isEmpty())
+            {
+                return encoding.compare("UTF-8", Qt::CaseInsensitive) == 0 ||
+                    encoding.compare("UTF8", Qt::CaseInsensitive) == 0;
+            }
+
+            // Without a declaration, only UTF-16 and UTF-32 start with a byte
+            // order mark or a zero byte.
+
+            const QByteArray &data = buffer->data;
+
+            return data.size() < 2 || (uchar(data[0]) != 0xfe && uchar(data[0]) != 0xff &&
+                                       data[0] != 0 && data[1] != 0);
+        }
+
+        /*!
+         * Moves past the next start tag, or with \a isEnd the next end tag, in a
+         * lazy decoder's buffer and stores its range in tagBegin and tagEnd.
+         * Comments, CDATA sections, processing instructions and declarations
+         * are passed over, as are quoted attribute values.  A self-closing tag
+         * is also its element's end tag.  If the tag isn't found the reader's
+         * error is raised rather than storing a subtree with the wrong range.
+         *
+         * \return False on error.
+         */
+        bool scanTag(bool isEnd)
+        {
+            if(isEnd && selfClosingEnd >= 0)
+            {
+                tagEnd = selfClosingEnd;
+                selfClosingEnd = -1;
+                return true;
+            }
+
+            // Only this decoder appends to the buffer, so it's read without
+            // locking.  The tags of the tokens that the reader returned are
+            // complete.
+
+            const char *data = buffer->data.constData();
+            int size = buffer->data.size();
+
+            for(int i = scanned; i < size; i++)
+            {
+                if(data[i] != '<' || i + 1 >= size)
+                {
+                    continue;
+                }
+
+                int end = markupEnd(data, size, i);
+
+                if(end < 0)
+                {
+                    break;
+                }
+
+                if(end > 0)
+                {
+                    i = end - 1;
+                    continue;
+                }
+
+                if((data[i + 1] == '/') != isEnd)
+                {
+                    break;
+                }
+
+                char quote = 0;
+
+                for(int j = i + 1; j < size; j++)
+                {
+                    if(quote)
+                    {
+                        quote = data[j] == quote ? 0 : quote;
+                    }
+                    else if(data[j] == '"' || data[j] == '\'')
+                    {
+                        quote = data[j];
+                    }
+                    else if(data[j] == '>')
+                    {
+                        tagBegin = i;
+                        tagEnd = j + 1;
+                        scanned = j + 1;
+
+                        if(!isEnd && data[j - 1] == '/')
+                        {
+                            selfClosingEnd = tagEnd;
+                        }
+
+                        return true;
+                    }
+                }
+
+                break;
+            }
+
+            xml.raiseError(QString("Couldn't find the %1 tag of %2 at %3")
+                           .arg(isEnd ? "end" : "start").arg(xml.name().toString())
+                           .arg(scanned));
+            return false;
+        }
+
+        /*!
+         * Moves past the document type declaration in a lazy decoder's buffer
+         * and keeps it, so that the entities and default attributes declared
+         * in its internal subset also apply to subtrees.  If it isn't found the
+         * document is decoded eagerly.
+         */
+        void scanDoctype()
+        {
+            const char *data = buffer->data.constData();
+            int size = buffer->data.size();
+
+            for(int i = scanned; i + 1 < size; i++)
+            {
+                if(data[i] != '<')
+                {
+                    continue;
+                }
+
+                int end = markupEnd(data, size, i);
+
+                if(end <= 0)
+                {
+                    break;
+                }
+
+                if(end - i > 9 && memcmp(data + i, "<!DOCTYPE", 9) == 0)
+                {
+                    doctype = buffer->data.mid(i, end - i);
+                    scanned = end;
+                    return;
+                }
+
+                i = end - 1;
+            }
+
+            buffer.reset();
+        }
+
+        /*!
+         * \return The offset just past the comment, CDATA section, processing
+         * instruction or declaration that starts with the '<' at \a from in the
+         * \a size bytes at \a data, 0 if a tag starts there or -1 if it isn't
+         * complete.
+         */
+        static int markupEnd(const char *data, int size, int from)
+        {
+            const char *next = data + from + 1;
+            const char *close = 0;
+
+            if(*next == '?')
+            {
+                close = "?>";
+            }
+            else if(size - from >= 4 && memcmp(next, "!--", 3) == 0)
+            {
+                close = "-->";
+            }
+            else if(size - from >= 9 && memcmp(next, "![CDATA[", 8) == 0)
+            {
+                close = "]]>";
+            }
+            else if(*next == '!')
+            {
+                return declarationEnd(data, size, from);
+            }
+            else
+            {
+                return 0;
+            }
+
+            const char *end = find(data, size, from + 1, close);
+
+            return end ? int(end - data) + int(strlen(close)) : -1;
+        }
+
+        /*!
+         * \return The offset just past the declaration at \a from, as with
+         * markupEnd().  Quoted literals and a document type's internal subset,
+         * including the declarations and comments in it, may contain '>'.
+         */
+        static int declarationEnd(const char *data, int size, int from)
+        {
+            char quote = 0;
+            bool subset = false;
+
+            for(int i = from + 2; i < size; i++)
+            {
+                if(quote)
+                {
+                    quote = data[i] == quote ? 0 : quote;
+                }
+                else if(data[i] == '"' || data[i] == '\'')
+                {
+                    quote = data[i];
+                }
+                else if(subset && data[i] == '<' && i + 1 < size)
+                {
+                    int end = markupEnd(data, size, i);
+
+                    if(end < 0)
+                    {
+                        return -1;
+                    }
+
+                    i = qMax(i, end - 1);
+                }
+                else if(data[i] == '[')
+                {
+                    subset = true;
+                }
+                else if(data[i] == ']')
+                {
+                    subset = false;
+                }
+                else if(data[i] == '>' && !subset)
+                {
+                    return i + 1;
+                }
+            }
+
+            return -1;
+        }
+
+        /*!
+         * \return The first occurrence of \a string in the \a size bytes at \a
+         * data at or after \a from, or 0.
+         */
+        static const char *find(const char *data, int size, int from, const char *string)
+        {
+            int length = int(strlen(string));
+
+            for(int i = from; i + length <= size; i++)
+            {
+                if(data[i] == string[0] && memcmp(data + i, string, length) == 0)
+                {
+                    return data + i;
+                }
+            }
+
+            return 0;
+        }
+
+        QXmlStreamReader xml;
+        NameTable names;
+        Projection projection;
+        int root;
+        RecordSink recordSink;
+        QScopedPointer<BuilderSink> builderSink;
+        Sink *sink;
+        QVector<Frame> stack;
+        int skipDepth;
+        bool stopped;
+        QExplicitlySharedDataPointer<Buffer> buffer;
+        int scanned;
+        int tagBegin;
+        int tagEnd;
+        int selfClosingEnd;
+        Pending pending;
+        QByteArray doctype;
+    };
+
+    /*!
+     * A nested record or list that a lazy decoder skipped, which is decoded
+     * from its range of the document's bytes with a decoder of its own.  The
+     * range is preceded by the document type declaration, if there is one, and
+     * decoded with the namespaces declared by the elements around it.
+     */
+
+    class Subtree : public Record::Subtree
+    {
+    public:
+        Subtree(const QExplicitlySharedDataPointer<Buffer> &b, int from, int to,
+                const Projection &p, int n, const QByteArray &d,
+                const QXmlStreamNamespaceDeclarations &ns) :
+            buffer(b),
+            begin(from),
+            end(to),
+            projection(p),
+            node(n),
+            doctype(d),
+            namespaces(ns)
+        {
+
+        }
+
+        int encodedSize() const
+        {
+            return end - begin;
+        }
+
+    protected:
+        QVariant decode() const
+        {
+            buffer->mutex.lock();
+            QByteArray data = buffer->data.mid(begin, end - begin);
+            buffer->mutex.unlock();
+
+            Decoder decoder(static_cast<RecordHandler *>(0), projection);
+            decoder.setNode(node);
+            decoder.addNamespaceDeclarations(namespaces);
+
+            if(!doctype.isEmpty())
+            {
+                decoder.addData(doctype.constData(), doctype.size());
+            }
+
+            decoder.addData(data.constData(), data.size());
+
+            return decoder.value();
+        }
+
+    private:
+        QExplicitlySharedDataPointer<Buffer> buffer;
+        int begin;
+        int end;
+        Projection projection;
+        int node;
+        QByteArray doctype;
+        QXmlStreamNamespaceDeclarations namespaces;
+    };
+
+    void Decoder::endPending()
+    {
+        recordSink.subtree(pending.name, new Subtree(buffer, pending.begin, tagEnd,
+                                                     projection, pending.node, doctype,
+                                                     pending.namespaces));
+        pending.begin = -1;
+        pending.namespaces.clear();
+    }
+}
+
+namespace JSON
+{
+    /*!
+     * A decoder for ActiveResource's JSON format.  JSON has no element names, so
+     * the class names of records are derived from the keys they're stored under
+     * (singularized for the elements of arrays) and for the top level records from
+     * the resource's name.  Like ActiveResource, a top level object with a single
+     * key is treated as the root wrapping the actual data.
+     *
+     * The body is buffered and decoded once it is complete, but top level records
+     * are still passed to the record handler and dropped one at a time.
+     *
+     * The values of fields that aren't selected by the projection are skipped
+     * by scanning for their end without decoding them.  Since a top level
+     * object may be a wrapper around the actual records, the wrapper is found
+     * first when projecting, so that the projection applies to the records.
+     */
+
+    class Decoder : public ::Decoder
+    {
+    public:
+        Decoder(const QString &resource, RecordHandler *recordHandler = 0,
+                const Projection &p = Projection()) :
+            elementName(toSingular(resource)),
+            projection(p),
+            handler(recordHandler),
+            position(0),
+            end(0),
+            error(false),
+            stopped(false)
+        {
+
+        }
+
+        void reserve(int size)
+        {
+            buffer.reserve(size);
+        }
+
+        bool addData(const char *data, int length)
+        {
+            buffer.append(data, length);
+            return true;
+        }
+
+        void finish()
+        {
+            position = buffer.constData();
+            end = position + buffer.size();
+
+            skipWhitespace();
+
+            if(position >= end)
+            {
+                return;
+            }
+
+            if(*position == '[')
+            {
+                parseRecords(toClassName(elementName), true);
+            }
+            else if(*position == '{')
+            {
+                const char *start = position;
+                QString key;
+                char wrapped = wrapper(&key);
+
+                if(wrapped == '[')
+                {
+                    parseRecords(toClassName(fromKey(toSingular(key))), false);
+                    next('}');
+                }
+                else if(wrapped == '{')
+                {
+                    append(parseObject(toClassName(fromKey(key)), projection.root()));
+                    next('}');
+                }
+                else
+                {
+                    position = start;
+                    error = false;
+                    parseRoot();
+                }
+            }
+            else
+            {
+                error = true;
+            }
+
+            if(error && getenv(QAR_DEBUG))
+            {
+                qDebug() << "Invalid JSON at offset" << int(position - buffer.constData());
+            }
+
+            buffer.clear();
+        }
+
+        RecordList records() const
+        {
+            return result;
+        }
+
+    private:
+        /*!
+         * Parses a top level object that isn't known to be a wrapper.
+         */
+        void parseRoot()
+        {
+            Record record = parseObject(toClassName(elementName), projection.root());
+
+            if(record.size() == 1 && record.begin().value().type() == QVariant::List)
+            {
+                foreach(QVariant v, record.begin().value().toList())
+                {
+                    if(!append(v))
+                    {
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                append(unwrap(record));
+            }
+        }
+
+        /*!
+         * Passes \a value to the handler or stores it.  \return False if the handler
+         * asked to stop.
+         */
+        bool append(const QVariant &value)
+        {
+            if(stopped || !isRecord(value))
+            {
+                return !stopped;
+            }
+
+            Record record = value;
+
+            if(handler)
+            {
+                stopped = !handler->handle(record);
+            }
+            else
+            {
+                result.append(record);
+            }
+
+            return !stopped;
+        }
+
+        /*!
+         * Strips the root from objects of the form { "product": { ... } }.
+         */
+        static Record unwrap(const Record &record)
+        {
+            if(record.size() == 1 && isRecord(record.begin().value()))
+            {
+                return record.begin().value();
+            }
+
+            return record;
+        }
+
+        /*!
+         * If projecting and the object at the current position has a single
+         * field whose value is an array or an object, moves to that value and
+         * stores the field's key in \a key.  \return The value's first
+         * character, or 0 if the object isn't such a wrapper.  The position and
+         * error state are then undefined.
+         */
+        char wrapper(QString *key)
+        {
+            if(projection.root() == Projection::All)
+            {
+                return 0;
+            }
+
+            position++;
+            skipWhitespace();
+
+            if(position >= end || *position != '"')
+            {
+                return 0;
+            }
+
+            *key = parseString();
+            skipWhitespace();
+
+            if(position >= end || *position != ':')
+            {
+                return 0;
+            }
+
+            position++;
+            skipWhitespace();
+
+            const char *value = position;
+
+            if(position >= end || (*value != '[' && *value != '{'))
+            {
+                return 0;
+            }
+
+            skipValue();
+            skipWhitespace();
+
+            if(position >= end || *position != '}')
+            {
+                return 0;
+            }
+
+            position = value;
+            return *value;
+        }
+
+        /*!
+         * Parses a top level record at the current position, which may be
+         * wrapped in an object with a single key, e.g. { "product": { ... } }.
+         */
+        Record parseRecord(const QString &className)
+        {
+            const char *start = position;
+            QString key;
+
+            if(wrapper(&key) == '{')
+            {
+                Record record = parseObject(toClassName(fromKey(key)), projection.root());
+                next('}');
+                return record;
+            }
+
+            position = start;
+            error = false;
+            return unwrap(parseObject(className, projection.root()));
+        }
+
+        /*!
+         * Parses an array of top level records of \a className.  Elements that
+         * are wrapped are unwrapped if \a unwrapElements is true.
+         */
+        void parseRecords(const QString &className, bool unwrapElements)
+        {
+            position++;
+            skipWhitespace();
+
+            if(position < end && *position == ']')
+            {
+                position++;
+                return;
+            }
+
+            while(!error && position < end)
+            {
+                skipWhitespace();
+
+                if(position < end && *position == '{')
+                {
+                    Record record = unwrapElements ? parseRecord(className) :
+                        parseObject(className, projection.root());
+
+                    if(!append(record))
+                    {
+                        return;
+                    }
+                }
+                else
+                {
+                    skipValue();
+                }
+
+                if(!next(']'))
+                {
+                    return;
+                }
+            }
+        }
+
+        QVariant parseValue(const QString &key, int node)
+        {
+            skipWhitespace();
+
+            if(position >= end)
+            {
+                error = true;
+                return QVariant();
+            }
+
+            switch(*position)
+            {
+            case '{':
+                return parseObject(toClassName(fromKey(key)), node);
+            case '[':
+                return parseArray(key, node);
+            case '"':
+                return toValue(parseString());
+            case 't':
+                return literal("true", true);
+            case 'f':
+                return literal("false", false);
+            case 'n':
+                return literal("null", QVariant());
+            default:
+                return parseNumber();
+            }
+        }
+
+        /*!
+         * Parses an object as a record at \a node of the projection.
+         */
+        Record parseObject(const QString &className, int node)
+        {
+            // Start from the last record of the same class so that the keys
+            // are shared when they come in the same order.
+
+            Record record = prototypes.value(className).record.emptyCopy();
+            record.setClassName(className);
+
+            position++;
+            skipWhitespace();
+
+            if(position < end && *position == '}')
+            {
+                position++;
+                return record;
+            }
+
+            while(!error && position < end)
+            {
+                skipWhitespace();
+
+                if(position >= end || *position != '"')
+                {
+                    error = true;
+                    break;
+                }
+
+                QString key = parseString();
+
+                skipWhitespace();
+
+                if(position >= end || *position != ':')
+                {
+                    error = true;
+                    break;
+                }
+
+                position++;
+
+                int child = node == Projection::All ? Projection::All :
+                    projection.child(node, QString(key).replace('-', '_'));
+
+                if(child == Projection::Skip)
+                {
+                    skipValue();
+                }
+                else
+                {
+                    assign(&record, key, parseValue(key, child));
+                }
+
+                if(!next('}'))
+                {
+                    break;
+                }
+            }
+
+            Prototype &prototype = prototypes[className];
+
+            if(record.size() != prototype.fields)
+            {
+                prototype.record = record.emptyCopy();
+                prototype.fields = record.size();
+            }
+
+            return record;
+        }
+
+        QVariantList parseArray(const QString &key, int node)
+        {
+            QVariantList list;
+            QString className = toClassName(fromKey(toSingular(key)));
+
+            position++;
+            skipWhitespace();
+
+            if(position < end && *position == ']')
+            {
+                position++;
+                return list;
+            }
+
+            while(!error && position < end)
+            {
+                skipWhitespace();
+
+                if(position < end && *position == '{')
+                {
+                    list.append(parseObject(className, node));
+                }
+                else
+                {
+                    list.append(parseValue(key, node));
+                }
+
+                if(!next(']'))
+                {
+                    break;
+                }
+            }
+
+            return list;
+        }
+
+        /*!
+         * Skips the separator after an element of an array or object.  \return
+         * False if \a close, the end of the container, was reached instead.
+         */
+        bool next(char close)
+        {
+            skipWhitespace();
+
+            if(position < end && *position == ',')
+            {
+                position++;
+                return true;
+            }
+
+            if(position < end && *position == close)
+            {
+                position++;
+            }
+            else
+            {
+                error = true;
+            }
+
+            return false;
+        }
+
+        /*!
+         * Moves past the value at the current position without decoding it:
+         * strings are scanned for their closing quote and arrays and objects for
+         * their closing bracket.  A scalar ends where the separator or end of
+         * its container begins.
+         */
+        void skipValue()
+        {
+            int depth = 0;
+
+            skipWhitespace();
+
+            while(position < end)
+            {
+                char c = *position++;
+
+                if(c == '"')
+                {
+                    while(position < end && *position != '"')
+                    {
+                        if(*position == '\\' && position + 1 < end)
+                        {
+                            position++;
+                        }
+
+                        position++;
+                    }
+
+                    if(position >= end)
+                    {
+                        break;
+                    }
+
+                    position++;
+                }
+                else if(c == '{' || c == '[')
+                {
+                    depth++;
+                    continue;
+                }
+                else if(c == '}' || c == ']' || c == ',')
+                {
+                    if(depth == 0)
+                    {
+                        position--;
+                        return;
+                    }
+
+                    if(c == ',')
+                    {
+                        continue;
+                    }
+
+                    depth--;
+                }
+                else
+                {
+                    continue;
+                }
+
+                if(depth == 0)
+                {
+                    return;
+                }
+            }
+
+            error = true;
+        }
+
+        QString parseString()
+        {
+            const char *start = ++position;
+
+            while(position < end && *position != '"' && *position != '\\')
+            {
+                position++;
+            }
+
+            if(position < end && *position == '"')
+            {
+                return QString::fromUtf8(start, int(position++ - start));
+            }
+
+            QByteArray bytes(start, int(position - start));
+
+            while(position < end && *position != '"')
+            {
+                if(*position != '\\')
+                {
+                    bytes.append(*position++);
+                    continue;
+                }
+
+                if(++position >= end)
+                {
+                    break;
+                }
+
+                switch(*position++)
+                {
+                case 'b':
+                    bytes.append('\b');
+                    break;
+                case 'f':
+                    bytes.append('\f');
+                    break;
+                case 'n':
+                    bytes.append('\n');
+                    break;
+                case 'r':
+                    bytes.append('\r');
+                    break;
+                case 't':
+                    bytes.append('\t');
+                    break;
+                case 'u':
+                    appendUtf8(&bytes, parseCodePoint());
+                    break;
+                default:
+                    bytes.append(position[-1]);
+                }
+            }
+
+            if(position < end)
+            {
+                position++;
+            }
+            else
+            {
+                error = true;
+            }
+
+            return QString::fromUtf8(bytes);
+        }
+
+        /*!
+         * Reads the hex digits of a \uXXXX escape, combining surrogate pairs.
+         */
+        uint parseCodePoint()
+        {
+            uint code = parseHex();
+
+            if(code >= 0xd800 && code <= 0xdbff && end - position >= 6 &&
+               position[0] == '\\' && position[1] == 'u')
+            {
+                position += 2;
+                uint low = parseHex();
+
+                if(low >= 0xdc00 && low <= 0xdfff)
+                {
+                    return 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+
+                return 0xfffd;
+            }
+
+            return (code >= 0xd800 && code <= 0xdfff) ? 0xfffd : code;
+        }
+
+        uint parseHex()
+        {
+            uint code = 0;
+
+            for(int i = 0; i < 4; i++, position++)
+            {
+                if(position >= end)
+                {
+                    error = true;
+                    return 0xfffd;
+                }
+
+                char c = *position;
+                code <<= 4;
+
+                if(c >= '0' && c <= '9')
+                {
+                    code |= c - '0';
+                }
+                else if(c >= 'a' && c <= 'f')
+                {
+                    code |= c - 'a' + 10;
+                }
+                else if(c >= 'A' && c <= 'F')
+                {
+                    code |= c - 'A' + 10;
+                }
+                else
+                {
+                    error = true;
+                    return 0xfffd;
+                }
+            }
+
+            return code;
+        }
+
+        static void appendUtf8(QByteArray *bytes, uint code)
+        {
+            if(code < 0x80)
+            {
+                bytes->append(char(code));
+            }
+            else if(code < 0x800)
+            {
+                bytes->append(char(0xc0 | (code >> 6)));
+                bytes->append(char(0x80 | (code & 0x3f)));
+            }
+            else if(code < 0x10000)
+            {
+                bytes->append(char(0xe0 | (code >> 12)));
+                bytes->append(char(0x80 | ((code >> 6) & 0x3f)));
+                bytes->append(char(0x80 | (code & 0x3f)));
+            }
+            else
+            {
+                bytes->append(char(0xf0 | (code >> 18)));
+                bytes->append(char(0x80 | ((code >> 12) & 0x3f)));
+                bytes->append(char(0x80 | ((code >> 6) & 0x3f)));
+                bytes->append(char(0x80 | (code & 0x3f)));
+            }
+        }
+
+        QVariant parseNumber()
+        {
+            const char *start = position;
+            bool isInteger = true;
+
+            if(position < end && *position == '-')
+            {
+                position++;
+            }
+
+            while(position < end && *position >= '0' && *position <= '9')
+            {
+                position++;
+            }
+
+            while(position < end && (*position == '.' || *position == 'e' || *position == 'E' ||
+                                     *position == '+' || *position == '-' ||
+                                     (*position >= '0' && *position <= '9')))
+            {
+                isInteger = false;
+                position++;
+            }
+
+            int length = int(position - start);
+
+            if(length == 0 || (length == 1 && *start == '-'))
+            {
+                error = true;
+                return QVariant();
+            }
+
+            if(isInteger && length < 19)
+            {
+                qlonglong value = 0;
+
+                for(const char *c = (*start == '-') ? start + 1 : start; c < position; c++)
+                {
+                    value = value * 10 + (*c - '0');
+                }
+
+                if(*start == '-')
+                {
+                    value = -value;
+                }
+
+                if(value >= -2147483647LL - 1 && value <= 2147483647LL)
+                {
+                    return int(value);
+                }
+
+                return value;
+            }
+
+            return QByteArray(start, length).toDouble();
+        }
+
+        QVariant literal(const char *word, const QVariant &value)
+        {
+            int length = int(strlen(word));
+
+            if(end - position < length || strncmp(position, word, length) != 0)
+            {
+                error = true;
+                return QVariant();
+            }
+
+            position += length;
+            return value;
+        }
+
+        /*!
+         * Strings that are timestamps as written by Rails are converted to
+         * QDateTime to match the typed values of the XML format.
+         */
+        static QVariant toValue(const QString &s)
+        {
+            if(s.length() >= 19 && s[4] == '-' && s[10] == 'T')
+            {
+                QDateTime time = toDateTime(s);
+
+                if(time.isValid())
+                {
+                    return time;
+                }
+            }
+
+            return s;
+        }
+
+        struct Prototype
+        {
+            Prototype() : fields(0) {}
+            Record record;
+            int fields;
+        };
+
+        /*!
+         * JSON keys use underscores where XML element names use dashes.
+         */
+        static QString fromKey(QString key)
+        {
+            return key.replace('_', '-');
+        }
+
+        void skipWhitespace()
+        {
+            while(position < end && (*position == ' ' || *position == '\n' ||
+                                     *position == '\r' || *position == '\t'))
+            {
+                position++;
+            }
+        }
+
+        QString elementName;
+        Projection projection;
+        RecordHandler *handler;
+        QHash<QString, Prototype> prototypes;
+        QByteArray buffer;
+        const char *position;
+        const char *end;
+        bool error;
+        bool stopped;
+        RecordList result;
+    };
+}
+
+/*!
+ * \return A decoder for \a format.  With a \a builder, XML is passed to it
+ * directly, while other formats pass their records to \a handler, which should
+ * build them.  Lazy decoding doesn't apply to builders.
+ */
+
+static Decoder *createDecoder(Format format, const QString &resource, RecordHandler *handler,
+                              const QStringList &fields = QStringList(), bool lazy = false,
+                              Builder *builder = 0)
+{
+    if(format == JsonFormat)
+    {
+        return new JSON::Decoder(resource, handler, Projection(fields));
+    }
+
+    if(builder)
+    {
+        return new XML::Decoder(builder, Projection(fields));
+    }
+
+    return new XML::Decoder(handler, Projection(fields), lazy);
+}
+
+/*!
+ * Passes records to a Builder for decoders that don't produce events.
+ */
+
+class BuildingHandler : public RecordHandler
+{
+public:
+    BuildingHandler(Builder *b) :
+        builder(b)
+    {
+
+    }
+
+    bool handle(const Record &record)
+    {
+        build(record, builder);
+        return true;
+    }
+
+    Builder *builder;
+};
+
+/*!
+ * Passes records on to another handler while counting them.
+ */
+
+class CountingHandler : public RecordHandler
+{
+public:
+    CountingHandler(RecordHandler *handler) :
+        target(handler),
+        count(0)
+    {
+
+    }
+
+    bool handle(const Record &record)
+    {
+        count++;
+        return target->handle(record);
+    }
+
+    RecordHandler *target;
+    int count;
+};
+
+/*!
+ * Passes events on to another builder while counting the top level records.
+ */
+
+class CountingBuilder : public Builder
+{
+public:
+    CountingBuilder(Builder *builder) :
+        target(builder),
+        depth(0),
+        count(0)
+    {
+
+    }
+
+    void beginRecord(const QByteArray &className)
+    {
+        depth++;
+        target->beginRecord(className);
+    }
+
+    void endRecord()
+    {
+        if(--depth == 0)
+        {
+            count++;
+        }
+
+        target->endRecord();
+    }
+
+    void beginList()
+    {
+        depth++;
+        target->beginList();
+    }
+
+    void endList()
+    {
+        depth--;
+        target->endList();
+    }
+
+    void key(const QByteArray &key) { target->key(key); }
+    void nullValue() { target->nullValue(); }
+    void stringValue(const QByteArray &value) { target->stringValue(value); }
+    void intValue(qint64 value) { target->intValue(value); }
+    void doubleValue(double value) { target->doubleValue(value); }
+    void boolValue(bool value) { target->boolValue(value); }
+    void dateTimeValue(const QDateTime &value) { target->dateTimeValue(value); }
+
+    Builder *target;
+    int depth;
+    int count;
+};
+
+/*!
+ * Finishes \a decoder and returns its records.  Decoders only pass the
+ * elements of a root array to their handler, so any other records are passed
+ * to \a handler here.
+ */
+
+static RecordList finishDecoding(Decoder *decoder, RecordHandler *handler)
+{
+    decoder->finish();
+
+    RecordList records = decoder->records();
+
+    if(handler)
+    {
+        foreach(Record record, records)
+        {
+            if(!handler->handle(record))
+            {
+                break;
+            }
+        }
+
+        return RecordList();
+    }
+
+    return records;
+}
+
+namespace HTTP
+{
+    /*!
+     * Shares the connection, DNS and SSL session caches between pooled handles.
+     * A handle added to a multi handle otherwise uses the multi handle's
+     * connections, which are closed along with it, so transfers run together,
+     * as in a Batch, hedged requests, page prefetching and findAsync(), would
+     * never reuse a connection.  Connections can only be shared from libcurl
+     * 7.57.0 on; older versions still share DNS lookups and SSL sessions.  The
+     * caches are freed along with the last handle using them.
+     */
+
+    class Share : public QSharedData
+    {
+    public:
+        Share() :
+            handle(curl_share_init())
+        {
+            curl_share_setopt(handle, CURLSHOPT_LOCKFUNC, lock);
+            curl_share_setopt(handle, CURLSHOPT_UNLOCKFUNC, unlock);
+            curl_share_setopt(handle, CURLSHOPT_USERDATA, (void *) this);
+            curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+            curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+        }
+
+        ~Share()
+        {
+            curl_share_cleanup(handle);
+        }
+
+        CURLSH *handle;
+
+    private:
+        static void lock(CURL *, curl_lock_data data, curl_lock_access, void *share)
+        {
+            reinterpret_cast<Share *>(share)->locks[data].lock();
+        }
+
+        static void unlock(CURL *, curl_lock_data data, void *share)
+        {
+            reinterpret_cast<Share *>(share)->locks[data].unlock();
+        }
+
+        QMutex locks[CURL_LOCK_DATA_LAST];
+    };
+
+    /*!
+     * Keeps finished CURL handles around for later requests and attaches the
+     * handles it hands out to a Share, so that their connections, DNS and SSL
+     * session caches are kept whether they're performed on their own or in a
+     * multi handle.  Handles are reset and detached from the Share before
+     * they're put back.  clear() starts a new Share, so the old connections are
+     * closed as soon as the transfers still using them finish.
+     */
+
+    class Pool
+    {
+    public:
+        Pool() :
+            maxSize(DEFAULT_POOL_SIZE),
+            idleTimeout(DEFAULT_POOL_IDLE_TIMEOUT),
+            share(new Share)
+        {
+
+        }
+
+        ~Pool()
+        {
+            clear();
+        }
+
+        /*!
+         * \return A handle attached to the current Share, which is kept alive
+         * by \a handleShare for as long as the handle is attached to it.  No
+         * Share is used if connection reuse is disabled.
+         */
+        CURL *acquire(QExplicitlySharedDataPointer<Share> *handleShare)
+        {
+            QMutexLocker locker(&mutex);
+
+            expire();
+
+            CURL *handle = idle.isEmpty() ? 0 : idle.takeLast().handle;
+            int connections = maxSize;
+            int age = idleTimeout;
+
+            if(connections > 0)
+            {
+                *handleShare = share;
+            }
+
+            locker.unlock();
+
+            if(!handle)
+            {
+                handle = curl_easy_init();
+            }
+
+            if(handle && connections > 0)
+            {
+                curl_easy_setopt(handle, CURLOPT_SHARE, (*handleShare)->handle);
+                curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, long(connections));
+#if LIBCURL_VERSION_NUM >= 0x074100
+                curl_easy_setopt(handle, CURLOPT_MAXAGE_CONN, long(age));
+#else
+                Q_UNUSED(age);
+#endif
+            }
+
+            return handle;
+        }
+
+        void release(CURL *handle)
+        {
+            curl_easy_setopt(handle, CURLOPT_SHARE, (CURLSH *) 0);
+            curl_easy_reset(handle);
+
+            QMutexLocker locker(&mutex);
+
+            expire();
+
+            if(idle.size() < maxSize)
+            {
+                Entry entry = { handle, time(0) };
+                idle.append(entry);
+                return;
+            }
+
+            locker.unlock();
+
+            curl_easy_cleanup(handle);
+        }
+
+        void clear()
+        {
+            QMutexLocker locker(&mutex);
+
+            while(!idle.isEmpty())
+            {
+                curl_easy_cleanup(idle.takeFirst().handle);
+            }
+
+            share = QExplicitlySharedDataPointer<Share>(new Share);
+        }
+
+        /*!
+         * Frees the handles that have been idle for longer than the timeout.
+         * Entries are appended on release, so the oldest ones are at the front.
+         * Must be called with the mutex held.
+         */
+        void expire()
+        {
+            time_t limit = time(0) - idleTimeout;
+
+            while(!idle.isEmpty() && (idle.front().released < limit ||
+                                      idle.size() > maxSize))
+            {
+                curl_easy_cleanup(idle.takeFirst().handle);
+            }
+        }
+
+        struct Entry
+        {
+            CURL *handle;
+            time_t released;
+        };
+
+        QMutex mutex;
+        QList<Entry> idle;
+        int maxSize;
+        int idleTimeout;
+        QExplicitlySharedDataPointer<Share> share;
+    };
+
+    Q_GLOBAL_STATIC(Pool, pool)
+
+    /*!
+     * Initializes libcurl when the library is loaded, before any other threads
+     * can be using it, since curl_global_init() isn't thread safe.  It's never
+     * cleaned up, as pooled handles may outlive this object at exit.
+     */
+
+    class Global
+    {
+    public:
+        Global()
+        {
+            curl_global_init(CURL_GLOBAL_ALL);
+        }
+    };
+
+    static Global global;
+
+    /*!
+     * Borrows a handle from the pool for the lifetime of the object.
+     */
+
+    class Connection
+    {
+    public:
+        Connection() :
+            handle(0)
+        {
+            handle = pool() ? pool()->acquire(&share) : curl_easy_init();
+        }
+
+        ~Connection()
+        {
+            if(!handle)
+            {
+                return;
+            }
+
+            if(pool())
+            {
+                pool()->release(handle);
+            }
+            else
+            {
+                curl_easy_cleanup(handle);
+            }
+        }
+
+        CURL *handle;
+
+    private:
+        QExplicitlySharedDataPointer<Share> share;
+
+        Connection(const Connection &);
+        Connection &operator=(const Connection &);
+    };
+
+    void handleError(int result, const Response &response, const QString &message)
+    {
+        Exception::Type type = Exception::ConnectionError;
+
+        if(result == CURLE_OPERATION_TIMEOUTED)
+        {
+            type = Exception::TimeoutError;
+        }
+        else if(result == CURLE_SSL_CONNECT_ERROR)
+        {
+            type = Exception::SSLError;
+        }
+        else if(response.code() >= 400 && response.code() <= 499)
+        {
+            if(response.code() == 400)
+            {
+                type = Exception::BadRequest;
+            }
+            else if(response.code() == 401)
+            {
+                type = Exception::UnauthorizedAccess;
+            }
+            else if(response.code() == 403)
+            {
+                type = Exception::ForbiddenAccess;
+            }
+            else if(response.code() == 404)
+            {
+                type = Exception::ResourceNotFound;
+            }
+            else if(response.code() == 405)
+            {
+                type = Exception::MethodNotAllowed;
+            }
+            else if(response.code() == 409)
+            {
+                type = Exception::ResourceConflict;
+            }
+            else if(response.code() == 410)
+            {
+                type = Exception::ResourceGone;
+            }
+            else
+            {
+                type = Exception::ClientError;
+            }
+        }
+        else if(response.code() >= 500 && response.code() < 600)
+        {
+            type = Exception::ServerError;
+        }
+
+        throw Exception(type, response, message);
+    }
+
+    /*!
+     * \return The value of the Accept-Encoding header for \a encodings, limited
+     * to those the installed libcurl can decompress.
+     */
+
+    QByteArray acceptEncoding(Encodings encodings)
+    {
+        curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+        QList<QByteArray> names;
+
+        if(info->features & CURL_VERSION_LIBZ)
+        {
+            if(encodings & GzipEncoding)
+            {
+                names.append("gzip");
+            }
+
+            if(encodings & DeflateEncoding)
+            {
+                names.append("deflate");
+            }
+        }
+
+#ifdef CURL_VERSION_BROTLI
+        if((info->features & CURL_VERSION_BROTLI) && (encodings & BrotliEncoding))
+        {
+            names.append("br");
+        }
+#endif
+
+        QByteArray header;
+
+        foreach(QByteArray name, names)
+        {
+            header += (header.isEmpty() ? "" : ", ") + name;
+        }
+
+        return header;
+    }
+
+    /*!
+     * The state of a single GET request.  The same transfer is used for all of the
+     * requests made while following redirects.  It may be performed directly with
+     * perform() or be driven, together with others, by HTTP::perform().
+     */
+
+    class Transfer
+    {
+    public:
+        Transfer(const QUrl &u, bool follow, int t,
+                 const QHash<QString, QString> &requestHeaders) :
+            url(u),
+            followRedirects(follow),
+            timeout(t),
+            sentHeaders(requestHeaders),
+            errorBuffer(CURL_ERROR_SIZE, 0),
+            requestHeaderList(0),
+            decoder(0),
+            responseCode(0),
+            contentLength(-1),
+            headersComplete(false),
+            parseTime(0),
+            conditional(false),
+            notModified(false),
+            stopped(false),
+            finished(false),
+            canceled(0)
+        {
+            QHash<QString, QString>::const_iterator it = requestHeaders.constBegin();
+            while(it != requestHeaders.constEnd())
+            {
+                QString header = it.key() + ": " + it.value();
+                requestHeaderList = curl_slist_append(requestHeaderList, header.toUtf8());
+                ++it;
+            }
+        }
+
+        ~Transfer()
+        {
+            curl_slist_free_all(requestHeaderList);
+        }
+
+        CURL *handle() const
+        {
+            return connection.handle;
+        }
+
+        /*!
+         * Prepares the handle for a request to the current URL.
+         */
+        void setup()
+        {
+            CURL *curl = connection.handle;
+
+            data.clear();
+            headers.clear();
+            headers.reserve(1024);
+            responseCode = 0;
+            contentLength = -1;
+            headersComplete = false;
+            parseTime = 0;
+            encodedUrl = url.toEncoded();
+
+            curl_easy_setopt(curl, CURLOPT_URL, encodedUrl.data());
+            curl_easy_setopt(curl, CURLOPT_WRITEHEADER, (void *) this);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerWriter);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writer);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) this);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+            curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer.data());
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, requestHeaderList);
+
+            if(!encoding.isEmpty())
+            {
+                curl_easy_setopt(curl, CURLOPT_ENCODING, encoding.constData());
+            }
+
+            if(canceled)
+            {
+                curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0);
+                curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, progress);
+                curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, (void *) this);
+            }
+        }
+
+        bool isCanceled() const
+        {
+            return canceled && int(*canceled) != 0;
+        }
+
+        /*!
+         * Inspects the outcome of the request.  Throws an Exception on errors.
+         * \return True if a redirect was followed and the transfer has to be
+         * performed again.
+         */
+        bool finish(int result)
+        {
+            if(!errors.isEmpty())
+            {
+                throw errors.front();
+            }
+
+            if(isCanceled())
+            {
+                throw Exception(Exception::Canceled, Response(0, headers, data), "Canceled");
+            }
+
+            if(stopped)
+            {
+                finished = true;
+                return false;
+            }
+
+            long httpCode = 0;
+            curl_easy_getinfo(connection.handle, CURLINFO_RESPONSE_CODE, &httpCode);
+
+            if(httpCode == 304 && conditional && result == 0)
+            {
+                notModified = true;
+                finished = true;
+                return false;
+            }
+
+            if(httpCode >= 300 && httpCode < 400)
+            {
+                Response response(httpCode, headers, data, timings());
+                QString location = response.header("Location");
+
+                if(getenv(QAR_DEBUG))
+                {
+                    qDebug() << (followRedirects ? "Following" : "Not following")
+                             << "redirect from" << url.toString(QUrl::RemoveUserInfo)
+                             << "to" << location;
+                }
+
+                if(!followRedirects || location.isEmpty())
+                {
+                    throw Exception(Exception::Redirection, response, location);
+                }
+
+                QString user = url.userName();
+                QString pass = url.password();
+                url = location;
+                url.setUserName(user);
+                url.setPassword(pass);
+                return true;
+            }
+            else if(result != 0 || httpCode >= 400)
+            {
+                QString message;
+
+                if(result != 0)
+                {
+                    message = QString::fromUtf8(errorBuffer.constData());
+                }
+
+                handleError(result, Response(httpCode, headers, data, timings()), message);
+            }
+
+            finished = true;
+            return false;
+        }
+
+        /*!
+         * \return A new transfer for the same request that feeds \a otherDecoder.
+         */
+        Transfer *duplicate(::Decoder *otherDecoder) const
+        {
+            Transfer *transfer = new Transfer(url, followRedirects, timeout, sentHeaders);
+            transfer->decoder = otherDecoder;
+            transfer->encoding = encoding;
+            transfer->conditional = conditional;
+            transfer->canceled = canceled;
+            return transfer;
+        }
+
+        /*!
+         * \return The timings of the last request made.  The parse time is only
+         * that of the data added so far.
+         */
+        Timings timings() const
+        {
+            Timings timings;
+            double downloaded = 0;
+
+            curl_easy_getinfo(connection.handle, CURLINFO_NAMELOOKUP_TIME, &timings.nameLookup);
+            curl_easy_getinfo(connection.handle, CURLINFO_CONNECT_TIME, &timings.connect);
+            curl_easy_getinfo(connection.handle, CURLINFO_APPCONNECT_TIME, &timings.appConnect);
+            curl_easy_getinfo(connection.handle, CURLINFO_STARTTRANSFER_TIME, &timings.startTransfer);
+            curl_easy_getinfo(connection.handle, CURLINFO_TOTAL_TIME, &timings.total);
+            curl_easy_getinfo(connection.handle, CURLINFO_SIZE_DOWNLOAD, &downloaded);
+
+            timings.bytesDownloaded = qint64(downloaded);
+            timings.parse = parseTime / 1000000000.0;
+
+            return timings;
+        }
+
+        /*!
+         * Performs the request, following redirects if enabled.
+         */
+        void perform()
+        {
+            if(!connection.handle)
+            {
+                finished = true;
+                return;
+            }
+
+            do
+            {
+                setup();
+            }
+            while(finish(curl_easy_perform(connection.handle)));
+        }
+
+        QUrl url;
+        bool followRedirects;
+        int timeout;
+        QHash<QString, QString> sentHeaders;
+        QByteArray encodedUrl;
+        QByteArray encoding;
+        QByteArray errorBuffer;
+        struct curl_slist *requestHeaderList;
+        Connection connection;
+        QByteArray headers;
+        QByteArray data;
+        ::Decoder *decoder;
+        long responseCode;
+        int contentLength;
+        bool headersComplete;
+        qint64 parseTime;
+        bool conditional;
+        bool notModified;
+        bool stopped;
+        bool finished;
+        QAtomicInt *canceled;
+        QList<Exception> errors;
+
+    private:
+        /*!
+         * Called by libcurl at least once a second while the transfer runs.
+         * Returning non-zero aborts it.
+         */
+        static int progress(void *stream, double, double, double, double)
+        {
+            return reinterpret_cast<Transfer *>(stream)->isCanceled() ? 1 : 0;
+        }
+
+        /*!
+         * Header lines are appended to a single buffer, which is only split up
+         * if a Response is created from it.  The only header looked at while
+         * the transfer is running is Content-Length, to size the body's buffer.
+         */
+        static size_t headerWriter(void *ptr, size_t size, size_t nmemb, void *stream)
+        {
+            Transfer *transfer = reinterpret_cast<Transfer *>(stream);
+            const char *line = (const char *) ptr;
+            int length = int(size * nmemb);
+
+            // A new status line starts the headers of another response, e.g.
+            // after a "100 Continue".
+
+            if(length >= 5 && qstrncmp(line, "HTTP/", 5) == 0 && !transfer->headers.isEmpty())
+            {
+                transfer->headers.clear();
+                transfer->contentLength = -1;
+                transfer->headersComplete = false;
+            }
+
+            // The empty line ends the headers.  Those of interim and redirect
+            // responses are followed by another response's, so they don't count.
+
+            if(length > 0 && (line[0] == '\r' || line[0] == '\n'))
+            {
+                long code = 0;
+                curl_easy_getinfo(transfer->connection.handle, CURLINFO_RESPONSE_CODE, &code);
+                transfer->headersComplete = code >= 200 && code < 300;
+            }
+
+            static const char contentLength[] = "content-length:";
+            static const int contentLengthSize = sizeof(contentLength) - 1;
+
+            if(length > contentLengthSize &&
+               qstrnicmp(line, contentLength, contentLengthSize) == 0)
+            {
+                qint64 value = 0;
+                int i = contentLengthSize;
+
+                while(i < length && (line[i] == ' ' || line[i] == '\t'))
+                {
+                    i++;
+                }
+
+                for(; i < length && line[i] >= '0' && line[i] <= '9' && value <= MAX_PRESIZE; i++)
+                {
+                    value = value * 10 + (line[i] - '0');
+                }
+
+                transfer->contentLength = int(qMin(value, qint64(MAX_PRESIZE)));
+            }
+
+            transfer->headers.append(line, length);
+
+            return size * nmemb;
+        }
+
+        /*!
+         * Successful responses are handed to the decoder (if there is one) chunk
+         * by chunk as they arrive so that decoding overlaps with the transfer.
+         * Everything else is buffered for the Response of the Exception.  Either
+         * way the body's buffer is sized up front from the Content-Length.
+         */
+        static size_t writer(void *ptr, size_t size, size_t nmemb, void *stream)
+        {
+            Transfer *transfer = reinterpret_cast<Transfer *>(stream);
+            int length = int(size * nmemb);
+            bool first = transfer->responseCode == 0;
+
+            if(transfer->isCanceled())
+            {
+                return 0;
+            }
+
+            if(first)
+            {
+                curl_easy_getinfo(transfer->connection.handle, CURLINFO_RESPONSE_CODE,
+                                  &transfer->responseCode);
+            }
+
+            if(transfer->decoder && transfer->responseCode >= 200 &&
+               transfer->responseCode < 300)
+            {
+                QElapsedTimer timer;
+                timer.start();
+
+                try
+                {
+                    if(first && transfer->contentLength > 0)
+                    {
+                        transfer->decoder->reserve(transfer->contentLength);
+                    }
+
+                    transfer->stopped = !transfer->decoder->addData((const char *) ptr, length);
+                }
+                catch(const Exception &ex)
+                {
+                    transfer->errors.append(ex);
+                }
+
+                transfer->parseTime += timer.nsecsElapsed();
+
+                if(transfer->stopped || !transfer->errors.isEmpty())
+                {
+                    return 0;
+                }
+            }
+            else
+            {
+                if(first && transfer->contentLength > 0)
+                {
+                    transfer->data.reserve(transfer->contentLength);
+                }
+
+                transfer->data.append((const char *) ptr, length);
+            }
+
+            return size * nmemb;
+        }
+
+        Transfer(const Transfer &);
+        Transfer &operator=(const Transfer &);
+    };
+
+    QByteArray get(const QUrl &url, bool followRedirects = false, int timeout = DEFAULT_TIMEOUT,
+                   const QHash<QString, QString> &requestHeaders = QHash<QString, QString>())
+    {
+        Transfer transfer(url, followRedirects, timeout, requestHeaders);
+        transfer.perform();
+        return transfer.data;
+    }
+
+    /*!
+     * Drives any number of transfers from a single multi handle.  Transfers may
+     * be added at any time, e.g. while others are still running.  Errors are not
+     * thrown, but stored in the failed transfer.
+     */
+
+    class Multi
+    {
+    public:
+        Multi() :
+            multi(curl_multi_init())
+        {
+
+        }
+
+        ~Multi()
+        {
+            foreach(CURL *handle, running.keys())
+            {
+                curl_multi_remove_handle(multi, handle);
+            }
+
+            curl_multi_cleanup(multi);
+        }
+
+        /*!
+         * Starts \a transfer.  Transfers without a connection are finished
+         * right away and returned by the next call to perform().
+         */
+        void add(Transfer *transfer)
+        {
+            if(!transfer->handle())
+            {
+                transfer->finished = true;
+                done.append(transfer);
+                return;
+            }
+
+            transfer->setup();
+            curl_multi_add_handle(multi, transfer->handle());
+            running[transfer->handle()] = transfer;
+        }
+
+        /*!
+         * Stops \a transfer if it's still running.
+         */
+        void remove(Transfer *transfer)
+        {
+            if(transfer->handle() && running.remove(transfer->handle()) > 0)
+            {
+                curl_multi_remove_handle(multi, transfer->handle());
+            }
+
+            done.removeAll(transfer);
+        }
+
+        int size() const
+        {
+            return running.size();
+        }
+
+        /*!
+         * Moves the running transfers forward without blocking.  Redirects are
+         * followed by restarting the transfer.
+         *
+         * \return The transfers that finished since the last call.
+         */
+        QList<Transfer *> perform()
+        {
+            int active = 0;
+            curl_multi_perform(multi, &active);
+
+            int queued = 0;
+            CURLMsg *message = 0;
+
+            while((message = curl_multi_info_read(multi, &queued)))
+            {
+                if(message->msg != CURLMSG_DONE)
+                {
+                    continue;
+                }
+
+                CURL *handle = message->easy_handle;
+                int result = message->data.result;
+                Transfer *transfer = running.take(handle);
+
+                curl_multi_remove_handle(multi, handle);
+
+                try
+                {
+                    if(transfer->finish(result))
+                    {
+                        add(transfer);
+                        continue;
+                    }
+                }
+                catch(const Exception &ex)
+                {
+                    if(transfer->errors.isEmpty())
+                    {
+                        transfer->errors.append(ex);
+                    }
+
+                    transfer->finished = true;
+                }
+
+                done.append(transfer);
+            }
+
+            QList<Transfer *> finished = done;
+            done.clear();
+            return finished;
+        }
+
+        /*!
+         * Blocks until there's activity on one of the transfers or \a timeout
+         * milliseconds have passed.
+         */
+        void wait(int timeout = 1000)
+        {
+            if(!running.isEmpty())
+            {
+                curl_multi_wait(multi, 0, 0, timeout, 0);
+            }
+        }
+
+    private:
+        CURLM *multi;
+        QHash<CURL *, Transfer *> running;
+        QList<Transfer *> done;
+
+        Multi(const Multi &);
+        Multi &operator=(const Multi &);
+    };
+
+    /*!
+     * Is told about the transfers that a SocketLoop has finished.
+     */
+
+    class Receiver
+    {
+    public:
+        virtual ~Receiver() {}
+
+        /*!
+         * Called once \a transfer has finished.  Errors are stored in the
+         * transfer rather than thrown.
+         */
+        virtual void finished(Transfer *transfer) = 0;
+
+        /*!
+         * \return True if the transfer isn't wanted anymore.  It's then
+         * removed and finished with an Exception of type Canceled.
+         */
+        virtual bool isCanceled() const
+        {
+            return false;
+        }
+    };
+
+    /*!
+     * Drives transfers from the Qt event loop of the thread that it belongs to,
+     * without blocking.  libcurl tells it which sockets to watch and when its
+     * next timeout is due (see curl_multi_socket_action()), which are turned
+     * into socket notifiers and a timer.  There's one loop per thread, created
+     * by the first call to forThread() in that thread.
+     *
+     * While transfers are running, their receivers are asked every
+     * ASYNC_CANCEL_INTERVAL milliseconds whether they were canceled, so that
+     * canceled transfers free their connection rather than running to
+     * completion.
+     */
+
+    class SocketLoop : public QObject
+    {
+    public:
+        SocketLoop() :
+            multi(curl_multi_init()),
+            timer(0),
+            cancelTimer(0)
+        {
+            curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socketCallback);
+            curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, (void *) this);
+            curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timerCallback);
+            curl_multi_setopt(multi, CURLMOPT_TIMERDATA, (void *) this);
+        }
+
+        /*!
+         * Transfers that are still running when the thread exits fail.
+         */
+        ~SocketLoop()
+        {
+            QList<Running> remaining = running.values();
+            running.clear();
+
+            foreach(const Running &entry, remaining)
+            {
+                curl_multi_remove_handle(multi, entry.transfer->handle());
+
+                entry.transfer->errors.append(
+                    Exception(Exception::ConnectionError,
+                              Response(0, Response::Headers(), QByteArray()),
+                              "The thread running the request finished"));
+                entry.transfer->finished = true;
+                entry.receiver->finished(entry.transfer);
+            }
+
+            curl_multi_cleanup(multi);
+        }
+
+        static SocketLoop *forThread();
+
+        /*!
+         * Starts \a transfer and tells \a receiver once it has finished.
+         * Transfers without a connection are finished right away.
+         */
+        void add(Transfer *transfer, Receiver *receiver)
+        {
+            if(!transfer->handle())
+            {
+                transfer->finished = true;
+                receiver->finished(transfer);
+                return;
+            }
+
+            transfer->setup();
+
+            Running entry = { transfer, receiver };
+            running[transfer->handle()] = entry;
+
+            curl_multi_add_handle(multi, transfer->handle());
+
+            if(!cancelTimer)
+            {
+                cancelTimer = startTimer(ASYNC_CANCEL_INTERVAL);
+            }
+        }
+
+    protected:
+        void timerEvent(QTimerEvent *event)
+        {
+            if(event->timerId() == cancelTimer)
+            {
+                removeCanceled();
+                return;
+            }
+
+            if(event->timerId() != timer)
+            {
+                QObject::timerEvent(event);
+                return;
+            }
+
+            killTimer(timer);
+            timer = 0;
+
+            action(CURL_SOCKET_TIMEOUT, 0);
+        }
+
+    private:
+        /*!
+         * Passes its socket's activity on to the loop.  The activated() signal
+         * isn't used so that no meta object is needed.
+         */
+        class Notifier : public QSocketNotifier
+        {
+        public:
+            Notifier(SocketLoop *loop, int socket, Type type) :
+                QSocketNotifier(socket, type, loop),
+                loop(loop)
+            {
+
+            }
+
+        protected:
+            bool event(QEvent *event)
+            {
+                if(event->type() == QEvent::SockAct)
+                {
+                    loop->action(socket(), type() == Read ? CURL_CSELECT_IN : CURL_CSELECT_OUT);
+                    return true;
+                }
+
+                return QSocketNotifier::event(event);
+            }
+
+        private:
+            SocketLoop *loop;
+        };
+
+        struct Running
+        {
+            Transfer *transfer;
+            Receiver *receiver;
+        };
+
+        struct Watch
+        {
+            Watch() : read(0), write(0) {}
+            Notifier *read;
+            Notifier *write;
+        };
+
+        void action(int socket, int flags)
+        {
+            int active = 0;
+            curl_multi_socket_action(multi, socket, flags, &active);
+            collect();
+        }
+
+        /*!
+         * Hands the finished transfers to their receivers.  Redirects are
+         * followed by restarting the transfer.
+         */
+        void collect()
+        {
+            int queued = 0;
+            CURLMsg *message = 0;
+
+            while((message = curl_multi_info_read(multi, &queued)))
+            {
+                if(message->msg != CURLMSG_DONE)
+                {
+                    continue;
+                }
+
+                CURL *handle = message->easy_handle;
+                int result = message->data.result;
+                Running entry = running.take(handle);
+
+                curl_multi_remove_handle(multi, handle);
+
+                try
+                {
+                    if(entry.transfer->finish(result))
+                    {
+                        add(entry.transfer, entry.receiver);
+                        continue;
+                    }
+                }
+                catch(const Exception &ex)
+                {
+                    if(entry.transfer->errors.isEmpty())
+                    {
+                        entry.transfer->errors.append(ex);
+                    }
+
+                    entry.transfer->finished = true;
+                }
+
+                entry.receiver->finished(entry.transfer);
+            }
+
+            stopCancelTimer();
+        }
+
+        /*!
+         * Removes the transfers whose receivers were canceled and finishes
+         * them with an error.  libcurl closes their connections, since they're
+         * in the middle of a response.
+         */
+        void removeCanceled()
+        {
+            QList<Running> canceled;
+
+            foreach(const Running &entry, running)
+            {
+                if(entry.receiver->isCanceled())
+                {
+                    canceled.append(entry);
+                }
+            }
+
+            foreach(const Running &entry, canceled)
+            {
+                running.remove(entry.transfer->handle());
+                curl_multi_remove_handle(multi, entry.transfer->handle());
+
+                entry.transfer->errors.append(
+                    Exception(Exception::Canceled,
+                              Response(0, Response::Headers(), QByteArray()), "Canceled"));
+                entry.transfer->finished = true;
+                entry.receiver->finished(entry.transfer);
+            }
+
+            stopCancelTimer();
+        }
+
+        void stopCancelTimer()
+        {
+            if(running.isEmpty() && cancelTimer)
+            {
+                killTimer(cancelTimer);
+                cancelTimer = 0;
+            }
+        }
+
+        /*!
+         * Notifiers are deleted later since this may be called from within
+         * one of their event handlers.
+         */
+        void update(Notifier **notifier, int socket, QSocketNotifier::Type type, bool enabled)
+        {
+            if(enabled && !*notifier)
+            {
+                *notifier = new Notifier(this, socket, type);
+            }
+            else if(!enabled && *notifier)
+            {
+                (*notifier)->setEnabled(false);
+                (*notifier)->deleteLater();
+                *notifier = 0;
+            }
+        }
+
+        static int socketCallback(CURL *, curl_socket_t socket, int what, void *data, void *)
+        {
+            SocketLoop *loop = reinterpret_cast<SocketLoop *>(data);
+            Watch &watch = loop->watches[int(socket)];
+
+            loop->update(&watch.read, int(socket), QSocketNotifier::Read,
+                         what == CURL_POLL_IN || what == CURL_POLL_INOUT);
+            loop->update(&watch.write, int(socket), QSocketNotifier::Write,
+                         what == CURL_POLL_OUT || what == CURL_POLL_INOUT);
+
+            if(what == CURL_POLL_REMOVE)
+            {
+                loop->watches.remove(int(socket));
+            }
+
+            return 0;
+        }
+
+        static int timerCallback(CURLM *, long timeout, void *data)
+        {
+            SocketLoop *loop = reinterpret_cast<SocketLoop *>(data);
+
+            if(loop->timer)
+            {
+                loop->killTimer(loop->timer);
+                loop->timer = 0;
+            }
+
+            if(timeout >= 0)
+            {
+                loop->timer = loop->startTimer(int(timeout));
+            }
+
+            return 0;
+        }
+
+        CURLM *multi;
+        int timer;
+        int cancelTimer;
+        QHash<CURL *, Running> running;
+        QHash<int, Watch> watches;
+
+        SocketLoop(const SocketLoop &);
+        SocketLoop &operator=(const SocketLoop &);
+    };
+
+    Q_GLOBAL_STATIC(QThreadStorage<SocketLoop *>, socketLoops)
+
+    SocketLoop *SocketLoop::forThread()
+    {
+        QThreadStorage<SocketLoop *> *loops = socketLoops();
+
+        if(!loops->hasLocalData())
+        {
+            loops->setLocalData(new SocketLoop);
+        }
+
+        return loops->localData();
+    }
+
+    /*!
+     * Performs \a primary and, if it hasn't finished after \a delay milliseconds,
+     * a duplicate of it that feeds \a hedgeDecoder, which is stored in \a hedge.
+     * Once one of them has finished successfully the other one is stopped.
+     *
+     * \return The transfer that finished first.  If both fail (or the primary
+     * fails before the duplicate is started), the primary's error is thrown.
+     */
+    Transfer *performHedged(Transfer *primary, int delay, ::Decoder *hedgeDecoder,
+                            QScopedPointer<Transfer> &hedge)
+    {
+        Multi multi;
+        QElapsedTimer timer;
+
+        timer.start();
+        multi.add(primary);
+
+        while(true)
+        {
+            if(!hedge && timer.elapsed() >= delay)
+            {
+                hedge.reset(primary->duplicate(hedgeDecoder));
+                multi.add(hedge.data());
+            }
+
+            foreach(Transfer *transfer, multi.perform())
+            {
+                if(transfer->errors.isEmpty())
+                {
+                    multi.remove(primary);
+
+                    if(hedge)
+                    {
+                        multi.remove(hedge.data());
+                    }
+
+                    return transfer;
+                }
+            }
+
+            if(!primary->errors.isEmpty() && (!hedge || !hedge->errors.isEmpty()))
+            {
+                throw primary->errors.front();
+            }
+
+            multi.wait(hedge ? 1000 : qBound(1, delay - int(timer.elapsed()), 1000));
+        }
+    }
+
+    /*!
+     * Performs all of \a transfers with at most \a maxConcurrent of them in
+     * flight at once.
+     */
+    void perform(const QList<Transfer *> &transfers, int maxConcurrent)
+    {
+        Multi multi;
+        QList<Transfer *> pending = transfers;
+        int remaining = transfers.size();
+
+        maxConcurrent = qMax(1, maxConcurrent);
+
+        while(remaining > 0)
+        {
+            while(!pending.isEmpty() && multi.size() < maxConcurrent)
+            {
+                multi.add(pending.takeFirst());
+            }
+
+            remaining -= multi.perform().size();
+
+            if(remaining > 0)
+            {
+                multi.wait();
+            }
+        }
+    }
+
+    /*!
+     * \return The target of the entry with rel="next" in the Link header of
+     * \a rawHeaders, resolved against \a url, or an empty URL if there is none.
+     */
+    QUrl nextLink(const QUrl &url, const QByteArray &rawHeaders)
+    {
+        QString header = Response(200, rawHeaders, QByteArray()).header("Link");
+        QRegExp link("<([^>]*)>([^,]*)");
+        QRegExp rel("rel\\s*=\\s*\"?([^\";]*)\"?");
+
+        for(int i = link.indexIn(header); i >= 0; i = link.indexIn(header, i + link.matchedLength()))
+        {
+            QString parameters = link.cap(2);
+
+            if(rel.indexIn(parameters) >= 0 &&
+               rel.cap(1).split(' ', QString::SkipEmptyParts).contains("next"))
+            {
+                QUrl next = url.resolved(QUrl(link.cap(1)));
+                next.setUserName(url.userName());
+                next.setPassword(url.password());
+                return next;
+            }
+        }
+
+        return QUrl();
+    }
+}
+
+/*
+ * Timings
+ */
+
+Timings::Timings() :
+    nameLookup(0),
+    connect(0),
+    appConnect(0),
+    startTransfer(0),
+    total(0),
+    bytesDownloaded(0),
+    parse(0),
+    records(0)
+{
+
+}
+
+/*
+ * Response
+ */
+
+/*!
+ * Splits the header block into its fields.  Leading and trailing whitespace of
+ * names and values isn't included and lines without a colon, such as the
+ * status line, are skipped.  If the block holds several responses' headers,
+ * only those of the last one are kept.
+ */
+
+Response::Data::Data(Code c, const QByteArray &h, const QByteArray &d) :
+    code(c),
+    rawHeaders(h),
+    data(d)
+{
+    const char *raw = rawHeaders.constData();
+    int length = rawHeaders.size();
+    int start = 0;
+
+    while(start < length)
+    {
+        const char *lineEnd = (const char *) memchr(raw + start, '\n', length - start);
+        int end = lineEnd ? int(lineEnd - raw) : length;
+        int next = end + 1;
+
+        if(end - start >= 5 && qstrncmp(raw + start, "HTTP/", 5) == 0)
+        {
+            fields.clear();
+            start = next;
+            continue;
+        }
+
+        const char *colon = (const char *) memchr(raw + start, ':', end - start);
+
+        if(colon)
+        {
+            Field field;
+            int separator = int(colon - raw);
+            int valueStart = separator + 1;
+
+            while(start < separator && isspace(uchar(raw[start])))
+            {
+                start++;
+            }
+
+            while(separator > start && isspace(uchar(raw[separator - 1])))
+            {
+                separator--;
+            }
+
+            while(valueStart < end && isspace(uchar(raw[valueStart])))
+            {
+                valueStart++;
+            }
+
+            while(end > valueStart && isspace(uchar(raw[end - 1])))
+            {
+                end--;
+            }
+
+            field.name = start;
+            field.nameLength = separator - start;
+            field.value = valueStart;
+            field.valueLength = end - valueStart;
+
+            fields.append(field);
+        }
+
+        start = next;
+    }
+}
+
+Response::Response(Code code, const Headers &headers, const QByteArray &data)
+{
+    QByteArray raw;
+
+    for(Headers::ConstIterator it = headers.begin(); it != headers.end(); ++it)
+    {
+        raw += it.key().toLatin1() + ": " + it.value().toLatin1() + "\r\n";
+    }
+
+    d = new Data(code, raw, data);
+}
+
+Response::Response(Code code, const QByteArray &rawHeaders, const QByteArray &data,
+                   const Timings &timings) :
+    d(new Data(code, rawHeaders, data))
+{
+    d->timings = timings;
+}
+
+Response::Code Response::code() const
+{
+    return d->code;
+}
+
+Response::Headers Response::headers() const
+{
+    Headers headers;
+    const char *raw = d->rawHeaders.constData();
+
+    foreach(Field field, d->fields)
+    {
+        headers[QString::fromLatin1(raw + field.name, field.nameLength)] =
+            QString::fromLatin1(raw + field.value, field.valueLength);
+    }
+
+    return headers;
+}
+
+QString Response::header(const QString &name) const
+{
+    QByteArray key = name.toLatin1();
+    const char *raw = d->rawHeaders.constData();
+
+    // Later headers replace earlier ones of the same name, as in headers().
+
+    for(int i = d->fields.size() - 1; i >= 0; i--)
+    {
+        const Field &field = d->fields[i];
+
+        if(field.nameLength == key.size() &&
+           qstrnicmp(raw + field.name, key.constData(), uint(key.size())) == 0)
+        {
+            return QString::fromLatin1(raw + field.value, field.valueLength);
+        }
+    }
+
+    return QString();
+}
+
+QByteArray Response::rawHeaders() const
+{
+    return d->rawHeaders;
+}
+
+QByteArray Response::data() const
+{
+    return d->data;
+}
+
+Timings Response::timings() const
+{
+    return d->timings;
+}
+
+/*
+ * Exception
+ */
+
+Exception::Data::Data(Type t, const Response &r, const QString &m) :
+    type(t),
+    response(r),
+    message(m)
+{
+
+}
+
+Exception::Exception(Type type, const Response &response, const QString &message) :
+    d(new Data(type, response, message))
+{
+
+}
+
+Exception::~Exception() throw()
+{
+
+}
+
+void Exception::raise() const
+{
+    throw *this;
+}
+
+Exception *Exception::clone() const
+{
+    return new Exception(*this);
+}
+
+Exception::Type Exception::type() const
+{
+    return d->type;
+}
+
+Response Exception::response() const
+{
+    return d->response;
+}
+
+QString Exception::message() const
+{
+    return d->message;
+}
+
+/*
+ * Record
+ */
+
+int Record::Data::indexOf(const QString &key) const
+{
+    int index = shape ? shape->indexes.value(key, -1) : -1;
+    return index < values.size() ? index : -1;
+}
+
+Record::Record(const QVariantHash &hash) :
+    d(new Data)
+{
+    for(QVariantHash::ConstIterator it = hash.begin(); it != hash.end(); ++it)
+    {
+        if(it.key() == QActiveResourceClassKey)
+        {
+            d->className = it.value().toString();
+        }
+        else
+        {
+            (*this)[it.key()] = it.value();
+        }
+    }
+}
+
+Record::Record(const QVariant &v)
+{
+    if(v.userType() == qMetaTypeId<Record>())
+    {
+        d = v.value<Record>().d;
+    }
+    else
+    {
+        *this = Record(v.toHash());
+    }
+}
+
+QVariant &Record::operator[](const QString &key)
+{
+    Data *data = d.data();
+    int size = data->values.size();
+
+    // Records of the same type usually set the same keys in the same order, so
+    // first check if this is just the next key of the shape.
+
+    if(data->shape && data->shape->keys.size() > size && data->shape->keys.at(size) == key)
+    {
+        data->values.append(QVariant());
+        return data->values.last();
+    }
+
+    int index = data->indexOf(key);
+
+    if(index >= 0)
+    {
+        if(!data->subtrees.isEmpty() && data->subtrees.contains(index))
+        {
+            data->values[index] = data->subtrees.take(index)->value();
+        }
+
+        return data->values[index];
+    }
+
+    if(!data->shape)
+    {
+        data->shape = new Shape;
+    }
+    else if(data->shape->ref != 1 || data->shape->keys.size() != size)
+    {
+        Shape *shape = new Shape;
+        shape->keys = data->shape->keys.mid(0, size);
+
+        for(int i = 0; i < size; i++)
+        {
+            shape->indexes.insert(shape->keys.at(i), i);
+        }
+
+        data->shape = shape;
+    }
+
+    data->shape->keys.append(key);
+    data->shape->indexes.insert(key, size);
+    data->values.append(QVariant());
+
+    return data->values.last();
+}
+
+QVariant Record::operator[](const QString &key) const
+{
+    int index = d->indexOf(key);
+    return index >= 0 ? valueAt(index) : QVariant();
+}
+
+void Record::setSubtree(const QString &key, Subtree *subtree)
+{
+    int index = d->indexOf(key);
+
+    if(index >= 0)
+    {
+        d->values[index] = QVariant();
+    }
+    else
+    {
+        (*this)[key];
+        index = d->values.size() - 1;
+    }
+
+    d->subtrees.insert(index, QExplicitlySharedDataPointer<Subtree>(subtree));
+}
+
+const Record::Subtree *Record::subtree(const QString &key) const
+{
+    if(d->subtrees.isEmpty())
+    {
+        return 0;
+    }
+
+    return d->subtrees.value(d->indexOf(key)).data();
+}
+
+const QVariant &Record::subtreeAt(int index) const
+{
+    QHash<int, QExplicitlySharedDataPointer<Subtree> >::ConstIterator it =
+        d->subtrees.constFind(index);
+
+    return it != d->subtrees.constEnd() ? it.value()->value() : d->values.at(index);
+}
+
+bool Record::isEmpty() const
+{
+    return d->values.isEmpty();
+}
+
+int Record::size() const
+{
+    return d->values.size();
+}
+
+bool Record::contains(const QString &key) const
+{
+    return d->indexOf(key) >= 0;
+}
+
+QString Record::className() const
+{
+    return d->className;
+}
+
+void Record::setClassName(const QString &name)
+{
+    d->className = name;
+}
+
+/*!
+ * \return \a value with the records in it converted to hashes.
+ */
+
+static QVariant toHashValue(const QVariant &value)
+{
+    if(isRecord(value))
+    {
+        Record record = value;
+        QVariantHash hash = record.toHash();
+        hash.insert(QActiveResourceClassKey, record.className());
+        return hash;
+    }
+
+    if(value.type() == QVariant::List)
+    {
+        QVariantList list;
+
+        foreach(QVariant element, value.toList())
+        {
+            list.append(toHashValue(element));
+        }
+
+        return list;
+    }
+
+    return value;
+}
+
+QVariantHash Record::toHash() const
+{
+    QVariantHash hash;
+
+    for(ConstIterator it = begin(), last = end(); it != last; ++it)
+    {
+        hash.insert(it.key(), toHashValue(it.value()));
+    }
+
+    return hash;
+}
+
+Record::operator QVariant() const
+{
+    return QVariant::fromValue(*this);
+}
+
+Record Record::emptyCopy() const
+{
+    Record record;
+    record.d->shape = d->shape;
+    record.d->className = d->className;
+    record.d->values.reserve(d->shape ? d->shape->keys.size() : 0);
+    return record;
+}
+
+Record::ConstIterator Record::begin() const
+{
+    return ConstIterator(*this, 0);
+}
+
+Record::ConstIterator Record::end() const
+{
+    return ConstIterator(*this, d->values.size());
+}
+
+/*
+ * Record::Subtree
+ */
+
+Record::Subtree::Subtree() :
+    hasDecoded(false)
+{
+
+}
+
+Record::Subtree::~Subtree()
+{
+
+}
+
+const QVariant &Record::Subtree::value() const
+{
+    QMutexLocker locker(&mutex);
+
+    if(!hasDecoded)
+    {
+        decoded = decode();
+        hasDecoded = true;
+    }
+
+    return decoded;
+}
+
+bool Record::Subtree::isDecoded() const
+{
+    QMutexLocker locker(&mutex);
+    return hasDecoded;
+}
+
+int Record::Subtree::encodedSize() const
+{
+    return 0;
+}
+
+/*
+ * ConnectionPool
+ */
+
+int ConnectionPool::maxSize()
+{
+    QMutexLocker locker(&HTTP::pool()->mutex);
+    return HTTP::pool()->maxSize;
+}
+
+void ConnectionPool::setMaxSize(int size)
+{
+    QMutexLocker locker(&HTTP::pool()->mutex);
+    HTTP::pool()->maxSize = qMax(0, size);
+    HTTP::pool()->expire();
+}
+
+int ConnectionPool::idleTimeout()
+{
+    QMutexLocker locker(&HTTP::pool()->mutex);
+    return HTTP::pool()->idleTimeout;
+}
+
+void ConnectionPool::setIdleTimeout(int seconds)
+{
+    QMutexLocker locker(&HTTP::pool()->mutex);
+    HTTP::pool()->idleTimeout = seconds;
+    HTTP::pool()->expire();
+}
+
+void ConnectionPool::clear()
+{
+    HTTP::pool()->clear();
+}
+
+/*
+ * Cache::Data
+ */
+
+/*!
+ * \return A rough estimate of the memory used by \a value.  Key shapes are
+ * shared between the records of a response and so aren't counted.
+ */
+
+static qint64 estimateSize(const QVariant &value)
+{
+    static const qint64 overhead = sizeof(QVariant) + 16;
+
+    if(isRecord(value))
+    {
+        Record record = value;
+        qint64 size = overhead + record.className().size() * 2;
+
+        for(Record::ConstIterator it = record.begin(), last = record.end(); it != last; ++it)
+        {
+            // Lazy values that haven't been read yet are counted by their
+            // share of the response's text rather than decoded.
+
+            const Record::Subtree *subtree = record.subtree(it.key());
+
+            if(subtree && !subtree->isDecoded())
+            {
+                size += overhead + subtree->encodedSize();
+            }
+            else
+            {
+                size += estimateSize(it.value());
+            }
+        }
+
+        return size;
+    }
+
+    switch(value.type())
+    {
+    case QVariant::List:
+    {
+        qint64 size = overhead;
+
+        foreach(QVariant element, value.toList())
+        {
+            size += estimateSize(element);
+        }
+
+        return size;
+    }
+    case QVariant::String:
+        return overhead + value.toString().size() * 2;
+    default:
+        return overhead;
+    }
+}
+
+static qint64 estimateSize(const QString &key, const RecordList &records)
+{
+    qint64 size = key.size() * 2;
+
+    foreach(Record record, records)
+    {
+        size += estimateSize(record);
+    }
+
+    return size;
+}
+
+/*
+ * Saved entries are a QDataStream with a magic number and version followed by
+ * the validators and the records.  Each value is prefixed by its type: records
+ * and lists are written element by element, everything else as a QVariant.
+ * Field names are written only the first time they occur and are referred to
+ * by their index after that.  Lazy values are decoded to be written.
+ */
+
+enum StoredType
+{
+    StoredRecord,
+    StoredList,
+    StoredVariant
+};
+
+static void writeValue(QDataStream &stream, const QVariant &value, QHash<QString, qint32> *keys)
+{
+    if(isRecord(value))
+    {
+        Record record = value;
+        stream << quint8(StoredRecord) << record.className() << qint32(record.size());
+
+        for(Record::ConstIterator it = record.begin(), last = record.end(); it != last; ++it)
+        {
+            qint32 index = keys->value(it.key(), keys->size());
+
+            stream << index;
+
+            if(index == keys->size())
+            {
+                stream << it.key();
+                keys->insert(it.key(), index);
+            }
+
+            writeValue(stream, it.value(), keys);
+        }
+    }
+    else if(value.type() == QVariant::List)
+    {
+        QVariantList list = value.toList();
+        stream << quint8(StoredList) << qint32(list.size());
+
+        foreach(QVariant element, list)
+        {
+            writeValue(stream, element, keys);
+        }
+    }
+    else
+    {
+        stream << quint8(StoredVariant) << value;
+    }
+}
+
+/*!
+ * The records of a class are started from the previous one of the same class
+ * so that they share its key shape, as in the decoders.
+ */
+
+static QVariant readValue(QDataStream &stream, QStringList *keys,
+                          QHash<QString, Record> *prototypes)
+{
+    quint8 type = 0;
+    stream >> type;
+
+    switch(type)
+    {
+    case StoredRecord:
+    {
+        QString className;
+        qint32 size = 0;
+        stream >> className >> size;
+
+        Record record = prototypes->value(className).emptyCopy();
+        record.setClassName(className);
+
+        for(int i = 0; i < size && stream.status() == QDataStream::Ok; i++)
+        {
+            qint32 index = 0;
+            stream >> index;
+
+            if(index == keys->size())
+            {
+                QString key;
+                stream >> key;
+                keys->append(key);
+            }
+            else if(index < 0 || index > keys->size())
+            {
+                stream.setStatus(QDataStream::ReadCorruptData);
+                break;
+            }
+
+            QVariant value = readValue(stream, keys, prototypes);
+            record[keys->at(index)] = value;
+        }
+
+        if(record.size() != prototypes->value(className).size())
+        {
+            prototypes->insert(className, record);
+        }
+
+        return record;
+    }
+    case StoredList:
+    {
+        QVariantList list;
+        qint32 size = 0;
+        stream >> size;
+
+        for(int i = 0; i < size && stream.status() == QDataStream::Ok; i++)
+        {
+            list.append(readValue(stream, keys, prototypes));
+        }
+
+        return list;
+    }
+    case StoredVariant:
+    {
+        QVariant value;
+        stream >> value;
+        return value;
+    }
+    default:
+        stream.setStatus(QDataStream::ReadCorruptData);
+        return QVariant();
+    }
+}
+
+Cache::Data::Data(int e, qint64 b) :
+    maxEntries(e),
+    maxBytes(b),
+    maxAge(0),
+    bytes(0),
+    clock(0),
+    hits(0),
+    misses(0)
+{
+
+}
+
+QString Cache::Data::key(const QUrl &url, const QHash<QString, QString> &headers)
+{
+    QString key = QString::fromLatin1(url.toEncoded());
+    QStringList names = headers.keys();
+
+    names.sort();
+
+    foreach(QString name, names)
+    {
+        key += '\n' + name + ": " + headers[name];
+    }
+
+    return key;
+}
+
+/*!
+ * Adds the validators of the entry for \a key to \a headers and copies the
+ * entry to \a entry.  Entries that aren't in memory are loaded from the
+ * directory, if there is one.  \return False if there is no such entry.
+ */
+
+bool Cache::Data::prepare(const QString &key, QHash<QString, QString> *headers, Entry *entry)
+{
+    QMutexLocker locker(&mutex);
+
+    QHash<QString, Entry>::Iterator it = entries.find(key);
+
+    if(it == entries.end())
+    {
+        if(directory.isEmpty())
+        {
+            return false;
+        }
+
+        QString file = fileName(key);
+
+        locker.unlock();
+
+        if(!load(file, entry))
+        {
+            return false;
+        }
+
+        entry->bytes = estimateSize(key, entry->records);
+
+        locker.relock();
+
+        it = entries.find(key);
+
+        if(it == entries.end())
+        {
+            it = entries.insert(key, *entry);
+            bytes += entry->bytes;
+        }
+    }
+
+    it->used = ++clock;
+    *entry = *it;
+
+    evict();
+
+    if(!entry->etag.isEmpty())
+    {
+        headers->insert("If-None-Match", entry->etag);
+    }
+
+    if(!entry->lastModified.isEmpty())
+    {
+        headers->insert("If-Modified-Since", entry->lastModified);
+    }
+
+    return true;
+}
+
+bool Cache::Data::isFresh(const Entry &entry)
+{
+    QMutexLocker locker(&mutex);
+    return qint64(time(0)) - entry.validated < maxAge;
+}
+
+/*!
+ * Counts a miss and stores \a records if the response had validators.
+ */
+
+void Cache::Data::store(const QString &key, const QByteArray &rawHeaders,
+                        const RecordList &records)
+{
+    Response response(200, rawHeaders, QByteArray());
+
+    Entry entry;
+    entry.etag = response.header("ETag");
+    entry.lastModified = response.header("Last-Modified");
+    entry.records = records;
+    entry.validated = time(0);
+    entry.bytes = estimateSize(key, records);
+
+    bool valid = !entry.etag.isEmpty() || !entry.lastModified.isEmpty();
+
+    QMutexLocker locker(&mutex);
+
+    misses++;
+
+    qint64 version = ++clock;
+
+    bytes -= entries.value(key).bytes;
+    entries.remove(key);
+
+    if(valid)
+    {
+        entry.used = ++clock;
+        entries.insert(key, entry);
+        bytes += entry.bytes;
+
+        evict();
+    }
+
+    if(!directory.isEmpty())
+    {
+        QString file = fileName(key);
+
+        locker.unlock();
+
+        if(valid)
+        {
+            save(file, entry, version);
+        }
+        else
+        {
+            remove(file, version);
+        }
+    }
+}
+
+/*!
+ * Counts a hit for \a key.  If the server was asked, i.e. \a validated is true,
+ * the entry's records are fresh again.
+ */
+
+void Cache::Data::hit(const QString &key, bool validated)
+{
+    QMutexLocker locker(&mutex);
+
+    hits++;
+
+    if(validated && entries.contains(key))
+    {
+        entries[key].validated = time(0);
+    }
+}
+
+/*!
+ * Removes the least recently used entries until both limits are met.  The
+ * mutex must be held.
+ */
+
+void Cache::Data::evict()
+{
+    while(!entries.isEmpty() && (entries.size() > maxEntries || bytes > maxBytes))
+    {
+        QHash<QString, Entry>::Iterator oldest = entries.begin();
+
+        for(QHash<QString, Entry>::Iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            if(it->used < oldest->used)
+            {
+                oldest = it;
+            }
+        }
+
+        bytes -= oldest->bytes;
+        entries.erase(oldest);
+    }
+}
+
+/*!
+ * Files are named by a hash of the key so that request headers, such as API
+ * keys, aren't written to disk.  The mutex must be held.
+ */
+
+QString Cache::Data::fileName(const QString &key) const
+{
+    QByteArray hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1);
+    return QDir(directory).filePath(QString::fromLatin1(hash.toHex()) + ".qar");
+}
+
+bool Cache::Data::load(const QString &fileName, Entry *entry)
+{
+    QFile file(fileName);
+
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_4_6);
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    stream >> magic >> version;
+
+    if(magic != CACHE_MAGIC || version != CACHE_VERSION)
+    {
+        return false;
+    }
+
+    qint32 count = 0;
+    stream >> entry->etag >> entry->lastModified >> entry->validated >> count;
+
+    QStringList keys;
+    QHash<QString, Record> prototypes;
+
+    entry->records.clear();
+
+    for(int i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+    {
+        entry->records.append(Record(readValue(stream, &keys, &prototypes)));
+    }
+
+    if(stream.status() != QDataStream::Ok)
+    {
+        if(getenv(QAR_DEBUG))
+        {
+            qDebug() << "Ignoring corrupt cache file" << fileName;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * Writes to a temporary file of its own in the same directory first, so that
+ * readers never see a partial entry and concurrent writers, in this or other
+ * processes, don't write to the same file.  The temporary file then replaces
+ * the entry with rename(), which is atomic on POSIX systems, so there's never
+ * a moment without a file.  \a version orders the writes of this process; see
+ * replace().
+ */
+
+void Cache::Data::save(const QString &fileName, const Entry &entry, qint64 version)
+{
+    QTemporaryFile file(fileName + ".XXXXXX");
+
+    if(!file.open())
+    {
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_4_6);
+
+    stream << quint32(CACHE_MAGIC) << quint32(CACHE_VERSION)
+           << entry.etag << entry.lastModified << entry.validated
+           << qint32(entry.records.size());
+
+    QHash<QString, qint32> keys;
+
+    foreach(Record record, entry.records)
+    {
+        writeValue(stream, record, &keys);
+    }
+
+    file.close();
+
+    if(stream.status() != QDataStream::Ok)
+    {
+        return;
+    }
+
+    QMutexLocker locker(&fileMutex);
+
+    if(!replace(fileName, version))
+    {
+        return;
+    }
+
+#ifdef Q_OS_WIN
+    // Windows' rename() doesn't overwrite.
+
+    QFile::remove(fileName);
+#endif
+
+    // A renamed temporary file must no longer be removed when it's destroyed,
+    // since its name is then that of the entry.
+
+    file.setAutoRemove(::rename(QFile::encodeName(file.fileName()).constData(),
+                                QFile::encodeName(fileName).constData()) != 0);
+}
+
+/*!
+ * Removes the file of an entry that may no longer be cached, unless a newer
+ * version of it has already been written.
+ */
+
+void Cache::Data::remove(const QString &fileName, qint64 version)
+{
+    QMutexLocker locker(&fileMutex);
+
+    if(replace(fileName, version))
+    {
+        QFile::remove(fileName);
+    }
+}
+
+/*!
+ * Entries are written outside of the mutex, so two threads storing the same
+ * key may get to the file in the opposite order of their store() calls.  Each
+ * write or removal is given the clock when it was stored as \a version and is
+ * dropped if a later one has already been applied.  \return True if the file
+ * may be replaced, which is then recorded.  The file mutex must be held.
+ */
+
+bool Cache::Data::replace(const QString &fileName, qint64 version)
+{
+    QHash<QString, qint64>::Iterator it = fileVersions.find(fileName);
+
+    if(it != fileVersions.end() && it.value() > version)
+    {
+        return false;
+    }
+
+    fileVersions[fileName] = version;
+    return true;
+}
+
+/*
+ * Cache
+ */
+
+Cache::Cache(int maxEntries, qint64 maxBytes) :
+    d(new Data(maxEntries, maxBytes))
+{
+
+}
+
+Cache::Cache(Data *data) :
+    d(data)
+{
+
+}
+
+int Cache::maxEntries() const
+{
+    if(!d)
+    {
+        return 0;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    return d->maxEntries;
+}
+
+void Cache::setMaxEntries(int count)
+{
+    if(!d)
+    {
+        return;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    d->maxEntries = qMax(0, count);
+    d->evict();
+}
+
+qint64 Cache::maxBytes() const
+{
+    if(!d)
+    {
+        return 0;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    return d->maxBytes;
+}
+
+void Cache::setMaxBytes(qint64 bytes)
+{
+    if(!d)
+    {
+        return;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    d->maxBytes = qMax(qint64(0), bytes);
+    d->evict();
+}
+
+int Cache::size() const
+{
+    if(!d)
+    {
+        return 0;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    return d->entries.size();
+}
+
+qint64 Cache::bytes() const
+{
+    if(!d)
+    {
+        return 0;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    return d->bytes;
+}
+
+int Cache::hits() const
+{
+    if(!d)
+    {
+        return 0;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    return d->hits;
+}
+
+int Cache::misses() const
+{
+    if(!d)
+    {
+        return 0;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    return d->misses;
+}
+
+void Cache::clear()
+{
+    if(!d)
+    {
+        return;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    d->entries.clear();
+    d->bytes = 0;
+}
+
+int Cache::maxAge() const
+{
+    if(!d)
+    {
+        return 0;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    return d->maxAge;
+}
+
+void Cache::setMaxAge(int seconds)
+{
+    if(!d)
+    {
+        return;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    d->maxAge = qMax(0, seconds);
+}
+
+QString Cache::directory() const
+{
+    if(!d)
+    {
+        return QString();
+    }
+
+    QMutexLocker locker(&d->mutex);
+    return d->directory;
+}
+
+void Cache::setDirectory(const QString &path)
+{
+    if(!d)
+    {
+        return;
+    }
+
+    if(!path.isEmpty())
+    {
+        QDir().mkpath(path);
+    }
+
+    QMutexLocker locker(&d->mutex);
+    d->directory = path;
+}
+
+bool Cache::isNull() const
+{
+    return !d;
+}
+
+/*
+ * RecordHandler
+ */
+
+RecordHandler::~RecordHandler()
+{
+
+}
+
+/*
+ * Builder
+ */
+
+Builder::~Builder()
+{
+
+}
+
+/*
+ * Param::Data
+ */
+
+Param::Data::Data(const QString &k, const QString &v) :
+    key(k),
+    value(v)
+{
+
+}
+
+/*
+ * Param
+ */
+
+Param::Param() :
+    d(0)
+{
+
+}
+
+Param::Param(const QString &key, const QString &value) :
+    d(new Data(key, value))
+{
+
+}
+
+bool Param::isNull() const
+{
+    return d == 0;
+}
+
+QString Param::key() const
+{
+    return isNull() ? QString() : d->key;
+}
+
+QString Param::value() const
+{
+    return isNull() ? QString() : d->value;
+}
+
+/*
+ * RetryPolicy::Data
+ */
+
+RetryPolicy::Data::Data() :
+    maxAttempts(1),
+    initialBackoff(100),
+    maxBackoff(10000),
+    respectRetryAfter(true),
+    hedgePercentile(0),
+    hedgeMinimumDelay(0),
+    nextLatency(0),
+    retries(0),
+    hedges(0),
+    hedgeWins(0)
+{
+    types << Exception::ConnectionError << Exception::TimeoutError << Exception::ServerError;
+}
+
+Q_GLOBAL_STATIC(QThreadStorage<bool *>, seededThreads)
+
+/*!
+ * Seeds qrand() once per thread.  Qt seeds every thread with 1, which would
+ * give concurrent retries the same jitter.
+ */
+
+static void seedRandom()
+{
+    QThreadStorage<bool *> *seeded = seededThreads();
+
+    if(!seeded->hasLocalData())
+    {
+        seeded->setLocalData(new bool(true));
+        qsrand(uint(QDateTime::currentMSecsSinceEpoch()) ^
+               uint(quintptr(QThread::currentThreadId())));
+    }
+}
+
+/*!
+ * \return The time in milliseconds to wait before retrying after \a exception
+ * on attempt number \a attempt, or -1 if it shouldn't be retried.
+ */
+
+int RetryPolicy::Data::retryDelay(const Exception &exception, int attempt)
+{
+    QMutexLocker locker(&mutex);
+
+    if(attempt >= maxAttempts || !types.contains(exception.type()))
+    {
+        return -1;
+    }
+
+    int backoff = qMax(1, initialBackoff);
+
+    for(int i = 1; i < attempt && backoff < maxBackoff; i++)
+    {
+        backoff *= 2;
+    }
+
+    backoff = qMin(backoff, maxBackoff);
+
+    seedRandom();
+
+    int delay = backoff - qrand() % (backoff / 2 + 1);
+
+    if(respectRetryAfter)
+    {
+        bool ok = false;
+        qint64 seconds = exception.response().header("Retry-After").trimmed().toLongLong(&ok);
+
+        // Retrying sooner than the server asked is pointless, so a longer wait
+        // than maxBackoff gives up instead.
+
+        if(ok && seconds > 0)
+        {
+            if(seconds * 1000 > maxBackoff)
+            {
+                return -1;
+            }
+
+            delay = qMax(delay, int(seconds * 1000));
+        }
+    }
+
+    retries++;
+
+    return delay;
+}
+
+/*!
+ * Sleeps for \a milliseconds in short slices so that a cancellation, including
+ * one from Ruby's unblock function, ends the wait early.  \return False if
+ * \a canceled was set.
+ */
+
+static bool waitUnlessCanceled(int milliseconds, QAtomicInt *canceled)
+{
+    for(int left = milliseconds; left > 0; left -= RETRY_PAUSE_SLICE)
+    {
+        if(canceled && int(*canceled) != 0)
+        {
+            return false;
+        }
+
+        int slice = qMin(left, RETRY_PAUSE_SLICE);
+        struct timespec pause = { 0, slice * 1000000L };
+        nanosleep(&pause, 0);
+    }
+
+    return !canceled || int(*canceled) == 0;
+}
+
+/*!
+ * \return The delay in milliseconds after which a hedged request is sent, or -1
+ * if hedging is disabled or there aren't enough samples yet.
+ */
+
+int RetryPolicy::Data::hedgeDelay()
+{
+    QMutexLocker locker(&mutex);
+
+    if(hedgePercentile <= 0 || latencies.size() < HEDGE_MIN_SAMPLES)
+    {
+        return -1;
+    }
+
+    QVector<double> sorted = latencies;
+    qSort(sorted);
+
+    int index = qMin(sorted.size() - 1, int(sorted.size() * hedgePercentile));
+
+    return qMax(hedgeMinimumDelay, int(sorted[index]));
+}
+
+/*!
+ * Keeps the latencies of the last HEDGE_WINDOW requests.
+ */
+
+void RetryPolicy::Data::addLatency(double milliseconds)
+{
+    QMutexLocker locker(&mutex);
+
+    if(latencies.size() < HEDGE_WINDOW)
+    {
+        latencies.append(milliseconds);
+    }
+    else
+    {
+        latencies[nextLatency] = milliseconds;
+        nextLatency = (nextLatency + 1) % HEDGE_WINDOW;
+    }
+}
+
+void RetryPolicy::Data::hedged(bool won)
+{
+    QMutexLocker locker(&mutex);
+
+    hedges++;
+
+    if(won)
+    {
+        hedgeWins++;
+    }
+}
+
+/*
+ * RetryPolicy
+ */
+
+RetryPolicy::RetryPolicy() :
+    d(new Data)
+{
+
+}
+
+int RetryPolicy::maxAttempts() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->maxAttempts;
+}
+
+void RetryPolicy::setMaxAttempts(int attempts)
+{
+    QMutexLocker locker(&d->mutex);
+    d->maxAttempts = qMax(1, attempts);
+}
+
+QList<Exception::Type> RetryPolicy::retryableTypes() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->types;
+}
+
+void RetryPolicy::setRetryableTypes(const QList<Exception::Type> &types)
+{
+    QMutexLocker locker(&d->mutex);
+    d->types = types;
+}
+
+int RetryPolicy::initialBackoff() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->initialBackoff;
+}
+
+void RetryPolicy::setInitialBackoff(int milliseconds)
+{
+    QMutexLocker locker(&d->mutex);
+    d->initialBackoff = qMax(0, milliseconds);
+}
+
+int RetryPolicy::maxBackoff() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->maxBackoff;
+}
+
+void RetryPolicy::setMaxBackoff(int milliseconds)
+{
+    QMutexLocker locker(&d->mutex);
+    d->maxBackoff = qMax(0, milliseconds);
+}
+
+bool RetryPolicy::respectsRetryAfter() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->respectRetryAfter;
+}
+
+void RetryPolicy::setRespectsRetryAfter(bool respect)
+{
+    QMutexLocker locker(&d->mutex);
+    d->respectRetryAfter = respect;
+}
+
+double RetryPolicy::hedgePercentile() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->hedgePercentile;
+}
+
+void RetryPolicy::setHedging(double percentile, int minimumDelay)
+{
+    QMutexLocker locker(&d->mutex);
+    d->hedgePercentile = qBound(0.0, percentile, 1.0);
+    d->hedgeMinimumDelay = qMax(0, minimumDelay);
+}
+
+int RetryPolicy::retries() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->retries;
+}
+
+int RetryPolicy::hedges() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->hedges;
+}
+
+int RetryPolicy::hedgeWins() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->hedgeWins;
+}
+
+/*
+ * Cancellation
+ */
+
+Cancellation::Cancellation() :
+    d(new Data)
+{
+
+}
+
+Cancellation::Cancellation(Data *data) :
+    d(data)
+{
+
+}
+
+void Cancellation::cancel()
+{
+    d->canceled.fetchAndStoreOrdered(1);
+}
+
+bool Cancellation::isCanceled() const
+{
+    return int(d->canceled) != 0;
+}
+
+void Cancellation::reset()
+{
+    d->canceled.fetchAndStoreOrdered(0);
+}
+
+/*
+ * Pagination::Data
+ */
+
+Pagination::Data::Data(Strategy s) :
+    strategy(s),
+    pageParameter("page"),
+    firstPage(1),
+    limit(0),
+    maxPages(0)
+{
+
+}
+
+/*
+ * Pagination
+ */
+
+Pagination::Pagination(Strategy strategy) :
+    d(new Data(strategy))
+{
+
+}
+
+Pagination::Strategy Pagination::strategy() const
+{
+    return d->strategy;
+}
+
+void Pagination::setStrategy(Strategy strategy)
+{
+    d->strategy = strategy;
+}
+
+QString Pagination::pageParameter() const
+{
+    return d->pageParameter;
+}
+
+void Pagination::setPageParameter(const QString &name)
+{
+    d->pageParameter = name;
+}
+
+int Pagination::firstPage() const
+{
+    return d->firstPage;
+}
+
+void Pagination::setFirstPage(int page)
+{
+    d->firstPage = page;
+}
+
+QString Pagination::limitParameter() const
+{
+    return d->limitParameter;
+}
+
+int Pagination::limit() const
+{
+    return d->limit;
+}
+
+void Pagination::setLimit(const QString &name, int limit)
+{
+    d->limitParameter = name;
+    d->limit = qMax(0, limit);
+}
+
+int Pagination::maxPages() const
+{
+    return d->maxPages;
+}
+
+void Pagination::setMaxPages(int count)
+{
+    d->maxPages = qMax(0, count);
+}
+
+/*!
+ * \return \a params with the page size and, unless \a page is negative, the page
+ * number of \a pagination appended.
+ */
+
+static ParamList pageParams(const Pagination &pagination, const ParamList &params, int page)
+{
+    ParamList result = params;
+
+    if(page >= 0)
+    {
+        result.append(Param(pagination.pageParameter(), QString::number(page)));
+    }
+
+    if(!pagination.limitParameter().isEmpty() && pagination.limit() > 0)
+    {
+        result.append(Param(pagination.limitParameter(), QString::number(pagination.limit())));
+    }
+
+    return result;
+}
+
+/*!
+ * A page requested by Resource::Data::fetchPages().  \a linked is set once the
+ * page's Link header has been looked at.  A page that's fresh in the cache
+ * has no transfer; its records are \a cachedRecords.  \a transfer is reset to
+ * 0 when the page is retried, so that it's requested again.
+ */
+
+struct PageRequest
+{
+    PageRequest() :
+        transfer(0), decoder(0), linked(false), attempt(1), conditional(false), fresh(false) {}
+    QUrl url;
+    Resource::Headers headers;
+    HTTP::Transfer *transfer;
+    Decoder *decoder;
+    bool linked;
+    int attempt;
+    QString cacheKey;
+    bool conditional;
+    bool fresh;
+    RecordList cachedRecords;
+};
+
+/*!
+ * \return True if \a page is known to have at least \a limit records, so
+ * that the page after it can't be past the end.  Without a limit that's never
+ * known, so any page counts as full.
+ */
+
+static bool isFull(const PageRequest &page, int limit)
+{
+    if(limit <= 0)
+    {
+        return true;
+    }
+
+    if(page.fresh)
+    {
+        return page.cachedRecords.size() >= limit;
+    }
+
+    return page.decoder && page.decoder->records().size() >= limit;
+}
+
+static void releasePage(HTTP::Multi *multi, PageRequest *page)
+{
+    if(page->transfer)
+    {
+        multi->remove(page->transfer);
+    }
+
+    delete page->transfer;
+    delete page->decoder;
+    page->transfer = 0;
+    page->decoder = 0;
+}
+
+static void releasePages(HTTP::Multi *multi, QList<PageRequest> *pages)
+{
+    for(int i = 0; i < pages->size(); i++)
+    {
+        releasePage(multi, &(*pages)[i]);
+    }
+
+    pages->clear();
+}
+
+/*
+ * Request coalescing
+ */
+
+/*!
+ * A fetch that's in progress and that other threads with the same request wait
+ * for rather than making it themselves.
+ */
+
+struct Flight
+{
+    Flight() : done(false), completed(false), waiters(0) {}
+    QWaitCondition finished;
+    bool done;
+    bool completed;
+    int waiters;
+    RecordList records;
+    QList<Exception> errors;
+};
+
+struct Flights
+{
+    QMutex mutex;
+    QHash<QString, Flight *> inFlight;
+};
+
+Q_GLOBAL_STATIC(Flights, flights)
+
+/*!
+ * Removes a flight once the thread fetching it is done, however it leaves, and
+ * wakes the threads waiting for it.  The last one out deletes the flight.
+ */
+
+class Landing
+{
+public:
+    Landing(Flights *s, const QString &k, Flight *f) : flights(s), key(k), flight(f) {}
+
+    ~Landing()
+    {
+        QMutexLocker locker(&flights->mutex);
+
+        flights->inFlight.remove(key);
+        flight->done = true;
+        flight->finished.wakeAll();
+
+        if(flight->waiters == 0)
+        {
+            delete flight;
+        }
+    }
+
+private:
+    Flights *flights;
+    QString key;
+    Flight *flight;
+};
+
+/*
+ * Resource::Data
+ */
+
+Resource::Data::Data(const QUrl &b, const QString &r) :
+    base(b),
+    resource(r),
+    url(base),
+    followRedirects(false),
+    timeout(DEFAULT_TIMEOUT),
+    format(XmlFormat),
+    encodings(AllEncodings),
+    lazy(false),
+    coalesce(false),
+    cancellation(static_cast<Cancellation::Data *>(0)),
+    cache(static_cast<Cache::Data *>(0)),
+    stats(new Stats)
+{
+    setUrl();
+}
+
+void Resource::Data::setUrl()
+{
+    url = base;
+    url.setPath(join(base.path(), resource));
+}
+
+QString Resource::Data::join(const QString &first, const QString &second)
+{
+    return first + (first.endsWith('/') ? "" : "/") + second;
+}
+
+QUrl Resource::Data::requestUrl(const QString &from, const ParamList &params) const
+{
+    QUrl requestUrl;
+
+    if(from.isEmpty())
+    {
+        requestUrl = url;
+    }
+    else
+    {
+        requestUrl = base;
+        requestUrl.setPath(from);
+    }
+
+    foreach(Param param, params)
+    {
+        if(!param.isNull())
+        {
+            requestUrl.addQueryItem(param.key(), param.value());
+        }
+    }
+
+    QString extension = (format == JsonFormat) ? ".json" : ".xml";
+
+    if(!requestUrl.path().endsWith(extension))
+    {
+        requestUrl.setPath(requestUrl.path() + extension);
+    }
+
+    return requestUrl;
+}
+
+/*!
+ * Fetches the records at \a target.  Records are passed to \a handler or, as
+ * events, to \a builder rather than returned, if one of them is given.  Then
+ * the cache isn't used and the request is neither hedged nor, once anything
+ * has been passed on, retried.
+ */
+
+RecordList Resource::Data::fetch(const QUrl &target, RecordHandler *handler,
+                                 Builder *builder) const
+{
+    Headers requestHeaders = headers;
+    QString cacheKey;
+    Cache::Entry cached;
+    bool conditional = false;
+
+    if(!cache.isNull() && !handler && !builder)
+    {
+        cacheKey = this->cacheKey(target);
+        conditional = cache.d->prepare(cacheKey, &requestHeaders, &cached);
+
+        if(conditional && cache.d->isFresh(cached))
+        {
+            cache.d->hit(cacheKey, false);
+            return cached.records;
+        }
+    }
+
+    CountingHandler counter(handler);
+    CountingBuilder countingBuilder(builder);
+    BuildingHandler building(&countingBuilder);
+    RecordHandler *decoderHandler = 0;
+
+    if(builder)
+    {
+        decoderHandler = &building;
+    }
+    else if(handler)
+    {
+        decoderHandler = &counter;
+    }
+
+    for(int attempt = 1; ; attempt++)
+    {
+        // Hedging would pass the records of both requests to the handler.
+
+        int hedgeDelay = handler || builder ? -1 : retryPolicy.d->hedgeDelay();
+
+        QScopedPointer<Decoder> decoder(createDecoder(format, resource, decoderHandler, fields,
+                                                      lazy, builder ? &countingBuilder : 0));
+        QScopedPointer<Decoder> hedgeDecoder;
+        QScopedPointer<HTTP::Transfer> hedge;
+        HTTP::Transfer transfer(target, followRedirects, timeout, requestHeaders);
+        transfer.canceled = canceled();
+        transfer.decoder = decoder.data();
+        transfer.encoding = HTTP::acceptEncoding(encodings);
+        transfer.conditional = conditional;
+
+        HTTP::Transfer *winner = &transfer;
+        QElapsedTimer timer;
+        timer.start();
+
+        try
+        {
+            if(hedgeDelay >= 0)
+            {
+                hedgeDecoder.reset(createDecoder(format, resource, 0, fields, lazy));
+                winner = HTTP::performHedged(&transfer, hedgeDelay, hedgeDecoder.data(), hedge);
+            }
+            else
+            {
+                transfer.perform();
+            }
+        }
+        catch(const Exception &exception)
+        {
+            if(hedge)
+            {
+                retryPolicy.d->hedged(false);
+            }
+
+            int passed = builder ? countingBuilder.count + countingBuilder.depth : counter.count;
+            int delay = passed > 0 ? -1 : retryPolicy.d->retryDelay(exception, attempt);
+
+            if(delay < 0)
+            {
+                throw;
+            }
+
+            if(getenv(QAR_DEBUG))
+            {
+                qDebug() << "Retrying" << target.toString(QUrl::RemoveUserInfo)
+                         << "in" << delay << "ms after" << exception.message();
+            }
+
+            if(!waitUnlessCanceled(delay, canceled()))
+            {
+                throw Exception(Exception::Canceled, exception.response(), "Canceled");
+            }
+
+            continue;
+        }
+
+        if(hedge)
+        {
+            retryPolicy.d->hedged(winner != &transfer);
+        }
+
+        retryPolicy.d->addLatency(timer.nsecsElapsed() / 1000000.0);
+
+        RecordList records;
+
+        if(winner->notModified)
+        {
+            cache.d->hit(cacheKey, true);
+            records = cached.records;
+        }
+        else if(!winner->stopped)
+        {
+            QElapsedTimer parseTimer;
+            parseTimer.start();
+
+            records = finishDecoding(winner->decoder, winner == &transfer ? decoderHandler : 0);
+            winner->parseTime += parseTimer.nsecsElapsed();
+
+            if(!cacheKey.isEmpty())
+            {
+                cache.d->store(cacheKey, winner->headers, records);
+            }
+        }
+
+        Timings timings = winner->timings();
+        timings.records = builder ? countingBuilder.count : handler ? counter.count : records.size();
+        setLastTimings(timings);
+
+        if(getenv(QAR_DEBUG))
+        {
+            qDebug() << "GET" << target.toString(QUrl::RemoveUserInfo)
+                     << "dns" << timings.nameLookup
+                     << "connect" << timings.connect
+                     << "tls" << timings.appConnect
+                     << "first byte" << timings.startTransfer
+                     << "total" << timings.total
+                     << "bytes" << timings.bytesDownloaded
+                     << "parse" << timings.parse
+                     << "records" << timings.records;
+        }
+
+        return records;
+    }
+}
+
+/*
+ * Resource::AsyncFind
+ */
+
+/*!
+ * A find started by findAsync().  It owns its transfer, reports the outcome to
+ * the future once the thread's SocketLoop has finished the transfer and then
+ * deletes itself.  With FindAllPages the pages are requested one after another
+ * and their records are reported together.
+ */
+
+class Resource::AsyncFind : public HTTP::Receiver
+{
+public:
+    AsyncFind(const Resource &r, const QFutureInterface<RecordList> &f, const QString &path,
+              const ParamList &p, bool allPages) :
+        resource(r),
+        future(f),
+        from(path),
+        params(p),
+        paged(allPages),
+        pages(0)
+    {
+
+    }
+
+    /*!
+     * Requests \a target.  If \a conditional is true the request is made
+     * conditional on \a entry, which is cached under \a key.
+     */
+    void start(const QUrl &target, const Headers &requestHeaders, const QString &key,
+               const Cache::Entry &entry, bool conditional)
+    {
+        const Resource::Data *data = resource.d.constData();
+
+        cacheKey = key;
+        cached = entry;
+
+        decoder.reset(createDecoder(data->format, data->resource, 0, data->fields, data->lazy));
+        transfer.reset(new HTTP::Transfer(target, data->followRedirects, data->timeout,
+                                          requestHeaders));
+        transfer->canceled = data->canceled();
+        transfer->decoder = decoder.data();
+        transfer->encoding = HTTP::acceptEncoding(data->encodings);
+        transfer->conditional = conditional;
+
+        pages++;
+
+        HTTP::SocketLoop::forThread()->add(transfer.data(), this);
+    }
+
+    bool isCanceled() const
+    {
+        return future.isCanceled();
+    }
+
+    void finished(HTTP::Transfer *)
+    {
+        const Resource::Data *data = resource.d.constData();
+
+        try
+        {
+            if(!transfer->errors.isEmpty())
+            {
+                throw transfer->errors.front();
+            }
+
+            RecordList page;
+
+            if(transfer->notModified)
+            {
+                data->cache.d->hit(cacheKey, true);
+                page = cached.records;
+            }
+            else
+            {
+                QElapsedTimer timer;
+                timer.start();
+
+                page = finishDecoding(decoder.data(), 0);
+                transfer->parseTime += timer.nsecsElapsed();
+
+                if(!cacheKey.isEmpty())
+                {
+                    data->cache.d->store(cacheKey, transfer->headers, page);
+                }
+            }
+
+            Timings timings = transfer->timings();
+            timings.records = page.size();
+            data->setLastTimings(timings);
+
+            records += page;
+
+            QUrl next = paged ? nextPage(page) : QUrl();
+
+            if(!next.isEmpty())
+            {
+                // This may finish and delete the find right away.
+
+                start(next, data->headers, QString(), Cache::Entry(), false);
+                return;
+            }
+
+            future.reportResult(records);
+        }
+        catch(const Exception &exception)
+        {
+            future.reportException(exception);
+        }
+
+        future.reportFinished();
+
+        delete this;
+    }
+
+private:
+    /*!
+     * \return The URL of the page after the one that returned \a page, or an
+     * empty URL if that was the last one, as with Resource::Data::fetchPages().
+     */
+    QUrl nextPage(const RecordList &page) const
+    {
+        const Pagination &pagination = resource.d.constData()->pagination;
+
+        if(page.isEmpty() || (pagination.limit() > 0 && page.size() < pagination.limit()) ||
+           (pagination.maxPages() > 0 && pages >= pagination.maxPages()))
+        {
+            return QUrl();
+        }
+
+        if(pagination.strategy() == Pagination::LinkHeader)
+        {
+            return HTTP::nextLink(transfer->url, transfer->headers);
+        }
+
+        return resource.d.constData()->requestUrl(
+            from, pageParams(pagination, params, pagination.firstPage() + pages));
+    }
+
+    Resource resource;
+    QFutureInterface<RecordList> future;
+    QString from;
+    ParamList params;
+    bool paged;
+    int pages;
+    QScopedPointer<Decoder> decoder;
+    QScopedPointer<HTTP::Transfer> transfer;
+    QString cacheKey;
+    Cache::Entry cached;
+    RecordList records;
+};
+
+/*!
+ * Like fetch(), but if another thread is already fetching the same URL with the
+ * same headers, waits for it and returns its records (or throws its exception)
+ * instead of making a request of its own.
+ */
+
+RecordList Resource::Data::fetchShared(const QUrl &target) const
+{
+    QString key = cacheKey(target);
+    Flights *shared = flights();
+    QMutexLocker locker(&shared->mutex);
+
+    while(shared->inFlight.contains(key))
+    {
+        Flight *flight = shared->inFlight.value(key);
+        flight->waiters++;
+
+        while(!flight->done)
+        {
+            flight->finished.wait(&shared->mutex);
+        }
+
+        flight->waiters--;
+
+        bool completed = flight->completed;
+        RecordList records = flight->records;
+        QList<Exception> errors = flight->errors;
+
+        if(flight->waiters == 0)
+        {
+            delete flight;
+        }
+
+        if(!errors.isEmpty())
+        {
+            throw errors.front();
+        }
+
+        if(completed)
+        {
+            return records;
+        }
+
+        // The fetch was abandoned by something other than an Exception, so the
+        // first waiter to get here makes the request itself.
+    }
+
+    Flight *flight = new Flight;
+    shared->inFlight[key] = flight;
+    locker.unlock();
+
+    Landing landing(shared, key, flight);
+
+    try
+    {
+        flight->records = fetch(target);
+        flight->completed = true;
+    }
+    catch(const Exception &exception)
+    {
+        // A canceled fetch is abandoned so that the waiters try again.
+
+        if(exception.type() != Exception::Canceled)
+        {
+            flight->errors.append(exception);
+        }
+
+        throw;
+    }
+
+    return flight->records;
+}
+
+/*!
+ * \return The key of \a target's records in the cache, which includes the
+ * headers and the selected fields.
+ */
+
+QString Resource::Data::cacheKey(const QUrl &target) const
+{
+    QString key = Cache::Data::key(target, headers);
+
+    if(!fields.isEmpty())
+    {
+        key += "\n#fields: " + fields.join(",");
+    }
+
+    return key;
+}
+
+/*!
+ * \return The flag that transfers check for cancellation, or 0 if there's no
+ * Cancellation.
+ */
+
+QAtomicInt *Resource::Data::canceled() const
+{
+    return cancellation.d ? &cancellation.d->canceled : 0;
+}
+
+void Resource::Data::setLastTimings(const Timings &timings) const
+{
+    QMutexLocker locker(&stats->mutex);
+    stats->last = timings;
+}
+
+/*!
+ * Fetches pages in order with at most two of them in flight: the one whose
+ * records are delivered next and the one after it.  Each page has its own
+ * decoder, so the prefetched page is decoded as it arrives too, and its records
+ * are only delivered once all pages before it have been.  With a page size,
+ * the next page is only requested once the current one has decoded a full
+ * page of records.
+ *
+ * Failed pages are retried according to the retry policy, which is safe since
+ * none of a page's records have been delivered before it's complete.  Pages
+ * found by number are cached as with fetch() when there's no handler; pages
+ * found through Link headers aren't, since a cached page doesn't know its next
+ * link.
+ */
+
+RecordList Resource::Data::fetchPages(const QString &from, const ParamList &params,
+                                      RecordHandler *handler) const
+{
+    const Pagination::Strategy strategy = pagination.strategy();
+    const int maxPages = pagination.maxPages();
+    const int limit = pagination.limit();
+    const bool cached = !cache.isNull() && !handler && strategy == Pagination::PageParameter;
+
+    HTTP::Multi multi;
+    QList<PageRequest> pages;
+    RecordList records;
+    int started = 0;
+    bool done = false;
+
+    QUrl next = requestUrl(from, pageParams(pagination, params,
+        strategy == Pagination::PageParameter ? pagination.firstPage() : -1));
+
+    try
+    {
+        while(true)
+        {
+            if(strategy == Pagination::LinkHeader && !pages.isEmpty() && !pages.back().linked)
+            {
+                HTTP::Transfer *transfer = pages.back().transfer;
+
+                if(transfer && (transfer->headersComplete ||
+                                (transfer->finished && transfer->errors.isEmpty())))
+                {
+                    pages.back().linked = true;
+                    next = HTTP::nextLink(transfer->url, transfer->headers);
+                }
+            }
+
+            while(!done && !next.isEmpty() && pages.size() < 2 &&
+                  (maxPages <= 0 || started < maxPages) &&
+                  (pages.isEmpty() || isFull(pages.back(), limit)))
+            {
+                PageRequest page;
+                page.url = next;
+                page.headers = headers;
+
+                if(cached)
+                {
+                    Cache::Entry entry;
+                    page.cacheKey = cacheKey(next);
+                    page.conditional = cache.d->prepare(page.cacheKey, &page.headers, &entry);
+                    page.cachedRecords = entry.records;
+
+                    if(page.conditional && cache.d->isFresh(entry))
+                    {
+                        cache.d->hit(page.cacheKey, false);
+                        page.fresh = true;
+                    }
+                }
+
+                pages.append(page);
+                started++;
+
+                next = (strategy == Pagination::PageParameter) ?
+                    requestUrl(from, pageParams(pagination, params, pagination.firstPage() + started)) :
+                    QUrl();
+            }
+
+            if(pages.isEmpty())
+            {
+                break;
+            }
+
+            // Requests new pages and pages that are being retried.
+
+            for(int i = 0; i < pages.size(); i++)
+            {
+                PageRequest &page = pages[i];
+
+                if(!page.fresh && !page.transfer)
+                {
+                    page.decoder = createDecoder(format, resource, 0, fields, lazy);
+                    page.transfer = new HTTP::Transfer(page.url, followRedirects, timeout,
+                                                       page.headers);
+                    page.transfer->canceled = canceled();
+                    page.transfer->decoder = page.decoder;
+                    page.transfer->encoding = HTTP::acceptEncoding(encodings);
+                    page.transfer->conditional = page.conditional;
+                    multi.add(page.transfer);
+                }
+            }
+
+            multi.perform();
+
+            while(!pages.isEmpty() && (pages.front().fresh || pages.front().transfer->finished))
+            {
+                PageRequest &page = pages.front();
+                RecordList pageRecords;
+
+                if(page.fresh)
+                {
+                    pageRecords = page.cachedRecords;
+                }
+                else
+                {
+                    QList<Exception> errors = page.transfer->errors;
+
+                    if(!errors.isEmpty())
+                    {
+                        int delay = retryPolicy.d->retryDelay(errors.front(), page.attempt);
+
+                        if(delay < 0)
+                        {
+                            throw errors.front();
+                        }
+
+                        if(getenv(QAR_DEBUG))
+                        {
+                            qDebug() << "Retrying" << page.url.toString(QUrl::RemoveUserInfo)
+                                     << "in" << delay << "ms after" << errors.front().message();
+                        }
+
+                        releasePage(&multi, &page);
+                        page.attempt++;
+
+                        if(!waitUnlessCanceled(delay, canceled()))
+                        {
+                            throw Exception(Exception::Canceled, errors.front().response(),
+                                            "Canceled");
+                        }
+
+                        break;
+                    }
+
+                    if(strategy == Pagination::LinkHeader && !page.linked)
+                    {
+                        next = HTTP::nextLink(page.transfer->url, page.transfer->headers);
+                    }
+
+                    if(page.transfer->notModified)
+                    {
+                        cache.d->hit(page.cacheKey, true);
+                        pageRecords = page.cachedRecords;
+                    }
+                    else
+                    {
+                        QElapsedTimer timer;
+                        timer.start();
+
+                        page.decoder->finish();
+                        pageRecords = page.decoder->records();
+                        page.transfer->parseTime += timer.nsecsElapsed();
+
+                        if(!page.cacheKey.isEmpty())
+                        {
+                            cache.d->store(page.cacheKey, page.transfer->headers, pageRecords);
+                        }
+                    }
+
+                    Timings timings = page.transfer->timings();
+                    timings.records = pageRecords.size();
+                    setLastTimings(timings);
+
+                    releasePage(&multi, &page);
+                }
+
+                pages.removeFirst();
+
+                if(pageRecords.isEmpty() || (limit > 0 && pageRecords.size() < limit))
+                {
+                    done = true;
+                }
+
+                if(handler)
+                {
+                    foreach(Record record, pageRecords)
+                    {
+                        if(!handler->handle(record))
+                        {
+                            done = true;
+                            break;
+                        }
+                    }
+                }
+                else
+                {
+                    records += pageRecords;
+                }
+
+                if(done)
+                {
+                    releasePages(&multi, &pages);
+                }
+            }
+
+            if(!pages.isEmpty() && !pages.front().fresh && pages.front().transfer)
+            {
+                multi.wait();
+            }
+        }
+    }
+    catch(...)
+    {
+        releasePages(&multi, &pages);
+        throw;
+    }
+
+    return records;
+}
+
+/*
+ * Resource
+ */
+
+Resource::Resource(const QUrl &base, const QString &resource) :
+    d(new Data(base, resource))
+{
+
+}
+
+void Resource::setBase(const QUrl &base)
+{
+    d->base = base;
+    d->setUrl();
+}
+
+void Resource::setResource(const QString &resource)
+{
+    d->resource = resource;
+    d->setUrl();
+}
+
+void Resource::setHeaders(const Headers &headers)
+{
+    d->headers = headers;
+}
+
+Record Resource::find(const QVariant &id) const
+{
+    return find(FindOne, Data::join(d->url.path(), id.toString()));
+}
+
+RecordList Resource::find(FindMulti style, const QString &from, const ParamList &params) const
+{
+    if(style == FindAllPages)
+    {
+        return d->fetchPages(from, params);
+    }
+
+    QUrl url = d->requestUrl(from, params);
+
+    return d->coalesce ? d->fetchShared(url) : d->fetch(url);
+}
+
+void Resource::findEach(FindMulti style, const QString &from, const ParamList &params,
+                        RecordHandler *handler) const
+{
+    if(style == FindAllPages)
+    {
+        d->fetchPages(from, params, handler);
+        return;
+    }
+
+    d->fetch(d->requestUrl(from, params), handler);
+}
+
+QFuture<RecordList> Resource::findAsync(FindMulti style, const QString &from,
+                                       const ParamList &params) const
+{
+    QFutureInterface<RecordList> future;
+    future.reportStarted();
+
+    AsyncFind *find = new AsyncFind(*this, future, from, params, style == FindAllPages);
+
+    if(style == FindAllPages)
+    {
+        const Pagination::Strategy strategy = d->pagination.strategy();
+
+        find->start(d->requestUrl(from, pageParams(d->pagination, params,
+                        strategy == Pagination::PageParameter ? d->pagination.firstPage() : -1)),
+                    d->headers, QString(), Cache::Entry(), false);
+
+        return future.future();
+    }
+
+    QUrl target = d->requestUrl(from, params);
+    Headers requestHeaders = d->headers;
+    QString cacheKey;
+    Cache::Entry cached;
+    bool conditional = false;
+
+    if(!d->cache.isNull())
+    {
+        cacheKey = d->cacheKey(target);
+        conditional = d->cache.d->prepare(cacheKey, &requestHeaders, &cached);
+
+        if(conditional && d->cache.d->isFresh(cached))
+        {
+            delete find;
+
+            d->cache.d->hit(cacheKey, false);
+            future.reportResult(cached.records);
+            future.reportFinished();
+            return future.future();
+        }
+    }
+
+    find->start(target, requestHeaders, cacheKey, cached, conditional);
+
+    return future.future();
+}
+
+void Resource::build(FindMulti style, const QString &from, const ParamList &params,
+                     Builder *builder) const
+{
+    if(style == FindAllPages)
+    {
+        BuildingHandler handler(builder);
+        d->fetchPages(from, params, &handler);
+        return;
+    }
+
+    QUrl url = d->requestUrl(from, params);
+
+    // Cached and shared records are only available as records.
+
+    if(!d->cache.isNull() || d->coalesce)
+    {
+        foreach(Record record, d->coalesce ? d->fetchShared(url) : d->fetch(url))
+        {
+            ::build(record, builder);
+        }
+
+        return;
+    }
+
+    d->fetch(url, 0, builder);
+}
+
+void Resource::build(const QVariant &id, Builder *builder) const
+{
+    build(FindAll, Data::join(d->url.path(), id.toString()), ParamList(), builder);
+}
+
+Record Resource::find(FindSingle style, const QString &from, const ParamList &params) const
+{
+    QUrl url = d->url;
+
+    switch(style)
+    {
+    case FindOne:
+    case FindFirst:
+    {
+        RecordList results = find(FindAll, from, params);
+        return results.isEmpty() ? Record() : results.front();
+    }
+    case FindLast:
+    {
+        RecordList results = find(FindAll, from, params);
+        return results.isEmpty() ? Record() : results.back();
+    }
+    }
+
+    return Record();
+}
+
+Record Resource::find(FindSingle style, const QString &from,
+                      const Param &first, const Param &second,
+                      const Param &third, const Param &fourth) const
+{
+    return find(style, from, ParamList() << first << second << third << fourth);
+}
+
+RecordList Resource::find(FindMulti style, const QString &from,
+                          const Param &first, const Param &second,
+                          const Param &third, const Param &fourth) const
+{
+    return find(style, from, ParamList() << first << second << third << fourth);
+}
+
+void Resource::setFollowRedirects(bool followRedirects)
+{
+    d->followRedirects = followRedirects;
+}
+
+int Resource::timeout() const
+{
+    return d->timeout;
+}
+
+void Resource::setTimeout(int timeout)
+{
+    d->timeout = timeout;
+}
+
+Format Resource::format() const
+{
+    return d->format;
+}
+
+void Resource::setFormat(Format format)
+{
+    d->format = format;
+}
+
+Timings Resource::lastTimings() const
+{
+    QMutexLocker locker(&d->stats->mutex);
+    return d->stats->last;
+}
+
+QStringList Resource::fields() const
+{
+    return d->fields;
+}
+
+void Resource::setFields(const QStringList &fields)
+{
+    d->fields = fields;
+}
+
+bool Resource::lazy() const
+{
+    return d->lazy;
+}
+
+void Resource::setLazy(bool lazy)
+{
+    d->lazy = lazy;
+}
+
+void Resource::setCancellation(const Cancellation &cancellation)
+{
+    d->cancellation = cancellation;
+}
+
+bool Resource::coalescing() const
+{
+    return d->coalesce;
+}
+
+void Resource::setCoalescing(bool coalesce)
+{
+    d->coalesce = coalesce;
+}
+
+RetryPolicy Resource::retryPolicy() const
+{
+    return d->retryPolicy;
+}
+
+void Resource::setRetryPolicy(const RetryPolicy &policy)
+{
+    d->retryPolicy = policy;
+}
+
+Pagination Resource::pagination() const
+{
+    return d->pagination;
+}
+
+void Resource::setPagination(const Pagination &pagination)
+{
+    d->pagination = pagination;
+}
+
+Encodings Resource::encodings() const
+{
+    return d->encodings;
+}
+
+void Resource::setEncodings(Encodings encodings)
+{
+    d->encodings = encodings;
+}
+
+Cache Resource::cache() const
+{
+    return d->cache;
+}
+
+void Resource::setCache(const Cache &cache)
+{
+    d->cache = cache;
+}
+
+void Resource::removeCache()
+{
+    d->cache = Cache(static_cast<Cache::Data *>(0));
+}
+
+/*
+ * Batch::Data
+ */
+
+Batch::Data::Data() :
+    maxConcurrent(DEFAULT_CONCURRENCY)
+{
+
+}
+
+/*
+ * Batch
+ */
+
+Batch::Batch() :
+    d(new Data)
+{
+
+}
+
+int Batch::add(const Resource &resource, FindMulti style, const QString &from,
+               const ParamList &params)
+{
+    Entry entry;
+    entry.resource = resource;
+    entry.style = style;
+    entry.from = from;
+    entry.params = params;
+    entry.finished = false;
+    d->entries.append(entry);
+
+    return d->entries.size() - 1;
+}
+
+int Batch::size() const
+{
+    return d->entries.size();
+}
+
+void Batch::clear()
+{
+    d->entries.clear();
+}
+
+int Batch::maxConcurrent() const
+{
+    return d->maxConcurrent;
+}
+
+void Batch::setMaxConcurrent(int count)
+{
+    d->maxConcurrent = qMax(1, count);
+}
+
+void Batch::exec()
+{
+    QList<int> indexes;
+    QList<HTTP::Transfer *> transfers;
+    QList<Decoder *> decoders;
+    QStringList cacheKeys;
+    QList<Cache::Entry> cached;
+
+    for(int i = 0; i < d->entries.size(); i++)
+    {
+        Entry &entry = d->entries[i];
+
+        if(!entry.finished && entry.style == FindAll)
+        {
+            const Resource::Data *resource = entry.resource.d.constData();
+            QUrl url = resource->requestUrl(entry.from, entry.params);
+            Resource::Headers headers = resource->headers;
+            QString cacheKey;
+            Cache::Entry cacheEntry;
+            bool conditional = false;
+
+            if(!resource->cache.isNull())
+            {
+                cacheKey = resource->cacheKey(url);
+                conditional = resource->cache.d->prepare(cacheKey, &headers, &cacheEntry);
+
+                if(conditional && resource->cache.d->isFresh(cacheEntry))
+                {
+                    resource->cache.d->hit(cacheKey, false);
+                    entry.records = cacheEntry.records;
+                    entry.finished = true;
+                    continue;
+                }
+            }
+
+            indexes.append(i);
+            cacheKeys.append(cacheKey);
+            cached.append(cacheEntry);
+            decoders.append(createDecoder(resource->format, resource->resource, 0,
+                                          resource->fields, resource->lazy));
+            transfers.append(new HTTP::Transfer(url, resource->followRedirects,
+                                                resource->timeout, headers));
+            transfers.back()->decoder = decoders.back();
+            transfers.back()->canceled = resource->canceled();
+            transfers.back()->encoding = HTTP::acceptEncoding(resource->encodings);
+            transfers.back()->conditional = conditional;
+        }
+    }
+
+    HTTP::perform(transfers, d->maxConcurrent);
+
+    for(int i = 0; i < transfers.size(); i++)
+    {
+        Entry &entry = d->entries[indexes[i]];
+        const Cache &cache = entry.resource.d.constData()->cache;
+
+        if(transfers[i]->errors.isEmpty() && transfers[i]->notModified)
+        {
+            cache.d->hit(cacheKeys[i], true);
+            entry.records = cached[i].records;
+        }
+        else if(transfers[i]->errors.isEmpty())
+        {
+            QElapsedTimer timer;
+            timer.start();
 
-                assign(&record, name, array);
-            }
-            else if(xml.attributes().value("nil") == "true")
+            decoders[i]->finish();
+            entry.records = decoders[i]->records();
+            transfers[i]->parseTime += timer.nsecsElapsed();
+
+            if(!cacheKeys[i].isEmpty())
             {
-                assign(&record, xml.name().toString(), QVariant());
+                cache.d->store(cacheKeys[i], transfers[i]->headers, entry.records);
             }
-            else if((advance && xml.name() != elementName) || isHash)
-            {
-                QString name = xml.name().toString();
+        }
+        else
+        {
+            entry.errors = transfers[i]->errors;
+        }
 
-                while(xml.readNext() && xml.isWhitespace()) {}
+        if(transfers[i]->errors.isEmpty())
+        {
+            Timings timings = transfers[i]->timings();
+            timings.records = entry.records.size();
+            entry.resource.d.constData()->setLastTimings(timings);
+        }
 
-                if(xml.tokenType() == QXmlStreamReader::StartElement)
-                {
-                    Record sub;
-                    sub.setClassName(toClassName(name));
+        entry.finished = true;
+    }
 
-                    while(hasNext(xml))
-                    {
-                        if(!xml.isWhitespace())
-                        {
-                            QString subName = xml.name().toString();
-                            assign(&sub, subName, extractFromRecord(reader(xml, false, true)));
-                        }
-                        xml.readNext();
-                    }
+    qDeleteAll(transfers);
+    qDeleteAll(decoders);
 
-                    assign(&record, name, sub);
-                }
-                else
-                {
-                    QVariant value;
-                    QString text = xml.text().toString();
+    // Paginated finds depend on the previous page's response, so they don't
+    // fit in a single round of transfers.
 
-                    switch(lookupType(type))
-                    {
-                    case QVariant::Int:
-                        value = text.toInt();
-                        break;
-                    case QVariant::Double:
-                        value = text.toDouble();
-                        break;
-                    case QVariant::DateTime:
-                        value = toDateTime(text);
-                        break;
-                    case QVariant::Bool:
-                        value = bool(text == "true");
-                        break;
-                    default:
-                        value = text.isEmpty() ? QVariant() : text;
-                    }
+    for(int i = 0; i < d->entries.size(); i++)
+    {
+        Entry &entry = d->entries[i];
 
-                    assign(&record, name, value);
-                }
-            }
-        }
-        if(xml.tokenType() == QXmlStreamReader::EndElement &&
-           !elementName.isNull() && elementName == xml.name())
+        if(!entry.finished)
         {
-            record.setClassName(toClassName(elementName));
-            return record;
-        }
+            try
+            {
+                entry.records = entry.resource.find(entry.style, entry.from, entry.params);
+            }
+            catch(const Exception &exception)
+            {
+                entry.errors.append(exception);
+            }
 
-        advance = true;
+            entry.finished = true;
+        }
     }
+}
+
+bool Batch::isFinished(int index) const
+{
+    return d->entries[index].finished;
+}
 
-    return QVariant();
+bool Batch::hasError(int index) const
+{
+    return !d->entries[index].errors.isEmpty();
 }
 
-static RecordList fetch(QUrl url, bool followRedirects, int timeout,
-                        const QActiveResource::Resource::Headers &headers)
+RecordList Batch::result(int index) const
 {
-    if(!url.path().endsWith(".xml"))
+    const Entry &entry = d->entries[index];
+
+    if(!entry.errors.isEmpty())
     {
-        url.setPath(url.path() + ".xml");
+        throw entry.errors.front();
     }
 
-    QByteArray data = HTTP::get(url, followRedirects, timeout, headers);
+    return entry.records;
+}
 
-    QXmlStreamReader xml(data);
+/*
+ * Executor::Task
+ */
 
-    QVariant value = reader(xml, true, false);
-    RecordList records;
+class Executor::Task : public QRunnable
+{
+public:
+    Task(const QExplicitlySharedDataPointer<State> &state, int index, int generation,
+         const Resource &resource, FindMulti style, const QString &from,
+         const ParamList &params) :
+        m_state(state),
+        m_index(index),
+        m_generation(generation),
+        m_resource(resource),
+        m_style(style),
+        m_from(from),
+        m_params(params)
+    {
 
-    if(value.type() == QVariant::List)
+    }
+
+    void run()
     {
-        foreach(QVariant v, value.toList())
+        RecordList records;
+        QList<Exception> errors;
+
+        try
         {
-            records.append(v.toHash());
+            records = m_resource.find(m_style, m_from, m_params);
         }
-    }
-    else if(value.type() == QVariant::Hash && value.toHash().size() == 2)
-    {
-        foreach(QVariant v, extractFromRecord(value).toList())
+        catch(const Exception &exception)
         {
-            records.append(v.toHash());
+            errors.append(exception);
         }
-    }
-    else if(value.isValid())
-    {
-        records.append(value.toHash());
+
+        QMutexLocker locker(&m_state->mutex);
+
+        // clear() waits for running tasks, so the entry is still there.
+
+        Q_ASSERT(m_state->generation == m_generation);
+
+        Entry &entry = m_state->entries[m_index];
+        entry.records = records;
+        entry.errors = errors;
+        entry.finished = true;
+
+        m_state->running--;
+        m_state->finished.wakeAll();
     }
 
-    return records;
-}
+private:
+    QExplicitlySharedDataPointer<State> m_state;
+    int m_index;
+    int m_generation;
+    Resource m_resource;
+    FindMulti m_style;
+    QString m_from;
+    ParamList m_params;
+};
 
 /*
- * Response
+ * Executor::State
  */
 
-Response::Data::Data(Code c, const Headers &h, const QByteArray &d) :
-    code(c),
-    headers(h),
-    data(d)
-{
+/*!
+ * \return The exception for an index that clear() invalidated.
+ */
 
+static Exception invalidIndex()
+{
+    return Exception(Exception::Canceled, Response(0, Response::Headers(), QByteArray()),
+                     "Invalid or cleared Executor index");
 }
 
-Response::Response(Code code, const Headers &headers, const QByteArray &data) :
-    d(new Data(code, headers, data))
+Executor::State::State() :
+    running(0),
+    clearing(0),
+    generation(0)
 {
 
 }
 
-Response::Code Response::code() const
-{
-    return d->code;
-}
+/*!
+ * \return The entry at \a index.  The mutex must be locked.
+ */
 
-Response::Headers Response::headers() const
+const Executor::Entry &Executor::State::entry(int index) const
 {
-    return d->headers;
+    if(index < 0 || index >= entries.size())
+    {
+        throw invalidIndex();
+    }
+
+    return entries.at(index);
 }
 
-QByteArray Response::data() const
+/*
+ * Executor::Data
+ */
+
+Executor::Data::Data(int maxThreads) :
+    state(new State)
 {
-    return d->data;
+    pool.setMaxThreadCount(maxThreads > 0 ? maxThreads : QThread::idealThreadCount());
 }
 
 /*
- * Exception
+ * Executor
  */
 
-Exception::Data::Data(Type t, const Response &r, const QString &m) :
-    type(t),
-    response(r),
-    message(m)
+Executor::Executor(int maxThreads) :
+    d(new Data(maxThreads))
 {
 
 }
 
-Exception::Exception(Type type, const Response &response, const QString &message) :
-    d(new Data(type, response, message))
+int Executor::add(const Resource &resource, FindMulti style, const QString &from,
+                  const ParamList &params)
 {
+    State *state = d->state.data();
+    QMutexLocker locker(&state->mutex);
 
-}
+    while(state->clearing > 0)
+    {
+        state->finished.wait(&state->mutex);
+    }
 
-Exception::Type Exception::type() const
-{
-    return d->type;
-}
+    state->entries.append(Entry());
+    state->running++;
+    int index = state->entries.size() - 1;
 
-Response Exception::response() const
-{
-    return d->response;
+    d->pool.start(new Task(d->state, index, state->generation, resource, style, from, params));
+
+    return index;
 }
 
-QString Exception::message() const
+int Executor::size() const
 {
-    return d->message;
+    QMutexLocker locker(&d->state->mutex);
+    return d->state->entries.size();
 }
 
-/*
- * Record
+/*!
+ * The tasks are waited for under the mutex rather than with the pool, so that
+ * add() can't start one between the wait and the clearing of the entries it
+ * writes to.
  */
 
-Record::Record(const QVariantHash &hash) :
-    d(new Data)
+void Executor::clear()
 {
-    d->hash = hash;
-    d->className = d->hash.take(QActiveResourceClassKey).toString();
-}
+    State *state = d->state.data();
+    QMutexLocker locker(&state->mutex);
 
-Record::Record(const QVariant &v) :
-    d(new Data)
-{
-    d->hash = v.toHash();
-    d->className = d->hash.take(QActiveResourceClassKey).toString();
-}
+    state->clearing++;
 
-QVariant &Record::operator[](const QString &key)
-{
-    return d->hash[key];
-}
+    while(state->running > 0)
+    {
+        state->finished.wait(&state->mutex);
+    }
 
-QVariant Record::operator[](const QString &key) const
-{
-    return d->hash[key];
+    state->entries.clear();
+    state->generation++;
+    state->clearing--;
+    state->finished.wakeAll();
 }
 
-bool Record::isEmpty() const
+int Executor::maxThreads() const
 {
-    return d->hash.isEmpty();
+    return d->pool.maxThreadCount();
 }
 
-QString Record::className() const
+void Executor::setMaxThreads(int count)
 {
-    return d->className;
+    d->pool.setMaxThreadCount(qMax(1, count));
 }
 
-void Record::setClassName(const QString &name)
+void Executor::waitForDone()
 {
-    d->className = name;
+    d->pool.waitForDone();
 }
 
-Record::operator QVariant() const
+bool Executor::isFinished(int index) const
 {
-    QVariantHash hash = d->hash;
-    hash[QActiveResourceClassKey] = d->className;
-    return hash;
+    QMutexLocker locker(&d->state->mutex);
+    return d->state->entry(index).finished;
 }
 
-Record::ConstIterator Record::begin() const
+bool Executor::hasError(int index) const
 {
-    return d->hash.begin();
+    QMutexLocker locker(&d->state->mutex);
+    return !d->state->entry(index).errors.isEmpty();
 }
 
-Record::ConstIterator Record::end() const
+/*!
+ * The generation is compared after each wait, since a clear() while waiting
+ * may have let later finds reuse the index.
+ */
+
+RecordList Executor::result(int index) const
 {
-    return d->hash.end();
+    State *state = d->state.data();
+    QMutexLocker locker(&state->mutex);
+
+    int generation = state->generation;
+
+    while(!state->entry(index).finished)
+    {
+        state->finished.wait(&state->mutex);
+
+        if(state->generation != generation)
+        {
+            throw invalidIndex();
+        }
+    }
+
+    const Entry &entry = state->entry(index);
+
+    if(!entry.errors.isEmpty())
+    {
+        throw entry.errors.front();
+    }
+
+    return entry.records;
 }
 
 /*
- * Param::Data
+ * Parser::Data
  */
 
-Param::Data::Data(const QString &k, const QString &v) :
-    key(k),
-    value(v)
+Parser::Data::Data(Format f, const QString &r) :
+    format(f),
+    resource(r),
+    lazy(false)
 {
 
 }
 
 /*
- * Param
+ * Parser
  */
 
-Param::Param() :
-    d(0)
+Parser::Parser(Format format, const QString &resource) :
+    d(new Data(format, resource))
 {
 
 }
 
-Param::Param(const QString &key, const QString &value) :
-    d(new Data(key, value))
+Format Parser::format() const
 {
-
+    return d->format;
 }
 
-bool Param::isNull() const
+void Parser::setFormat(Format format)
 {
-    return d == 0;
+    d->format = format;
 }
 
-QString Param::key() const
+QString Parser::resource() const
 {
-    return isNull() ? QString() : d->key;
+    return d->resource;
 }
 
-QString Param::value() const
+void Parser::setResource(const QString &resource)
 {
-    return isNull() ? QString() : d->value;
+    d->resource = resource;
 }
 
-/*
- * Resource::Data
- */
-
-Resource::Data::Data(const QUrl &b, const QString &r) :
-    base(b),
-    resource(r),
-    url(base),
-    followRedirects(false),
-    timeout(DEFAULT_TIMEOUT)
+QStringList Parser::fields() const
 {
-    setUrl();
+    return d->fields;
 }
 
-void Resource::Data::setUrl()
+void Parser::setFields(const QStringList &fields)
 {
-    url = base;
-    url.setPath(join(base.path(), resource));
+    d->fields = fields;
 }
 
-QString Resource::Data::join(const QString &first, const QString &second)
+bool Parser::lazy() const
 {
-    return first + (first.endsWith('/') ? "" : "/") + second;
+    return d->lazy;
 }
 
-/*
- * Resource
- */
-
-Resource::Resource(const QUrl &base, const QString &resource) :
-    d(new Data(base, resource))
+void Parser::setLazy(bool lazy)
 {
-
+    d->lazy = lazy;
 }
 
-void Resource::setBase(const QUrl &base)
+RecordList Parser::decode(const QByteArray &data) const
 {
-    d->base = base;
-    d->setUrl();
+    return decode(data.constData(), data.size(), 0);
 }
 
-void Resource::setResource(const QString &resource)
+void Parser::decode(const QByteArray &data, RecordHandler *handler) const
 {
-    d->resource = resource;
-    d->setUrl();
+    decode(data.constData(), data.size(), handler);
 }
 
-void Resource::setHeaders(const Headers &headers)
+RecordList Parser::decodeFile(const QString &path) const
 {
-    d->headers = headers;
+    return readFile(path, 0);
 }
 
-Record Resource::find(const QVariant &id) const
+void Parser::decodeFile(const QString &path, RecordHandler *handler) const
 {
-    return find(FindOne, Data::join(d->url.path(), id.toString()));
+    readFile(path, handler);
 }
 
-RecordList Resource::find(FindMulti style, const QString &from, const ParamList &params) const
+RecordList Parser::readFile(const QString &path, RecordHandler *handler) const
 {
-    Q_UNUSED(style);
-
-    QUrl url;
-
-    if(from.isEmpty())
-    {
-        url = d->url;
-    }
-    else
-    {
-        url = d->base;
-        url.setPath(from);
-    }
+    QFile file(path);
 
-    foreach(Param param, params)
+    if(!file.open(QIODevice::ReadOnly))
     {
-        if(!param.isNull())
+        if(getenv(QAR_DEBUG))
         {
-            url.addQueryItem(param.key(), param.value());
+            qDebug() << "Couldn't open" << path;
         }
-    }
-
-    return fetch(url, d->followRedirects, d->timeout, d->headers);
-}
 
-Record Resource::find(FindSingle style, const QString &from, const ParamList &params) const
-{
-    QUrl url = d->url;
+        return RecordList();
+    }
 
-    switch(style)
+    if(file.size() == 0)
     {
-    case FindOne:
-    case FindFirst:
-    {
-        RecordList results = find(FindAll, from, params);
-        return results.isEmpty() ? Record() : results.front();
+        return RecordList();
     }
-    case FindLast:
+
+    uchar *data = file.map(0, file.size());
+
+    if(!data)
     {
-        RecordList results = find(FindAll, from, params);
-        return results.isEmpty() ? Record() : results.back();
-    }
+        QByteArray contents = file.readAll();
+        return decode(contents.constData(), contents.size(), handler);
     }
 
-    return Record();
-}
+    RecordList records = decode((const char *) data, file.size(), handler);
+    file.unmap(data);
 
-Record Resource::find(FindSingle style, const QString &from,
-                      const Param &first, const Param &second,
-                      const Param &third, const Param &fourth) const
-{
-    return find(style, from, ParamList() << first << second << third << fourth);
+    return records;
 }
 
-RecordList Resource::find(FindMulti style, const QString &from,
-                          const Param &first, const Param &second,
-                          const Param &third, const Param &fourth) const
-{
-    return find(style, from, ParamList() << first << second << third << fourth);
-}
+/*!
+ * The data is added in chunks so that the XML decoder's copy of it stays small
+ * for large (mapped) files.
+ */
 
-void Resource::setFollowRedirects(bool followRedirects)
+RecordList Parser::decode(const char *data, qint64 length, RecordHandler *handler) const
 {
-    d->followRedirects = followRedirects;
-}
+    static const qint64 chunkSize = 1024 * 1024;
 
-int Resource::timeout() const
-{
-    return d->timeout;
-}
+    QScopedPointer<Decoder> decoder(createDecoder(d->format, d->resource, handler,
+                                                  d->fields, d->lazy));
 
-void Resource::setTimeout(int timeout)
-{
-    d->timeout = timeout;
+    if(length <= MAX_PRESIZE)
+    {
+        decoder->reserve(int(length));
+    }
+
+    for(qint64 offset = 0; offset < length; offset += chunkSize)
+    {
+        if(!decoder->addData(data + offset, int(qMin(chunkSize, length - offset))))
+        {
+            return RecordList();
+        }
+    }
+
+    return finishDecoding(decoder.data(), handler);
 }
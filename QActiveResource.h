@@ -2,36 +2,126 @@
  * Copyright (C) 2010, Directed Edge, Inc. | Licensed under the MPL and LGPL
  */
 
+#ifndef QACTIVERESOURCE_H
+#define QACTIVERESOURCE_H
+
 #include <QUrl>
 #include <QSharedData>
 #include <QHash>
+#include <QVector>
+#include <QStringList>
 #include <QVariant>
+#include <QDateTime>
+#include <QMetaType>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include <QFuture>
+#include <qtconcurrentexception.h>
 
 #define QAR_EXPORT __attribute__((visibility("default")))
 
 namespace QActiveResource
 {
+    /*!
+     * Where the time of a request went.  The network times are those reported
+     * by libcurl and, like it, are in seconds measured from the start of the
+     * request, so e.g. the time spent on the TLS handshake is appConnect minus
+     * connect.  If redirects were followed they're those of the last request.
+     */
+
+    struct QAR_EXPORT Timings
+    {
+        Timings();
+
+        double nameLookup;
+        double connect;
+        double appConnect;
+        double startTransfer;
+        double total;
+        qint64 bytesDownloaded;
+
+        /*!
+         * The time in seconds spent in the decoder, including that of a
+         * RecordHandler.  Since decoding overlaps with the download, most of it
+         * is part of total rather than added to it.
+         */
+        double parse;
+
+        /*!
+         * The number of records decoded.
+         */
+        int records;
+    };
+
     class QAR_EXPORT Response
     {
     public:
         typedef long Code;
         typedef QHash<QString, QString> Headers;
         Response(Code code, const Headers &headers, const QByteArray &data);
+
+        /*!
+         * Creates a response from the header block as it was received, i.e. the
+         * status line followed by "Name: value" lines.
+         */
+        Response(Code code, const QByteArray &rawHeaders, const QByteArray &data,
+                 const Timings &timings = Timings());
+
         Code code() const;
+
+        /*!
+         * \return All of the headers keyed by their names as sent.  The hash is
+         * built from the raw header block on each call.
+         */
         Headers headers() const;
+
+        /*!
+         * \return The value of the header \a name, which is matched case
+         * insensitively, or a null string if there is no such header.
+         */
+        QString header(const QString &name) const;
+
+        QByteArray rawHeaders() const;
         QByteArray data() const;
+
+        /*!
+         * \return The timings of the request that got this response.
+         */
+        Timings timings() const;
     private:
+        struct Field
+        {
+            int name;
+            int nameLength;
+            int value;
+            int valueLength;
+        };
         struct Data : public QSharedData
         {
-            Data(Code c, const Headers &h, const QByteArray &d);
+            Data(Code c, const QByteArray &h, const QByteArray &d);
             Code code;
-            Headers headers;
+            QByteArray rawHeaders;
+            QVector<Field> fields;
             QByteArray data;
+            Timings timings;
         };
         QSharedDataPointer<Data> d;
     };
 
-    class QAR_EXPORT Exception
+    /*!
+     * Thrown by all failed requests.  It's also a QtConcurrent::Exception so
+     * that it can be carried by the QFuture from Resource::findAsync(), whose
+     * result() rethrows it.
+     *
+     * \note Deriving from QtConcurrent::Exception gave the class a virtual
+     * table and a base, which changed its layout from earlier versions of the
+     * library.  That breaks binary compatibility, so code using the library has
+     * to be rebuilt against this version.
+     */
+
+    class QAR_EXPORT Exception : public QtConcurrent::Exception
     {
     public:
         enum Type
@@ -48,15 +138,25 @@ namespace QActiveResource
             MethodNotAllowed,
             ResourceConflict,
             ResourceGone,
-            ServerError
+            ServerError,
+
+            /*!
+             * The find was stopped with Cancellation::cancel() or removed with
+             * Executor::clear().
+             */
+            Canceled
         };
 
         Exception(Type type, const Response &response, const QString &message);
+        ~Exception() throw();
 
         Type type() const;
         Response response() const;
         QString message() const;
 
+        void raise() const;
+        Exception *clone() const;
+
     private:
         struct Data : public QSharedData
         {
@@ -69,8 +169,24 @@ namespace QActiveResource
     };
 
     /*!
-     * A thin wrapper around a QVariantHash that preserves the element's
-     * class name.
+     * A set of named values along with the element's class name.
+     *
+     * Rather than a hash per record, the keys are stored in a "shape" that is
+     * shared, copy-on-write, by all records of the same element type, while each
+     * record only holds a flat vector of its values.  Fields are iterated in the
+     * order in which they were set.
+     *
+     * Nested records are stored in QVariants as Record (see
+     * Q_DECLARE_METATYPE below) and can be converted back with Record(const
+     * QVariant &).
+     *
+     * Note that this differs from earlier versions, where records were hashes
+     * and nested records were stored as QVariantHash with their class name
+     * under the key "QActiveResource Class".  QVariant::toHash() returns an
+     * empty hash for a nested Record, so code such as
+     * record["vendor"].toHash() has to become Record(record["vendor"]), or
+     * convert the whole record with toHash(), which returns the old
+     * representation.
      */
 
     class QAR_EXPORT Record
@@ -79,28 +195,196 @@ namespace QActiveResource
         Record(const QVariantHash &hash = QVariantHash());
         Record(const QVariant &v);
         bool isEmpty() const;
+        int size() const;
+        bool contains(const QString &key) const;
         QVariant &operator[](const QString &key);
         QVariant operator[](const QString &key) const;
         QString className() const;
         void setClassName(const QString &name);
+
+        /*!
+         * \return The fields as a hash, with nested records (also those in
+         * lists) converted to hashes that hold their class name under the key
+         * "QActiveResource Class", as records were represented by earlier
+         * versions.
+         */
+        QVariantHash toHash() const;
+
         operator QVariant() const;
 
-        typedef QVariantHash::ConstIterator ConstIterator;
+        /*!
+         * \return An empty record with the same class name.  If its fields are
+         * set in the same order as this record's, their keys aren't copied but
+         * shared with this record.
+         */
+        Record emptyCopy() const;
+
+        /*!
+         * A value that's only decoded when it's first read, such as a nested
+         * record or list skipped by a lazy decoder.  The decoded value is kept
+         * and shared by all copies of the record.
+         */
+        class QAR_EXPORT Subtree : public QSharedData
+        {
+        public:
+            Subtree();
+            virtual ~Subtree();
+
+            /*!
+             * \return The decoded value.  The first call decodes it.
+             */
+            const QVariant &value() const;
+
+            /*!
+             * \return True once value() has decoded the value.
+             */
+            bool isDecoded() const;
+
+            /*!
+             * \return The size of the encoded value in bytes, e.g. of its
+             * text, or 0 if it isn't known.
+             */
+            virtual int encodedSize() const;
+
+        protected:
+            virtual QVariant decode() const = 0;
+
+        private:
+            Q_DISABLE_COPY(Subtree)
+            mutable QMutex mutex;
+            mutable QVariant decoded;
+            mutable bool hasDecoded;
+        };
+
+        /*!
+         * Sets \a key to the value of \a subtree, which is owned by the record
+         * from then on.  It's decoded by the first operator[] or iterator that
+         * reads it.
+         */
+        void setSubtree(const QString &key, Subtree *subtree);
+
+        /*!
+         * \return The subtree that \a key was set to with setSubtree(), or 0
+         * if it holds an ordinary value.
+         */
+        const Subtree *subtree(const QString &key) const;
+
+        /*!
+         * Iterates over the fields in the order in which they were set.  The
+         * iterator holds a (shallow) copy of the record, so it stays valid if
+         * the record it was taken from is modified or destroyed.
+         */
+        class ConstIterator;
 
         ConstIterator begin() const;
         ConstIterator end() const;
 
     private:
+        friend class ConstIterator;
+
+        const QVariant &valueAt(int index) const
+        {
+            return d->subtrees.isEmpty() ? d->values.at(index) : subtreeAt(index);
+        }
+
+        const QVariant &subtreeAt(int index) const;
+
+        struct Shape : public QSharedData
+        {
+            QStringList keys;
+            QHash<QString, int> indexes;
+        };
+
         struct Data : public QSharedData
         {
-            QVariantHash hash;
+            int indexOf(const QString &key) const;
+            QExplicitlySharedDataPointer<Shape> shape;
+            QVector<QVariant> values;
+            QHash<int, QExplicitlySharedDataPointer<Subtree> > subtrees;
             QString className;
         };
         QSharedDataPointer<Data> d;
     };
 
+    class QAR_EXPORT Record::ConstIterator
+    {
+    public:
+        ConstIterator(const Record &record, int index) :
+            m_record(record), m_index(index) {}
+        const QString &key() const { return m_record.d->shape->keys.at(m_index); }
+        const QVariant &value() const { return m_record.valueAt(m_index); }
+        const QVariant &operator*() const { return value(); }
+        const QVariant *operator->() const { return &value(); }
+        ConstIterator &operator++() { ++m_index; return *this; }
+        ConstIterator operator++(int) { ConstIterator it = *this; ++m_index; return it; }
+        ConstIterator &operator--() { --m_index; return *this; }
+        ConstIterator operator--(int) { ConstIterator it = *this; --m_index; return it; }
+        bool operator==(const ConstIterator &other) const { return m_index == other.m_index; }
+        bool operator!=(const ConstIterator &other) const { return m_index != other.m_index; }
+
+    private:
+        Record m_record;
+        int m_index;
+    };
+
     typedef QList<Record> RecordList;
 
+    /*!
+     * Receives records one at a time from Resource::findEach().
+     */
+
+    class QAR_EXPORT RecordHandler
+    {
+    public:
+        virtual ~RecordHandler();
+
+        /*!
+         * Called with each record as soon as its closing tag has been decoded.  The
+         * record isn't referenced by the decoder afterwards.  Return false to stop
+         * the find; the remainder of the response is then discarded.
+         *
+         * Only QActiveResource::Exception may be thrown from here; it's passed on
+         * to the caller of findEach().
+         */
+        virtual bool handle(const Record &record) = 0;
+    };
+
+    /*!
+     * Receives the records of a response from Resource::build() as a sequence of
+     * events while it's decoded, so that another representation of them, e.g. a
+     * scripting language's objects, can be built without building Records
+     * first.
+     *
+     * Each top level record, i.e. each record that find() would return, is
+     * passed as beginRecord(), its fields and endRecord().  A field is a key()
+     * followed by its value: a scalar, a nested record or a list of records
+     * between beginList() and endList().  Strings are UTF-8 and integers are
+     * passed as 64-bit, whatever their size in the document.
+     *
+     * With XmlFormat the events of a root array's records are produced
+     * straight from the XML reader.  A root record, and the records of other
+     * formats, are decoded to records first and then passed on, so the
+     * records are the same as those find() returns.
+     */
+
+    class QAR_EXPORT Builder
+    {
+    public:
+        virtual ~Builder();
+
+        virtual void beginRecord(const QByteArray &className) = 0;
+        virtual void endRecord() = 0;
+        virtual void beginList() = 0;
+        virtual void endList() = 0;
+        virtual void key(const QByteArray &key) = 0;
+        virtual void nullValue() = 0;
+        virtual void stringValue(const QByteArray &value) = 0;
+        virtual void intValue(qint64 value) = 0;
+        virtual void doubleValue(double value) = 0;
+        virtual void boolValue(bool value) = 0;
+        virtual void dateTimeValue(const QDateTime &value) = 0;
+    };
+
     /*!
      * Used as parameters to Resource::find() to specify additional constraints.
      * These correspond to the options passed in the options hash in the Ruby
@@ -129,6 +413,425 @@ namespace QActiveResource
 
     typedef QList<Param> ParamList;
 
+    /*!
+     * Describes how a collection is split into pages for FindAllPages.
+     *
+     * With PageParameter, the page number is passed as a query parameter
+     * (by default "page", starting at 1), optionally along with a page size.
+     * Since the URL of every page is known up front, the next page is requested
+     * while the current one is being downloaded and decoded.  Without a page
+     * size that's done before it's known whether the current page is the last
+     * one, so one request more than there are pages is made.  With a page size
+     * the next page is only requested once the current one has a full page of
+     * records, so only a collection that fills its last page exactly costs an
+     * extra request.
+     *
+     * With LinkHeader, the URL of the next page is taken from the response's
+     * Link header (the entry with rel="next").  The next page is requested as
+     * soon as the current page's headers have arrived, while its body is still
+     * being decoded.
+     *
+     * Either way the pages end with the first empty page, a page with fewer
+     * records than the page size, a response without a next link or once
+     * maxPages() pages have been fetched.  Failed pages are retried according
+     * to the resource's RetryPolicy.  Pages found by number are cached like
+     * other finds by find(); pages found through Link headers aren't.
+     */
+
+    class QAR_EXPORT Pagination
+    {
+    public:
+        enum Strategy
+        {
+            PageParameter,
+            LinkHeader
+        };
+
+        Pagination(Strategy strategy = PageParameter);
+
+        Strategy strategy() const;
+        void setStrategy(Strategy strategy);
+
+        /*!
+         * The query parameter holding the page number.  The default is "page".
+         */
+        QString pageParameter() const;
+        void setPageParameter(const QString &name);
+
+        /*!
+         * The number of the first page.  The default is 1.
+         */
+        int firstPage() const;
+        void setFirstPage(int page);
+
+        /*!
+         * The query parameter holding the page size, or an empty string if
+         * none is sent.
+         */
+        QString limitParameter() const;
+
+        /*!
+         * The number of records per page, or zero if unknown.
+         */
+        int limit() const;
+
+        /*!
+         * Sends \a limit as the page size in the query parameter \a name.
+         * Pages with fewer records are then known to be the last one.
+         */
+        void setLimit(const QString &name, int limit);
+
+        /*!
+         * The maximum number of pages fetched, or zero for no limit.
+         */
+        int maxPages() const;
+        void setMaxPages(int count);
+
+    private:
+        struct Data : public QSharedData
+        {
+            Data(Strategy strategy);
+            Strategy strategy;
+            QString pageParameter;
+            int firstPage;
+            QString limitParameter;
+            int limit;
+            int maxPages;
+        };
+
+        QSharedDataPointer<Data> d;
+    };
+
+    /*!
+     * Process wide settings for the pool of connections shared by all resources.
+     * Once a request is finished its connection is returned to the pool so that
+     * subsequent requests to the same host skip the TCP (and for HTTPS, the TLS)
+     * handshake.  This includes requests run concurrently, as in a Batch or by
+     * findAsync(), as long as libcurl is 7.57.0 or newer; older versions only
+     * share DNS lookups and SSL sessions between those.  All functions are
+     * thread-safe.
+     */
+
+    class QAR_EXPORT ConnectionPool
+    {
+    public:
+        /*!
+         * The maximum number of idle connections kept open.
+         */
+        static int maxSize();
+
+        /*!
+         * Sets the maximum number of idle connections kept open to \a size.  Zero
+         * disables connection reuse.
+         */
+        static void setMaxSize(int size);
+
+        /*!
+         * The time in seconds that an idle connection is kept before it is closed.
+         */
+        static int idleTimeout();
+
+        /*!
+         * Sets the time in seconds that an idle connection is kept to \a seconds.
+         */
+        static void setIdleTimeout(int seconds);
+
+        /*!
+         * Closes all idle connections.  Connections still in use are closed once
+         * their requests finish.
+         */
+        static void clear();
+    };
+
+    /*!
+     * An in-memory cache of found records, kept in least recently used order.
+     * Records are stored along with the ETag and Last-Modified headers of the
+     * response, which are sent back as If-None-Match / If-Modified-Since when
+     * the same URL is requested again with the same headers.  If the server
+     * answers with "304 Not Modified" the cached records are returned without
+     * downloading or decoding anything.  Responses without either header aren't
+     * cached.
+     *
+     * Copies of a cache refer to the same entries, so a cache may be shared by
+     * several resources.  All members are thread safe.
+     */
+
+    class QAR_EXPORT Cache
+    {
+    public:
+        /*!
+         * Creates a cache holding up to \a maxEntries responses and up to
+         * approximately \a maxBytes of records.
+         */
+        Cache(int maxEntries = 256, qint64 maxBytes = 64 * 1024 * 1024);
+
+        int maxEntries() const;
+        void setMaxEntries(int count);
+
+        /*!
+         * The limit of the estimated memory used by the cached records.
+         */
+        qint64 maxBytes() const;
+        void setMaxBytes(qint64 bytes);
+
+        /*!
+         * \return The number of cached responses.
+         */
+        int size() const;
+
+        /*!
+         * \return The estimated memory used by the cached records.
+         */
+        qint64 bytes() const;
+
+        /*!
+         * \return The number of requests answered with "304 Not Modified".
+         */
+        int hits() const;
+
+        /*!
+         * \return The number of requests that had to be downloaded and decoded.
+         */
+        int misses() const;
+
+        /*!
+         * The time in seconds for which records are returned without asking
+         * the server whether they've changed.  The default of zero revalidates
+         * on every find.
+         */
+        int maxAge() const;
+        void setMaxAge(int seconds);
+
+        /*!
+         * The directory entries are also saved to, or an empty string.
+         */
+        QString directory() const;
+
+        /*!
+         * Also saves entries to files in \a path, so that a restarted process
+         * can revalidate (or within maxAge() return) records without
+         * downloading and decoding them again.  Entries that aren't in memory
+         * are looked up there.  The limits only apply to the entries in
+         * memory.  An empty path disables saving.
+         */
+        void setDirectory(const QString &path);
+
+        /*!
+         * Removes all entries from memory.  Saved files and the counters are
+         * kept.
+         */
+        void clear();
+
+        /*!
+         * \return True if this is the null cache used by resources without
+         * one.  Its accessors return zero or an empty string and its setters
+         * do nothing.
+         */
+        bool isNull() const;
+
+    private:
+        friend class Resource;
+        friend class Batch;
+
+        struct Entry
+        {
+            Entry() : validated(0), bytes(0), used(0) {}
+            QString etag;
+            QString lastModified;
+            RecordList records;
+            qint64 validated;
+            qint64 bytes;
+            qint64 used;
+        };
+
+        struct Data : public QSharedData
+        {
+            Data(int maxEntries, qint64 maxBytes);
+            static QString key(const QUrl &url, const QHash<QString, QString> &headers);
+            bool prepare(const QString &key, QHash<QString, QString> *headers, Entry *entry);
+            bool isFresh(const Entry &entry);
+            void store(const QString &key, const QByteArray &rawHeaders,
+                       const RecordList &records);
+            void hit(const QString &key, bool validated);
+            void evict();
+            QString fileName(const QString &key) const;
+            static bool load(const QString &fileName, Entry *entry);
+            void save(const QString &fileName, const Entry &entry, qint64 version);
+            void remove(const QString &fileName, qint64 version);
+            bool replace(const QString &fileName, qint64 version);
+            QMutex mutex;
+            QMutex fileMutex;
+            QHash<QString, qint64> fileVersions;
+            QHash<QString, Entry> entries;
+            int maxEntries;
+            qint64 maxBytes;
+            int maxAge;
+            QString directory;
+            qint64 bytes;
+            qint64 clock;
+            int hits;
+            int misses;
+        };
+
+        explicit Cache(Data *data);
+
+        QExplicitlySharedDataPointer<Data> d;
+    };
+
+    /*!
+     * Controls how a Resource's find() and findEach() deal with failed and slow
+     * requests.
+     *
+     * Failed requests whose Exception type is retryable are repeated up to
+     * maxAttempts() times in total.  Before each retry the request waits for
+     * an exponentially growing backoff (initialBackoff() doubled per attempt, up
+     * to maxBackoff()) with random jitter of up to half of it, or for as many
+     * seconds as the response's Retry-After header asks for, if that's longer.
+     * A request whose Retry-After exceeds maxBackoff() isn't retried.  The
+     * wait ends early, with an Exception of type Canceled, if the resource's
+     * Cancellation is canceled.  findEach() doesn't retry once records have
+     * been passed to its handler.  With FindAllPages each page is retried on
+     * its own, since its records are only passed on once it's complete.
+     *
+     * With hedging enabled, find() sends a second, identical request if the
+     * first hasn't finished once it's slower than the hedgePercentile() of the
+     * recent requests made with this policy, and returns whichever finishes
+     * first.  Hedging starts once enough requests have been seen to estimate
+     * the percentile.
+     *
+     * Copies of a policy share their settings and counters.  All members are
+     * thread safe.
+     */
+
+    class QAR_EXPORT RetryPolicy
+    {
+    public:
+        /*!
+         * Creates a policy that doesn't retry or hedge.
+         */
+        RetryPolicy();
+
+        /*!
+         * The total number of attempts, including the first one.
+         */
+        int maxAttempts() const;
+        void setMaxAttempts(int attempts);
+
+        /*!
+         * The exception types that are retried.  The default is
+         * ConnectionError, TimeoutError and ServerError.
+         */
+        QList<Exception::Type> retryableTypes() const;
+        void setRetryableTypes(const QList<Exception::Type> &types);
+
+        /*!
+         * The backoff in milliseconds before the first retry.
+         */
+        int initialBackoff() const;
+        void setInitialBackoff(int milliseconds);
+
+        /*!
+         * The limit of the backoff in milliseconds.
+         */
+        int maxBackoff() const;
+        void setMaxBackoff(int milliseconds);
+
+        /*!
+         * If true (the default), a Retry-After header with a number of seconds
+         * extends the backoff, up to maxBackoff().
+         */
+        bool respectsRetryAfter() const;
+        void setRespectsRetryAfter(bool respect);
+
+        /*!
+         * The latency percentile, between 0 and 1, after which a hedged
+         * request is sent, or 0 if hedging is disabled (the default).
+         */
+        double hedgePercentile() const;
+
+        /*!
+         * Enables hedging after the \a percentile latency, but never before
+         * \a minimumDelay milliseconds.
+         */
+        void setHedging(double percentile, int minimumDelay = 0);
+
+        /*!
+         * \return The number of retries made.
+         */
+        int retries() const;
+
+        /*!
+         * \return The number of hedged requests sent.
+         */
+        int hedges() const;
+
+        /*!
+         * \return The number of hedged requests that finished before the
+         * request they duplicated.
+         */
+        int hedgeWins() const;
+
+    private:
+        friend class Resource;
+
+        struct Data : public QSharedData
+        {
+            Data();
+            int retryDelay(const Exception &exception, int attempt);
+            int hedgeDelay();
+            void addLatency(double milliseconds);
+            void hedged(bool won);
+            QMutex mutex;
+            int maxAttempts;
+            QList<Exception::Type> types;
+            int initialBackoff;
+            int maxBackoff;
+            bool respectRetryAfter;
+            double hedgePercentile;
+            int hedgeMinimumDelay;
+            QVector<double> latencies;
+            int nextLatency;
+            int retries;
+            int hedges;
+            int hedgeWins;
+        };
+
+        QExplicitlySharedDataPointer<Data> d;
+    };
+
+    /*!
+     * Stops the finds of a Resource that are running in other threads, e.g.
+     * when the thread that's waiting for them is interrupted.  Canceled finds
+     * throw an Exception of type Canceled, typically within a second.
+     *
+     * Copies share their state.  All members are thread safe.
+     */
+
+    class QAR_EXPORT Cancellation
+    {
+    public:
+        Cancellation();
+
+        /*!
+         * Cancels the running finds and those started until reset() is called.
+         */
+        void cancel();
+        bool isCanceled() const;
+        void reset();
+
+    private:
+        friend class Resource;
+
+        struct Data : public QSharedData
+        {
+            QAtomicInt canceled;
+        };
+
+        explicit Cancellation(Data *data);
+
+        QExplicitlySharedDataPointer<Data> d;
+    };
+
     /*!
      * Used with Resource::find() to specify that only one record should be
      * returned.
@@ -148,13 +851,55 @@ namespace QActiveResource
 
     enum FindMulti
     {
-        FindAll
+        FindAll,
+
+        /*!
+         * Fetches all pages of the collection as described by the resource's
+         * Pagination.
+         */
+        FindAllPages
     };
 
+    /*!
+     * The representation requested from the server, which also determines the
+     * extension appended to the URL.
+     */
+
+    enum Format
+    {
+        XmlFormat,
+        JsonFormat
+    };
+
+    /*!
+     * The content encodings that may be used for responses.  Compressed
+     * responses are decompressed chunk by chunk as they arrive, before being
+     * decoded.  Encodings that the installed libcurl doesn't support are never
+     * requested.
+     */
+
+    enum Encoding
+    {
+        IdentityEncoding = 0x0,
+        GzipEncoding = 0x1,
+        DeflateEncoding = 0x2,
+        BrotliEncoding = 0x4,
+        AllEncodings = GzipEncoding | DeflateEncoding | BrotliEncoding
+    };
+
+    Q_DECLARE_FLAGS(Encodings, Encoding)
+
     /*!
      * Represents an ActiveResource resource.  The semantics are similar to Ruby's
      * ActiveResource::Base, however, instead of subclassing the class, the base
      * and resource name are provided in the constructor.
+     *
+     * The const members, including find() and findEach(), may be called on the
+     * same resource from several threads at once.  The setters may not be
+     * called while another thread uses the same object, but copies are
+     * independent and may be modified freely.  Records and record lists are
+     * implicitly shared, so like Qt's containers different objects may be used
+     * in different threads even if they share data.
      */
 
     class QAR_EXPORT Resource
@@ -207,6 +952,34 @@ namespace QActiveResource
          */
         RecordList find(FindMulti style, const QString &from, const ParamList &params) const;
 
+        /*!
+         * Like the above, but rather than collecting the records in a list they're
+         * passed to \a handler as they are decoded, so that memory use is bounded
+         * by a single record instead of the whole response.  With FindAllPages
+         * the records are passed on a page at a time, in order, once each page
+         * is complete.  This only holds for XmlFormat: JSON responses are
+         * buffered in full and decoded once they're complete, so memory use is
+         * bounded by the body of a response (a page with FindAllPages) and the
+         * records are passed on one at a time only after it has arrived.
+         */
+        void findEach(FindMulti style, const QString &from, const ParamList &params,
+                      RecordHandler *handler) const;
+
+        /*!
+         * Like findEach(), but passes the records to \a builder as events (see
+         * Builder).  Requests are retried as with findEach() and FindAllPages
+         * passes on the pages in order.  With a cache or coalescing the records
+         * are found as with find() and then passed on.  Lazy decoding doesn't
+         * apply, since every record is passed on in full.
+         */
+        void build(FindMulti style, const QString &from, const ParamList &params,
+                   Builder *builder) const;
+
+        /*!
+         * Passes the record with the given text / numeric ID to \a builder.
+         */
+        void build(const QVariant &id, Builder *builder) const;
+
         /*!
          * Convenience overload of the above that lets the parameters be specified
          * directly in the function call.
@@ -222,6 +995,22 @@ namespace QActiveResource
                         const Param &first = Param(), const Param &second = Param(),
                         const Param &third = Param(), const Param &fourth = Param()) const;
 
+        /*!
+         * Starts a find without blocking and returns a future for its records.
+         * If the find fails, the future's result() throws its Exception.
+         *
+         * The request is driven by the Qt event loop of the calling thread,
+         * which has to keep running until the future has finished, so don't
+         * wait for it in the same thread.  Any number of finds may be in flight
+         * on one thread.  The cache is used as with find(), but requests aren't
+         * retried, hedged or coalesced.  With FindAllPages the pages are
+         * requested one after another, without the cache.  Canceling the
+         * future stops its request within a tenth of a second and closes its
+         * connection.
+         */
+        QFuture<RecordList> findAsync(FindMulti style = FindAll, const QString &from = QString(),
+                                      const ParamList &params = ParamList()) const;
+
         /*!
          * Enables following redirects if \a follow is true.
          *
@@ -240,20 +1029,457 @@ namespace QActiveResource
          */
         void setTimeout(int timeout);
 
+        /*!
+         * The format that is requested and decoded.  The default is XmlFormat.
+         */
+        Format format() const;
+
+        /*!
+         * Sets the format that is requested and decoded to \a format.  Both formats
+         * produce the same records; JSON keys have their dashes replaced by
+         * underscores and nested objects take their class name from their key.
+         * Only XML is decoded while the response is downloading; a JSON body is
+         * buffered and decoded once it's complete, which also limits findEach().
+         */
+        void setFormat(Format format);
+
+        /*!
+         * The fields that are decoded, or an empty list (the default) for all
+         * of them.  Fields of nested records are given as paths of keys
+         * separated by dots, e.g. "vendor.name", or "images.url" for the
+         * records of a list.  Selecting a field selects everything below it.
+         */
+        QStringList fields() const;
+
+        /*!
+         * Only decodes \a fields of the records.  The values of other fields
+         * are skipped as they're read, without decoding them or building
+         * records for them.
+         */
+        void setFields(const QStringList &fields);
+
+        /*!
+         * If true, nested records and lists of the records found with
+         * XmlFormat are decoded lazily.  The decoder only notes where each of
+         * them is in the response's text and decodes it the first time the
+         * record's field is read.  That's cheaper when most nested values are
+         * never read, but the response's text stays in memory while any of
+         * its lazy values do.  The default is false.  Other formats ignore
+         * this.
+         */
+        bool lazy() const;
+        void setLazy(bool lazy);
+
+        /*!
+         * If true, concurrent find() calls for the same URL and headers, from
+         * any resource, share a single request: one thread fetches and decodes
+         * the response and the others wait for its records (or its exception).
+         * findEach() and FindAllPages aren't coalesced.  The default is false.
+         */
+        bool coalescing() const;
+        void setCoalescing(bool coalesce);
+
+        /*!
+         * Makes find(), findEach() and findAsync() of this resource, and its
+         * requests in a Batch, stop once \a cancellation has been canceled.
+         */
+        void setCancellation(const Cancellation &cancellation);
+
+        /*!
+         * How failed and slow requests are handled.  By default neither is.
+         */
+        RetryPolicy retryPolicy() const;
+        void setRetryPolicy(const RetryPolicy &policy);
+
+        /*!
+         * How collections are paged for FindAllPages.
+         */
+        Pagination pagination() const;
+        void setPagination(const Pagination &pagination);
+
+        /*!
+         * The content encodings offered to the server.  The default is
+         * AllEncodings.
+         */
+        Encodings encodings() const;
+
+        /*!
+         * Sets the content encodings offered to the server to \a encodings.
+         * IdentityEncoding requests uncompressed responses.
+         */
+        void setEncodings(Encodings encodings);
+
+        /*!
+         * \return The timings of the last find() of this resource (or of a copy
+         * of it) that got a response, including the time spent decoding.
+         */
+        Timings lastTimings() const;
+
+        /*!
+         * \return The cache used by find(), or a null cache if there is none.
+         */
+        Cache cache() const;
+
+        /*!
+         * Caches the records returned by find() in \a cache.  Records passed
+         * to a RecordHandler by findEach() aren't cached.  With FindAllPages
+         * each page is cached on its own if the pages are found by number.
+         */
+        void setCache(const Cache &cache);
+
+        /*!
+         * Stops caching records.
+         */
+        void removeCache();
+
     private:
+        friend class Batch;
+
+        class AsyncFind;
+
+        struct Stats : public QSharedData
+        {
+            QMutex mutex;
+            Timings last;
+        };
+
         struct Data : public QSharedData
         {
             Data(const QUrl &base, const QString &resource);
             static QString join(const QString &first, const QString &second);
             void setUrl();
+            QUrl requestUrl(const QString &from, const ParamList &params) const;
+            RecordList fetch(const QUrl &target, RecordHandler *handler = 0,
+                             Builder *builder = 0) const;
+            RecordList fetchShared(const QUrl &target) const;
+            RecordList fetchPages(const QString &from, const ParamList &params,
+                                  RecordHandler *handler = 0) const;
+            void setLastTimings(const Timings &timings) const;
+            QAtomicInt *canceled() const;
+            QString cacheKey(const QUrl &target) const;
             QUrl base;
             QString resource;
             Headers headers;
             QUrl url;
             bool followRedirects;
             int timeout;
+            Format format;
+            Encodings encodings;
+            Pagination pagination;
+            RetryPolicy retryPolicy;
+            QStringList fields;
+            bool lazy;
+            bool coalesce;
+            Cancellation cancellation;
+            Cache cache;
+            QExplicitlySharedDataPointer<Stats> stats;
+        };
+
+        QSharedDataPointer<Data> d;
+    };
+
+    /*!
+     * Performs several finds concurrently.  Requests are queued with add() and
+     * then run by exec() from a single curl_multi loop, so that the total time is
+     * close to that of the slowest request rather than the sum of all of them.
+     *
+     * For example:
+     *
+     *   Batch batch;
+     *   int products = batch.add(Resource(base, "products"));
+     *   int customers = batch.add(Resource(base, "customers"));
+     *   batch.exec();
+     *   RecordList records = batch.result(products);
+     */
+
+    class QAR_EXPORT Batch
+    {
+    public:
+        Batch();
+
+        /*!
+         * Queues a find on \a resource.  The arguments correspond to those of
+         * Resource::find().
+         *
+         * The batch performs FindAll finds itself, all at once, so the
+         * resource's cache applies to them but its RetryPolicy and coalescing
+         * don't.  FindAllPages finds are made with Resource::find() one after
+         * another once the others have finished.
+         *
+         * \return The index used to retrieve the result.
+         */
+        int add(const Resource &resource, FindMulti style = FindAll,
+                const QString &from = QString(), const ParamList &params = ParamList());
+
+        /*!
+         * \return The number of queued requests.
+         */
+        int size() const;
+
+        /*!
+         * Removes all requests and their results.
+         */
+        void clear();
+
+        /*!
+         * The maximum number of requests that are performed at the same time.
+         */
+        int maxConcurrent() const;
+
+        /*!
+         * Sets the maximum number of requests that are performed at the same time.
+         */
+        void setMaxConcurrent(int count);
+
+        /*!
+         * Performs all requests that haven't been performed yet and blocks until
+         * all of them have finished.
+         */
+        void exec();
+
+        /*!
+         * \return True if the request at \a index has been performed.
+         */
+        bool isFinished(int index) const;
+
+        /*!
+         * \return True if the request at \a index failed.
+         */
+        bool hasError(int index) const;
+
+        /*!
+         * \return The records found by the request at \a index.  If the request
+         * failed, its Exception is thrown instead.
+         */
+        RecordList result(int index) const;
+
+    private:
+        struct Entry
+        {
+            Resource resource;
+            FindMulti style;
+            QString from;
+            ParamList params;
+            bool finished;
+            RecordList records;
+            QList<Exception> errors;
+        };
+
+        struct Data : public QSharedData
+        {
+            Data();
+            QList<Entry> entries;
+            int maxConcurrent;
+        };
+
+        QSharedDataPointer<Data> d;
+    };
+
+    /*!
+     * Runs finds on a pool of worker threads, so that the decoding of several
+     * responses is spread across cores.  Unlike with Batch, each find starts as
+     * soon as it's added and is made with Resource::find(), so caching,
+     * coalescing and retries apply.
+     *
+     * For example:
+     *
+     *   Executor executor;
+     *   int products = executor.add(Resource(base, "products"));
+     *   int customers = executor.add(Resource(base, "customers"));
+     *   RecordList records = executor.result(products);
+     *
+     * Copies of an executor share its threads and results.  All members are
+     * thread safe.
+     */
+
+    class QAR_EXPORT Executor
+    {
+    public:
+        /*!
+         * Creates an executor with up to \a maxThreads worker threads, or one
+         * per core if \a maxThreads is 0.
+         */
+        explicit Executor(int maxThreads = 0);
+
+        /*!
+         * Starts a find on \a resource.  The arguments correspond to those of
+         * Resource::find().
+         *
+         * \return The index used to retrieve the result.
+         */
+        int add(const Resource &resource, FindMulti style = FindAll,
+                const QString &from = QString(), const ParamList &params = ParamList());
+
+        /*!
+         * \return The number of finds that have been added.
+         */
+        int size() const;
+
+        /*!
+         * Waits for the finds that are running and removes all of them and
+         * their results.  Finds added by other threads meanwhile wait until
+         * it's done and are kept.
+         *
+         * All indexes returned by add() before are invalid afterwards, even
+         * though later finds reuse them.  Calls with such an index, including
+         * those of other threads that are waiting in result(), throw an
+         * Exception of type Exception::Canceled.
+         */
+        void clear();
+
+        /*!
+         * The maximum number of worker threads.
+         */
+        int maxThreads() const;
+        void setMaxThreads(int count);
+
+        /*!
+         * Blocks until all finds that have been added have finished.
+         */
+        void waitForDone();
+
+        /*!
+         * \return True if the find at \a index has finished.  An Exception of
+         * type Exception::Canceled is thrown if \a index is invalid.
+         */
+        bool isFinished(int index) const;
+
+        /*!
+         * \return True if the find at \a index has finished and failed.  An
+         * Exception of type Exception::Canceled is thrown if \a index is
+         * invalid.
+         */
+        bool hasError(int index) const;
+
+        /*!
+         * Blocks until the find at \a index has finished.
+         *
+         * \return Its records.  If it failed, its Exception is thrown instead.
+         * An Exception of type Exception::Canceled is thrown if \a index is
+         * invalid or clear() removes the find while waiting.
+         */
+        RecordList result(int index) const;
+
+    private:
+        class Task;
+
+        struct Entry
+        {
+            Entry() : finished(false) {}
+            bool finished;
+            RecordList records;
+            QList<Exception> errors;
+        };
+
+        /*!
+         * The entries and the counts that tasks update.  Each task holds a
+         * reference to it, so it outlives the executor's data while any task
+         * is still running.  The generation is incremented by clear().
+         */
+        struct State : public QSharedData
+        {
+            State();
+            QMutex mutex;
+            QWaitCondition finished;
+            QList<Entry> entries;
+            int running;
+            int clearing;
+            int generation;
+
+            const Entry &entry(int index) const;
+        };
+
+        struct Data : public QSharedData
+        {
+            Data(int maxThreads);
+            QThreadPool pool;
+            QExplicitlySharedDataPointer<State> state;
+        };
+
+        QExplicitlySharedDataPointer<Data> d;
+    };
+
+    /*!
+     * Decodes ActiveResource documents that come from somewhere other than a
+     * Resource, e.g. archived responses or message queue payloads.  The records
+     * are the same as those Resource::find() returns for the same body.
+     *
+     * For example:
+     *
+     *   Parser parser(JsonFormat, "products");
+     *   RecordList records = parser.decodeFile("products.json");
+     */
+
+    class QAR_EXPORT Parser
+    {
+    public:
+        /*!
+         * Creates a parser for \a format.  \a resource is only used by
+         * JsonFormat, where it provides the class name of top level records.
+         */
+        Parser(Format format = XmlFormat, const QString &resource = QString());
+
+        Format format() const;
+        void setFormat(Format format);
+
+        QString resource() const;
+        void setResource(const QString &resource);
+
+        /*!
+         * The fields that are decoded, as with Resource::setFields().
+         */
+        QStringList fields() const;
+        void setFields(const QStringList &fields);
+
+        /*!
+         * If true, nested values are decoded lazily, as with Resource::setLazy().
+         */
+        bool lazy() const;
+        void setLazy(bool lazy);
+
+        /*!
+         * \return The records of the document in \a data.  Malformed documents
+         * return the records decoded before the error.
+         */
+        RecordList decode(const QByteArray &data) const;
+
+        /*!
+         * Passes the records of the document in \a data to \a handler instead
+         * of collecting them.
+         */
+        void decode(const QByteArray &data, RecordHandler *handler) const;
+
+        /*!
+         * \return The records of the document in the file at \a path, which is
+         * memory mapped rather than read.  Returns an empty list if the file
+         * can't be opened.
+         */
+        RecordList decodeFile(const QString &path) const;
+
+        /*!
+         * Passes the records of the document in the file at \a path to
+         * \a handler instead of collecting them.
+         */
+        void decodeFile(const QString &path, RecordHandler *handler) const;
+
+    private:
+        RecordList readFile(const QString &path, RecordHandler *handler) const;
+        RecordList decode(const char *data, qint64 length, RecordHandler *handler) const;
+
+        struct Data : public QSharedData
+        {
+            Data(Format format, const QString &resource);
+            Format format;
+            QString resource;
+            QStringList fields;
+            bool lazy;
         };
 
         QSharedDataPointer<Data> d;
     };
 }
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(QActiveResource::Encodings)
+Q_DECLARE_METATYPE(QActiveResource::Record)
+
+#endif
@@ -4,11 +4,13 @@
  */
 
 #include "QActiveResource.h"
-#include "SharedObject.h"
 #include <QDateTime>
 #include <QDebug>
 #include <ruby.h>
 #include <ruby/encoding.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
 
 typedef VALUE(*ARGS)(...);
 typedef int(*ITERATOR)(...);
@@ -58,13 +60,14 @@ static VALUE rb_eActiveResourceServerError;
 
 static ID _all;
 static ID _allocate;
-static ID _at;
 static ID _code;
 static ID _body;
 static ID _collection_name;
 static ID _element_name;
 static ID _extend;
+static ID _extension;
 static ID _first;
+static ID _format;
 static ID _from;
 static ID _headers;
 static ID _new;
@@ -99,13 +102,14 @@ static void look_up_symbols()
 {
     _all = rb_intern("all");
     _allocate = rb_intern("allocate");
-    _at = rb_intern("at");
     _code = rb_intern("code");
     _body = rb_intern("body");
     _collection_name = rb_intern("collection_name");
     _element_name = rb_intern("element_name");
     _extend = rb_intern("extend");
+    _extension = rb_intern("extension");
     _first = rb_intern("first");
+    _format = rb_intern("format");
     _from = rb_intern("from");
     _headers = rb_intern("headers");
     _new = rb_intern("new");
@@ -129,10 +133,25 @@ static void look_up_symbols()
     ___qar_resource = rb_intern("@@qar_resource");
 }
 
-static QString to_s(VALUE value)
+/*!
+ * \return The result of calling to_s on \a value.  This may raise, so it may
+ * only be called while no C++ objects are alive.
+ */
+
+static VALUE to_s(VALUE value)
 {
     VALUE s = rb_funcall(value, _to_s, 0);
-    return QString::fromUtf8(StringValuePtr(s));
+    StringValue(s);
+    return s;
+}
+
+/*!
+ * \return The Ruby string \a s as a QString.  Doesn't raise.
+ */
+
+static QString to_qstring(VALUE s)
+{
+    return QString::fromUtf8(RSTRING_PTR(s), RSTRING_LEN(s));
 }
 
 static VALUE to_value(const QString &s)
@@ -143,71 +162,342 @@ static VALUE to_value(const QString &s)
     return string;
 }
 
-static VALUE to_value(const QVariant &v, VALUE base, bool isChild = false)
+/*!
+ * Records the events of a response in a compact buffer without touching any
+ * Ruby objects, so that the response can be decoded without the GVL and then
+ * be turned into Ruby objects by replaying the events.  Each event is a byte
+ * followed by its argument, if it has one; strings are stored as their length
+ * followed by their UTF-8 bytes.
+ */
+
+class EventBuffer : public QActiveResource::Builder
 {
-    switch(v.type())
+public:
+    enum Event
     {
-    case QVariant::Hash:
+        BeginRecord,
+        EndRecord,
+        BeginList,
+        EndList,
+        Key,
+        Null,
+        String,
+        Int,
+        Double,
+        Bool,
+        DateTime
+    };
+
+    void beginRecord(const QByteArray &className)
     {
-        QActiveResource::Record record = v;
+        append(BeginRecord, className);
+    }
 
-        VALUE attributes = rb_hash_new();
+    void endRecord()
+    {
+        append(EndRecord);
+    }
 
-        if(record.isEmpty())
-        {
-            return attributes;
-        }
+    void beginList()
+    {
+        append(BeginList);
+    }
 
-        VALUE klass = base;
+    void endList()
+    {
+        append(EndList);
+    }
 
-        if(isChild)
-        {
-            QString name = record.className();
-            klass = rb_define_class_under(base, name.toUtf8(), rb_cActiveResourceBase);
-        }
+    void key(const QByteArray &key)
+    {
+        append(Key, key);
+    }
+
+    void nullValue()
+    {
+        append(Null);
+    }
+
+    void stringValue(const QByteArray &value)
+    {
+        append(String, value);
+    }
+
+    void intValue(qint64 value)
+    {
+        append(Int);
+        appendValue(value);
+    }
+
+    void doubleValue(double value)
+    {
+        append(Double);
+        appendValue(value);
+    }
+
+    void boolValue(bool value)
+    {
+        append(Bool);
+        appendValue(char(value));
+    }
+
+    void dateTimeValue(const QDateTime &value)
+    {
+        append(DateTime);
+        appendValue(qint64(value.toMSecsSinceEpoch()));
+    }
+
+    QByteArray events;
+
+private:
+    void append(Event event)
+    {
+        events.append(char(event));
+    }
+
+    void append(Event event, const QByteArray &value)
+    {
+        events.append(char(event));
+        appendValue(value.size());
+        events.append(value);
+    }
+
+    template <class T> void appendValue(T value)
+    {
+        events.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+};
+
+/*!
+ * Turns the events of a response into Ruby objects.  The classes of nested
+ * records and the hash keys are looked up or created once per name, with the
+ * keys frozen so that hashes use them as they are rather than copying them.
+ * Everything cached is also kept in an array so that it can't be collected
+ * while it's only referenced from the hashes here.
+ *
+ * Creating classes and allocating records can raise, so the replay runs under
+ * rb_protect() and everything it allocates on the C++ side lives in members,
+ * which are destroyed normally once the caller has returned.
+ */
+
+class Conversion
+{
+public:
+    Conversion(VALUE base) :
+        m_base(base),
+        m_values(rb_ary_new()),
+        m_buffer(0)
+    {
+
+    }
+
+    /*!
+     * \return An array of the top level records in \a buffer.  If Ruby raises,
+     * \a state is set and the exception is left for the caller to re-raise once
+     * its own C++ objects are gone.
+     */
+    VALUE records(const EventBuffer &buffer, int *state)
+    {
+        m_buffer = &buffer;
+        m_frames.clear();
+        return rb_protect(replay, reinterpret_cast<VALUE>(this), state);
+    }
 
-        for(QActiveResource::Record::ConstIterator it = record.begin();
-            it != record.end();
-            ++it)
+private:
+    struct Frame
+    {
+        QByteArray className;
+        VALUE key;
+        bool isList;
+    };
+
+    static VALUE replay(VALUE data)
+    {
+        return reinterpret_cast<Conversion *>(data)->replay();
+    }
+
+    VALUE replay()
+    {
+        VALUE records = rb_ary_new();
+        VALUE containers = rb_ary_new();
+        VALUE key = Qnil;
+
+        const char *position = m_buffer->events.constData();
+        const char *end = position + m_buffer->events.size();
+
+        while(position < end)
         {
-            VALUE key = to_value(it.key());
-            VALUE value = to_value(it.value(), base, true);
-            rb_hash_aset(attributes, key, value);
+            VALUE value = Qundef;
+
+            switch(*position++)
+            {
+            case EventBuffer::BeginRecord:
+                readString(&position);
+                pushFrame(m_string, key, false);
+                rb_ary_push(containers, rb_hash_new());
+                break;
+            case EventBuffer::EndRecord:
+                value = rb_ary_pop(containers);
+                key = m_frames.back().key;
+
+                // Empty records are left as hashes.
+
+                if(RHASH_SIZE(value) > 0)
+                {
+                    value = toObject(m_frames.size() == 1 ?
+                                     m_base : classFor(m_frames.back().className), value);
+                }
+
+                m_frames.pop_back();
+                break;
+            case EventBuffer::BeginList:
+                pushFrame(QByteArray(), key, true);
+                rb_ary_push(containers, rb_ary_new());
+                break;
+            case EventBuffer::EndList:
+                key = m_frames.back().key;
+                m_frames.pop_back();
+                value = rb_ary_pop(containers);
+                break;
+            case EventBuffer::Key:
+                readString(&position);
+                key = keyFor(m_string);
+                break;
+            case EventBuffer::Null:
+                value = Qnil;
+                break;
+            case EventBuffer::String:
+                readString(&position);
+                value = rb_str_new(m_string.constData(), m_string.size());
+                rb_enc_associate_index(value, rb_utf8_enc_index);
+                break;
+            case EventBuffer::Int:
+                value = LL2NUM(readValue<qint64>(&position));
+                break;
+            case EventBuffer::Double:
+                value = rb_float_new(readValue<double>(&position));
+                break;
+            case EventBuffer::Bool:
+                value = readValue<char>(&position) ? Qtrue : Qfalse;
+                break;
+            case EventBuffer::DateTime:
+            {
+                // Milliseconds since the epoch, split with the remainder
+                // rounded down so that times before 1970 come out right.
+
+                qint64 msecs = readValue<qint64>(&position);
+                qint64 seconds = msecs / 1000;
+                qint64 remainder = msecs % 1000;
+
+                if(remainder < 0)
+                {
+                    seconds--;
+                    remainder += 1000;
+                }
+
+                value = rb_time_new(time_t(seconds), long(remainder * 1000));
+                break;
+            }
+            }
+
+            if(value == Qundef)
+            {
+                continue;
+            }
+
+            if(m_frames.isEmpty())
+            {
+                rb_ary_push(records, value);
+            }
+            else if(m_frames.back().isList)
+            {
+                rb_ary_push(rb_ary_entry(containers, -1), value);
+            }
+            else
+            {
+                rb_hash_aset(rb_ary_entry(containers, -1), key, value);
+            }
         }
 
+        return records;
+    }
+
+    void pushFrame(const QByteArray &className, VALUE key, bool isList)
+    {
+        Frame frame = { className, key, isList };
+        m_frames.append(frame);
+    }
+
+    VALUE toObject(VALUE klass, VALUE attributes)
+    {
         VALUE value = rb_funcall(klass, _allocate, 0);
         rb_ivar_set(value, __attributes, attributes);
         rb_ivar_set(value, __prefix_options, rb_hash_new());
         rb_ivar_set(value, __persisted, Qtrue);
         return value;
     }
-    case QVariant::List:
+
+    VALUE classFor(const QByteArray &name)
     {
-        VALUE value = rb_ary_new();
+        QHash<QByteArray, VALUE>::ConstIterator it = m_classes.find(name);
 
-        foreach(QVariant element, v.toList())
+        if(it != m_classes.end())
         {
-            rb_ary_push(value, to_value(element, base, isChild));
+            return it.value();
         }
 
-        return value;
+        VALUE klass = rb_define_class_under(m_base, name.constData(), rb_cActiveResourceBase);
+        rb_ary_push(m_values, klass);
+        m_classes.insert(name, klass);
+
+        return klass;
     }
-    case QVariant::Invalid:
-        return Qnil;
-    case QVariant::Bool:
-        return v.toBool() ? Qtrue : Qfalse;
-    case QVariant::Int:
-        return rb_int_new(v.toInt());
-    case QVariant::Double:
-        return rb_float_new(v.toDouble());
-    case QVariant::DateTime:
+
+    VALUE keyFor(const QByteArray &name)
     {
-        return rb_funcall(rb_cTime, _at, 1, rb_int_new(v.toDateTime().toTime_t()));
+        QHash<QByteArray, VALUE>::ConstIterator it = m_keys.find(name);
+
+        if(it != m_keys.end())
+        {
+            return it.value();
+        }
+
+        VALUE key = rb_str_new(name.constData(), name.size());
+        rb_enc_associate_index(key, rb_utf8_enc_index);
+        rb_str_freeze(key);
+        rb_ary_push(m_values, key);
+        m_keys.insert(name, key);
+
+        return key;
     }
-    default:
-        return to_value(v.toString());
+
+    /*!
+     * Reads a string into m_string rather than returning it, so that no
+     * temporary is alive when Ruby is called with it.
+     */
+    void readString(const char **position)
+    {
+        int size = readValue<int>(position);
+        m_string = QByteArray(*position, size);
+        *position += size;
     }
-}
+
+    template <class T> static T readValue(const char **position)
+    {
+        T value;
+        memcpy(&value, *position, sizeof(T));
+        *position += sizeof(T);
+        return value;
+    }
+
+    VALUE m_base;
+    VALUE m_values;
+    const EventBuffer *m_buffer;
+    QVector<Frame> m_frames;
+    QByteArray m_string;
+    QHash<QByteArray, VALUE> m_classes;
+    QHash<QByteArray, VALUE> m_keys;
+};
 
 static VALUE to_value(const QHash<QString, QString> &hash)
 {
@@ -238,19 +528,29 @@ static VALUE resource_allocate(VALUE klass)
     return Data_Wrap_Struct(klass, 0, resource_free, resource);
 }
 
+/*
+ * The parameters and headers are collected as arrays of [key, value] strings
+ * so that converting them, which calls to_s and may raise, is done before any
+ * C++ objects are created.
+ */
+
 static int params_hash_iterator_append_subhash(VALUE key, VALUE value, VALUE subHash)
 {
     VALUE subhashKey = rb_hash_aref(subHash, rb_str_new2("key"));
     VALUE params = rb_hash_aref(subHash, rb_str_new2("params"));
-    SharedObject::Wrapper<QActiveResource::ParamList> paramsObject(params);
-    QString subKey = to_s(subhashKey) + "[" + to_s(key) + "]";
+    VALUE subKey = rb_str_dup(to_s(subhashKey));
+    VALUE keyString = to_s(key);
+
+    rb_str_cat2(subKey, "[");
+    rb_str_append(subKey, keyString);
+    rb_str_cat2(subKey, "]");
 
     int tv = TYPE(value);
 
     if(tv == T_STRING || tv == T_FLOAT || tv == T_FIXNUM || tv == T_BIGNUM ||
        tv == T_SYMBOL)
     {
-        paramsObject->append(QActiveResource::Param(subKey, to_s(value)));
+        rb_ary_push(params, rb_assoc_new(subKey, to_s(value)));
     }
     else if(tv == T_HASH)
     {
@@ -258,9 +558,9 @@ static int params_hash_iterator_append_subhash(VALUE key, VALUE value, VALUE sub
     }
     else
     {
-        paramsObject->append(QActiveResource::Param(subKey, to_s(value)));
-        qCritical() << "QActiveResource: Value type of nested key" << to_s(key)
-                    << "not supported.";
+        rb_ary_push(params, rb_assoc_new(subKey, to_s(value)));
+        qCritical() << "QActiveResource: Value type of nested key"
+                    << RSTRING_PTR(keyString) << "not supported.";
     }
 
     return 0;
@@ -268,8 +568,6 @@ static int params_hash_iterator_append_subhash(VALUE key, VALUE value, VALUE sub
 
 static int params_hash_iterator(VALUE key, VALUE value, VALUE params)
 {
-    SharedObject::Wrapper<QActiveResource::ParamList> paramsObject(params);
-
     int tv = TYPE(value);
 
     if(tv == T_HASH)
@@ -283,13 +581,14 @@ static int params_hash_iterator(VALUE key, VALUE value, VALUE params)
     else if(tv == T_STRING || tv == T_FLOAT || tv == T_FIXNUM
             || tv == T_BIGNUM || tv == T_SYMBOL)
     {
-        paramsObject->append(QActiveResource::Param(to_s(key), to_s(value)));
+        rb_ary_push(params, rb_assoc_new(to_s(key), to_s(value)));
     }
     else
     {
-        paramsObject->append(QActiveResource::Param(to_s(key), to_s(value)));
-        qCritical() << "QActiveResource: Value type of key" << to_s(key)
-                    << "not supported.";
+        VALUE keyString = to_s(key);
+        rb_ary_push(params, rb_assoc_new(keyString, to_s(value)));
+        qCritical() << "QActiveResource: Value type of key"
+                    << RSTRING_PTR(keyString) << "not supported.";
     }
 
     return 0;
@@ -297,9 +596,7 @@ static int params_hash_iterator(VALUE key, VALUE value, VALUE params)
 
 static int headers_hash_iterator(VALUE key, VALUE value, VALUE headers)
 {
-    SharedObject::Wrapper<QActiveResource::Resource::Headers> headersObject(headers);
-
-    headersObject->insert(to_s(key), to_s(value));
+    rb_ary_push(headers, rb_assoc_new(to_s(key), to_s(value)));
 
     return 0;
 }
@@ -333,21 +630,152 @@ static QActiveResource::Resource *get_resource(VALUE self)
     return resource;
 }
 
-static VALUE qar_find(int argc, VALUE *argv, VALUE self)
+/*!
+ * The arguments of a find as Ruby values.  Getting them calls back into Ruby,
+ * which may raise, so they're gathered before any C++ objects are created; the
+ * strings are the results of to_s and the parameters and headers are arrays
+ * of [key, value] strings.  This lives on the stack, where Ruby's collector
+ * sees it.
+ */
+
+struct FindArguments
 {
-    SharedObject::Scope objectScope;
+    QActiveResource::Resource *resource;
+    VALUE site;
+    bool hasTimeout;
+    int timeout;
+    ID style;
+    VALUE name;
+    VALUE from;
+    VALUE extension;
+    VALUE params;
+    VALUE headers;
+};
+
+/*!
+ * A find whose arguments have been converted so that it can be run without
+ * the GVL.
+ */
 
-    QActiveResource::Resource *resource = get_resource(self);
-    resource->setBase(to_s(rb_funcall(self, _site, 0)));
+struct FindCall
+{
+    FindCall() : style(0), finished(false) {}
 
-    VALUE timeout = rb_ivar_get(self, __timeout);
-    if(timeout != Qnil)
+    QActiveResource::Resource resource;
+    QActiveResource::Cancellation cancellation;
+    ID style;
+    QString from;
+    QActiveResource::ParamList params;
+    EventBuffer events;
+    QList<QActiveResource::Exception> errors;
+    bool finished;
+};
+
+/*!
+ * Runs without the GVL, so it must not touch any Ruby objects.
+ */
+
+static void *find_without_gvl(void *data)
+{
+    FindCall *call = reinterpret_cast<FindCall *>(data);
+
+    try
+    {
+        if(call->style)
+        {
+            call->resource.build(QActiveResource::FindAll, call->from, call->params,
+                                 &call->events);
+        }
+        else
+        {
+            call->resource.build(call->from, &call->events);
+        }
+    }
+    catch(const QActiveResource::Exception &ex)
     {
-        resource->setTimeout(NUM2INT(timeout));
+        call->errors.append(ex);
     }
 
-    QString from;
-    SharedObject::Wrapper<QActiveResource::ParamList>paramsObject(objectScope);
+    call->finished = true;
+
+    return 0;
+}
+
+#ifndef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+static VALUE find_blocking_region(void *data)
+{
+    find_without_gvl(data);
+    return Qnil;
+}
+#endif
+
+/*!
+ * Called by Ruby when the thread running the find is interrupted, e.g. by
+ * Thread#raise or Thread#kill.  The transfer is aborted shortly after.
+ */
+
+static void find_unblock(void *data)
+{
+    reinterpret_cast<FindCall *>(data)->cancellation.cancel();
+}
+
+static VALUE to_exception(const QActiveResource::Exception &ex)
+{
+    VALUE code = rb_int_new(ex.response().code());
+    VALUE response = rb_funcall(rb_cQARResponse, _new, 3,
+                                code,
+                                to_value(ex.response().headers()),
+                                rb_str_new2(ex.response().data()));
+
+    // Canceled finds only get here if Ruby didn't have an exception of its own
+    // to raise.
+
+    VALUE klass = rb_eActiveResourceConnectionError;
+
+    #define AR_TEST_EXCEPTION(name)                                     \
+        if(ex.type() == QActiveResource::Exception::name)               \
+        {                                                               \
+            klass = rb_eActiveResource##name;                           \
+        }
+
+    AR_TEST_EXCEPTION(ConnectionError);
+    AR_TEST_EXCEPTION(TimeoutError);
+    AR_TEST_EXCEPTION(SSLError);
+    AR_TEST_EXCEPTION(Redirection);
+    AR_TEST_EXCEPTION(ClientError);
+    AR_TEST_EXCEPTION(BadRequest);
+    AR_TEST_EXCEPTION(UnauthorizedAccess);
+    AR_TEST_EXCEPTION(ForbiddenAccess);
+    AR_TEST_EXCEPTION(ResourceNotFound);
+    AR_TEST_EXCEPTION(MethodNotAllowed);
+    AR_TEST_EXCEPTION(ResourceConflict);
+    AR_TEST_EXCEPTION(ResourceGone);
+    AR_TEST_EXCEPTION(ServerError);
+
+    VALUE e = rb_funcall(klass, _allocate, 0);
+    rb_ivar_set(e, __code, code);
+    rb_ivar_set(e, __response, response);
+    rb_ivar_set(e, __message, to_value(ex.message()));
+
+    return e;
+}
+
+/*!
+ * Gathers the arguments of a find.  Anything here may raise, so no C++ objects
+ * may be created.
+ */
+
+static void find_arguments(int argc, VALUE *argv, VALUE self, FindArguments *arguments)
+{
+    arguments->resource = get_resource(self);
+    arguments->site = to_s(rb_funcall(self, _site, 0));
+
+    VALUE timeout = rb_ivar_get(self, __timeout);
+    arguments->hasTimeout = timeout != Qnil;
+    arguments->timeout = arguments->hasTimeout ? NUM2INT(timeout) : 0;
+
+    arguments->params = rb_ary_new();
+    arguments->from = Qnil;
 
     if(argc >= 2 && TYPE(argv[1]) == T_HASH)
     {
@@ -357,110 +785,169 @@ static VALUE qar_find(int argc, VALUE *argv, VALUE self)
         {
             rb_hash_foreach(params_hash,
                             (ITERATOR) params_hash_iterator,
-                            paramsObject.value());
+                            arguments->params);
         }
 
-        from = to_s(rb_hash_aref(argv[1], ID2SYM(_from)));
+        arguments->from = to_s(rb_hash_aref(argv[1], ID2SYM(_from)));
     }
 
-    resource->setResource(to_s(rb_funcall(self, _collection_name, 0)));
+    VALUE format = rb_respond_to(self, _format) ? rb_funcall(self, _format, 0) : Qnil;
+
+    arguments->extension = Qnil;
 
-    SharedObject::Wrapper<QActiveResource::Resource::Headers> headersObject(objectScope);
+    if(format != Qnil && rb_respond_to(format, _extension))
+    {
+        arguments->extension = to_s(rb_funcall(format, _extension, 0));
+    }
+
+    arguments->headers = rb_ary_new();
     rb_hash_foreach(rb_funcall(self, _headers, 0), (ITERATOR) headers_hash_iterator,
-                    headersObject.value());
-    resource->setHeaders(*headersObject.ptr());
+                    arguments->headers);
 
-    try
+    arguments->style = _all;
+    arguments->name = Qnil;
+
+    if(argc >= 1)
     {
-        if(from.endsWith(".json"))
+        arguments->style = SYMBOL_P(argv[0]) ? SYM2ID(argv[0]) : 0;
+
+        if(arguments->style == _one)
+        {
+            arguments->name = to_s(rb_funcall(self, _element_name, 0));
+        }
+        else if(arguments->style != _first && arguments->style != _last &&
+                arguments->style != _all)
         {
-            qDebug() << "QActiveResource can only deal with XML, not JSON requests.";
+            arguments->style = 0;
+            arguments->from = to_s(argv[0]);
+        }
+    }
 
-            QActiveResource::Response response(400,
-                                               QActiveResource::Response::Headers(),
-                                               QByteArray());
+    if(arguments->name == Qnil)
+    {
+        arguments->name = to_s(rb_funcall(self, _collection_name, 0));
+    }
+}
 
-            throw QActiveResource::Exception(QActiveResource::Exception::ClientError,
-                                             response,
-                                             "QActiveResource only supports XML queries.");
+/*!
+ * Runs the find with the GVL released and converts the result.  Rather than
+ * raising, an error is returned in \a error and an exception raised while
+ * converting is left pending in \a state, so that the C++ objects here are
+ * destroyed before Ruby unwinds the stack.
+ */
 
-        }
+static VALUE find(VALUE self, const FindArguments &arguments, VALUE *error, int *state)
+{
+    // The call gets its own copy of the resource, which is shared by all
+    // threads using the class.
 
-        if(argc >= 1)
-        {
-            ID current = SYM2ID(argv[0]);
+    FindCall call;
+    call.resource = *arguments.resource;
+    call.resource.setCancellation(call.cancellation);
+    call.resource.setBase(to_qstring(arguments.site));
+    call.resource.setResource(to_qstring(arguments.name));
 
-            if(current == _one)
-            {
-                resource->setResource(to_s(rb_funcall(self, _element_name, 0)));
-                QVariant v = resource->find(QActiveResource::FindOne, from,
-                                            *paramsObject.ptr());
-                return to_value(v, self);
-            }
-            else if(current == _first)
-            {
-                QVariant v = resource->find(QActiveResource::FindFirst, from,
-                                            *paramsObject.ptr());
-                return to_value(v, self);
-            }
-            else if(current == _last)
-            {
-                QVariant v = resource->find(QActiveResource::FindLast, from,
-                                            *paramsObject.ptr());
-                return to_value(v, self);
-            }
-            else if(current != _all)
-            {
-                return to_value(resource->find(to_s(argv[0])), self);
-            }
-        }
+    if(arguments.hasTimeout)
+    {
+        call.resource.setTimeout(arguments.timeout);
+    }
 
-        QActiveResource::RecordList records =
-            resource->find(QActiveResource::FindAll, from, *paramsObject.ptr());
-        VALUE array = rb_ary_new2(records.length());
+    call.style = arguments.style;
 
-        for(int i = 0; i < records.length(); i++)
-        {
-            rb_ary_store(array, i, to_value(records[i], self));
-        }
+    if(arguments.from != Qnil)
+    {
+        call.from = to_qstring(arguments.from);
+    }
 
-        return array;
-    }
-    catch(QActiveResource::Exception ex)
-    {
-        VALUE code = rb_int_new(ex.response().code());
-        VALUE response = rb_funcall(rb_cQARResponse, _new, 3,
-                                    code,
-                                    to_value(ex.response().headers()),
-                                    rb_str_new2(ex.response().data()));
-
-        #define AR_TEST_EXCEPTION(name)                                 \
-            if(ex.type() == QActiveResource::Exception::name)           \
-            {                                                           \
-                VALUE e = rb_funcall(                                   \
-                    rb_eActiveResource##name, _allocate, 0);            \
-                rb_ivar_set(e, __code, code);                           \
-                rb_ivar_set(e, __response, response);                   \
-                rb_ivar_set(e, __message, to_value(ex.message()));      \
-                rb_exc_raise(e);                                        \
-            }
+    for(long i = 0; i < RARRAY_LEN(arguments.params); i++)
+    {
+        VALUE param = rb_ary_entry(arguments.params, i);
+        call.params.append(QActiveResource::Param(to_qstring(rb_ary_entry(param, 0)),
+                                                  to_qstring(rb_ary_entry(param, 1))));
+    }
+
+    if(call.from.endsWith(".json") ||
+       (arguments.extension != Qnil && to_qstring(arguments.extension) == "json"))
+    {
+        call.resource.setFormat(QActiveResource::JsonFormat);
+    }
+    else
+    {
+        call.resource.setFormat(QActiveResource::XmlFormat);
+    }
+
+    QActiveResource::Resource::Headers headers;
+
+    for(long i = 0; i < RARRAY_LEN(arguments.headers); i++)
+    {
+        VALUE header = rb_ary_entry(arguments.headers, i);
+        headers.insert(to_qstring(rb_ary_entry(header, 0)),
+                       to_qstring(rb_ary_entry(header, 1)));
+    }
+
+    call.resource.setHeaders(headers);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    rb_thread_call_without_gvl2(find_without_gvl, &call, find_unblock, &call);
+#else
+    rb_thread_blocking_region(find_blocking_region, &call, find_unblock, &call);
+#endif
 
-        AR_TEST_EXCEPTION(ConnectionError);
-        AR_TEST_EXCEPTION(TimeoutError);
-        AR_TEST_EXCEPTION(SSLError);
-        AR_TEST_EXCEPTION(Redirection);
-        AR_TEST_EXCEPTION(ClientError);
-        AR_TEST_EXCEPTION(BadRequest);
-        AR_TEST_EXCEPTION(UnauthorizedAccess);
-        AR_TEST_EXCEPTION(ForbiddenAccess);
-        AR_TEST_EXCEPTION(ResourceNotFound);
-        AR_TEST_EXCEPTION(MethodNotAllowed);
-        AR_TEST_EXCEPTION(ResourceConflict);
-        AR_TEST_EXCEPTION(ResourceGone);
-        AR_TEST_EXCEPTION(ServerError);
+    if(!call.finished)
+    {
+        call.errors.append(QActiveResource::Exception(
+                               QActiveResource::Exception::Canceled,
+                               QActiveResource::Response(0, QActiveResource::Response::Headers(),
+                                                         QByteArray()),
+                               "Interrupted"));
+    }
 
+    if(!call.errors.isEmpty())
+    {
+        *error = to_exception(call.errors.front());
         return Qnil;
     }
+
+    return Conversion(self).records(call.events, state);
+}
+
+static VALUE qar_find(int argc, VALUE *argv, VALUE self)
+{
+    FindArguments arguments;
+    find_arguments(argc, argv, self, &arguments);
+
+    VALUE error = Qnil;
+    int state = 0;
+    VALUE records = find(self, arguments, &error, &state);
+
+    // Interrupts that arrived while the GVL was released are raised here.
+
+    rb_thread_check_ints();
+
+    if(state)
+    {
+        rb_jump_tag(state);
+    }
+
+    if(error != Qnil)
+    {
+        rb_exc_raise(error);
+    }
+
+    if(arguments.style == _all)
+    {
+        return records;
+    }
+
+    // Like Resource::find(FindSingle), an empty record is returned if there
+    // are none.
+
+    if(RARRAY_LEN(records) == 0)
+    {
+        return rb_hash_new();
+    }
+
+    return rb_ary_entry(records, arguments.style == _last ? -1 : 0);
 }
 
 static VALUE set_follow_redirects(VALUE self, VALUE follow)
@@ -40,4 +40,7 @@ else
   pkg_config(pc)
 end
 
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl2", "ruby/thread.h")
+
 create_makefile("QAR")
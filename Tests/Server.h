@@ -0,0 +1,205 @@
+/*
+ * A minimal loopback HTTP server for the tests and the benchmark harness.  It
+ * runs in its own thread, serves a fixed set of files and keeps connections
+ * alive.  Unknown paths get a 404.  Destroying the server also closes the
+ * connections that clients have kept open.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <QHash>
+#include <QByteArray>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QSet>
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+/*!
+ * The state that a Server shares with its connections.
+ */
+
+struct ServerState
+{
+    QHash<QByteArray, QByteArray> files;
+    QByteArray headers;
+    QAtomicInt requests;
+    QMutex mutex;
+    QSet<int> sockets;
+};
+
+class Connection : public QRunnable
+{
+public:
+    Connection(int socket, ServerState *state) :
+        m_socket(socket),
+        m_state(state)
+    {
+        QMutexLocker locker(&m_state->mutex);
+        m_state->sockets.insert(m_socket);
+    }
+
+    void run()
+    {
+        QByteArray buffer;
+        char chunk[4096];
+
+        while(true)
+        {
+            int end = buffer.indexOf("\r\n\r\n");
+
+            if(end < 0)
+            {
+                ssize_t received = recv(m_socket, chunk, sizeof(chunk), 0);
+
+                if(received <= 0)
+                {
+                    break;
+                }
+
+                buffer.append(chunk, int(received));
+                continue;
+            }
+
+            QList<QByteArray> requestLine = buffer.left(buffer.indexOf("\r\n")).split(' ');
+            QByteArray path = requestLine.size() > 1 ? requestLine[1] : QByteArray();
+
+            buffer.remove(0, end + 4);
+            m_state->requests.ref();
+
+            if(path.contains('?'))
+            {
+                path = path.left(path.indexOf('?'));
+            }
+
+            QByteArray response;
+
+            if(m_state->files.contains(path))
+            {
+                const QByteArray &body = m_state->files[path];
+                response = "HTTP/1.1 200 OK\r\nContent-Type: " +
+                    QByteArray(path.endsWith(".json") ? "application/json" : "application/xml") +
+                    "\r\nContent-Length: " + QByteArray::number(body.size()) + "\r\n" +
+                    m_state->headers + "\r\n" + body;
+            }
+            else
+            {
+                response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+            }
+
+            for(int sent = 0; sent < response.size(); )
+            {
+                ssize_t count = send(m_socket, response.constData() + sent,
+                                     response.size() - sent, MSG_NOSIGNAL);
+
+                if(count <= 0)
+                {
+                    break;
+                }
+
+                sent += int(count);
+            }
+        }
+
+        QMutexLocker locker(&m_state->mutex);
+        m_state->sockets.remove(m_socket);
+        close(m_socket);
+    }
+
+private:
+    int m_socket;
+    ServerState *m_state;
+};
+
+class Server : public QThread
+{
+public:
+    /*!
+     * Serves \a files, which are keyed by their path, e.g. "/tests.xml".  The
+     * header lines in \a headers, each ending with "\r\n", are added to every
+     * successful response.
+     */
+    Server(const QHash<QByteArray, QByteArray> &files, const QByteArray &headers = QByteArray()) :
+        m_socket(socket(AF_INET, SOCK_STREAM, 0)),
+        m_port(0)
+    {
+        m_state.files = files;
+        m_state.headers = headers;
+
+        int on = 1;
+        setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        socklen_t length = sizeof(address);
+
+        if(bind(m_socket, (sockaddr *) &address, length) == 0 &&
+           listen(m_socket, 64) == 0 &&
+           getsockname(m_socket, (sockaddr *) &address, &length) == 0)
+        {
+            m_port = ntohs(address.sin_port);
+        }
+
+        m_pool.setMaxThreadCount(64);
+    }
+
+    ~Server()
+    {
+        shutdown(m_socket, SHUT_RDWR);
+        close(m_socket);
+        wait();
+
+        // Connections that are kept alive would otherwise block the pool's
+        // destructor until the client closes them.
+
+        QMutexLocker locker(&m_state.mutex);
+
+        foreach(int client, m_state.sockets)
+        {
+            shutdown(client, SHUT_RDWR);
+        }
+    }
+
+    int port() const
+    {
+        return m_port;
+    }
+
+    /*!
+     * \return The number of requests received so far.
+     */
+    int requests() const
+    {
+        return int(m_state.requests);
+    }
+
+protected:
+    void run()
+    {
+        int client;
+
+        while((client = accept(m_socket, 0, 0)) >= 0)
+        {
+            m_pool.start(new Connection(client, &m_state));
+        }
+    }
+
+private:
+    ServerState m_state;
+    QThreadPool m_pool;
+    int m_socket;
+    int m_port;
+};
+
+#endif
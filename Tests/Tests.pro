@@ -0,0 +1,7 @@
+TEMPLATE = subdirs
+SUBDIRS = unit executor
+
+# "make check" builds and runs every test program.
+
+check.CONFIG = recursive
+QMAKE_EXTRA_TARGETS += check
@@ -0,0 +1,242 @@
+/*
+ * Checks that Executor::clear() is safe while other threads add finds or wait
+ * for results, and that indexes it invalidated throw rather than reading
+ * entries that are gone.  A small collection is fetched from a loopback
+ * server.  How throughput scales with the number of threads depends on the
+ * machine's load, so it's reported by the benchmark harness rather than
+ * checked here.
+ *
+ * Usage: executor [requests]
+ */
+
+#include <QActiveResource.h>
+
+#include "../Server.h"
+
+#include <stdio.h>
+
+using namespace QActiveResource;
+
+static const char products[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<products type=\"array\">\n"
+    "  <product><id type=\"integer\">1</id><title>Shirt</title></product>\n"
+    "  <product><id type=\"integer\">2</id><title>Hat</title></product>\n"
+    "</products>\n";
+
+/*!
+ * Adds finds to an executor from its own thread.
+ */
+
+class Adder : public QThread
+{
+public:
+    Adder(const Executor &executor, const Resource &resource, int count) :
+        m_executor(executor),
+        m_resource(resource),
+        m_count(count)
+    {
+
+    }
+
+protected:
+    void run()
+    {
+        for(int i = 0; i < m_count; i++)
+        {
+            m_executor.add(m_resource);
+        }
+    }
+
+private:
+    Executor m_executor;
+    Resource m_resource;
+    int m_count;
+};
+
+/*!
+ * Waits for the result of a find from its own thread.
+ */
+
+class Waiter : public QThread
+{
+public:
+    Waiter(const Executor &executor, int index) :
+        m_executor(executor),
+        m_index(index),
+        m_records(-1),
+        m_canceled(false)
+    {
+
+    }
+
+    int records() const
+    {
+        return m_records;
+    }
+
+    bool canceled() const
+    {
+        return m_canceled;
+    }
+
+protected:
+    void run()
+    {
+        try
+        {
+            m_records = m_executor.result(m_index).size();
+        }
+        catch(const Exception &exception)
+        {
+            m_canceled = exception.type() == Exception::Canceled;
+        }
+    }
+
+private:
+    Executor m_executor;
+    int m_index;
+    int m_records;
+    bool m_canceled;
+};
+
+/*!
+ * Clears \a executor while another thread adds finds to it.  \return False if
+ * a find that survived a clear() doesn't have its result.
+ */
+
+static bool clearing(const Resource &resource, int requests)
+{
+    Executor executor(4);
+    Adder adder(executor, resource, requests);
+
+    adder.start();
+
+    while(adder.isRunning())
+    {
+        executor.clear();
+    }
+
+    adder.wait();
+    executor.waitForDone();
+
+    for(int i = 0; i < executor.size(); i++)
+    {
+        try
+        {
+            executor.result(i);
+        }
+        catch(const Exception &exception)
+        {
+            fprintf(stderr, "Find failed: %s\n", qPrintable(exception.message()));
+            return false;
+        }
+    }
+
+    printf("%i of %i finds were kept after clearing\n", executor.size(), requests);
+    return true;
+}
+
+/*!
+ * \return True if \a call throws an Exception of type Exception::Canceled.
+ */
+
+static bool throwsCanceled(const Executor &executor, int index, int call)
+{
+    try
+    {
+        switch(call)
+        {
+        case 0:
+            executor.isFinished(index);
+            break;
+        case 1:
+            executor.hasError(index);
+            break;
+        default:
+            executor.result(index);
+            break;
+        }
+    }
+    catch(const Exception &exception)
+    {
+        return exception.type() == Exception::Canceled;
+    }
+
+    return false;
+}
+
+/*!
+ * \return False if an index that was never handed out or that clear()
+ * invalidated doesn't throw, or if a thread waiting for a result is left
+ * reading a removed entry.
+ */
+
+static bool invalidIndexes(const Resource &resource, int requests)
+{
+    bool passed = true;
+    Executor executor(2);
+
+    for(int call = 0; call < 3; call++)
+    {
+        passed = throwsCanceled(executor, 0, call) && passed;
+        passed = throwsCanceled(executor, -1, call) && passed;
+    }
+
+    for(int i = 0; i < requests; i++)
+    {
+        executor.add(resource);
+
+        Waiter waiter(executor, 0);
+        waiter.start();
+        executor.clear();
+        waiter.wait();
+
+        // The waiter either got the result before the clear() or was told
+        // that the find was removed.
+
+        if(waiter.records() != 2 && !waiter.canceled())
+        {
+            passed = false;
+        }
+
+        passed = throwsCanceled(executor, 0, 2) && passed;
+    }
+
+    if(!passed)
+    {
+        fprintf(stderr, "Invalid indexes didn't throw\n");
+    }
+
+    return passed;
+}
+
+int main(int argc, char *argv[])
+{
+    int requests = argc > 1 ? QString(argv[1]).toInt() : 100;
+
+    QHash<QByteArray, QByteArray> files;
+    files["/products.xml"] = products;
+
+    Server server(files);
+
+    if(!server.port())
+    {
+        fprintf(stderr, "Couldn't start the server\n");
+        return 1;
+    }
+
+    server.start();
+
+    Resource resource(QUrl(QString("http://127.0.0.1:%1/").arg(server.port())), "products");
+
+    bool passed = clearing(resource, requests);
+    passed = invalidIndexes(resource, requests / 10 + 1) && passed;
+
+    // Close the pooled keep-alive connections so that the server's connection
+    // threads finish.
+
+    ConnectionPool::clear();
+
+    return passed ? 0 : 1;
+}
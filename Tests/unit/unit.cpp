@@ -0,0 +1,947 @@
+/*
+ * Checks Record and the decoders against small documents with known contents.
+ * Every failed check is printed and the exit status is non-zero if any failed.
+ *
+ * Usage: unit
+ */
+
+#include <QActiveResource.h>
+
+#include "../Server.h"
+
+#include <QDir>
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QFuture>
+
+#include <stdio.h>
+
+using namespace QActiveResource;
+
+static int failures = 0;
+
+#define CHECK(condition) check(condition, #condition, __FILE__, __LINE__)
+
+static bool check(bool condition, const char *text, const char *file, int line)
+{
+    if(!condition)
+    {
+        fprintf(stderr, "%s:%i: check failed: %s\n", file, line, text);
+        failures++;
+    }
+
+    return condition;
+}
+
+static bool isRecord(const QVariant &value)
+{
+    return value.userType() == qMetaTypeId<Record>();
+}
+
+/*!
+ * Compares two decoded values, including nested records and lists.
+ */
+
+static bool same(const QVariant &a, const QVariant &b)
+{
+    if(isRecord(a) || isRecord(b))
+    {
+        if(!isRecord(a) || !isRecord(b))
+        {
+            return false;
+        }
+
+        Record x(a);
+        Record y(b);
+
+        if(x.className() != y.className() || x.size() != y.size())
+        {
+            return false;
+        }
+
+        for(Record::ConstIterator it = x.begin(), last = x.end(); it != last; ++it)
+        {
+            if(!y.contains(it.key()) || !same(it.value(), y[it.key()]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    if(a.type() == QVariant::List || b.type() == QVariant::List)
+    {
+        QVariantList x = a.toList();
+        QVariantList y = b.toList();
+
+        if(a.type() != b.type() || x.size() != y.size())
+        {
+            return false;
+        }
+
+        for(int i = 0; i < x.size(); i++)
+        {
+            if(!same(x[i], y[i]))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    return a.type() == b.type() && a.isNull() == b.isNull() && a == b;
+}
+
+/*!
+ * Counts the records passed to it and stops after \a limit of them.
+ */
+
+class Counter : public RecordHandler
+{
+public:
+    Counter(int l) : limit(l), count(0) {}
+
+    bool handle(const Record &)
+    {
+        return ++count < limit;
+    }
+
+    int limit;
+    int count;
+};
+
+/*!
+ * Writes the events passed to it as text, e.g. "{Product id=1 tags=[x] }".
+ */
+
+class Recorder : public Builder
+{
+public:
+    void beginRecord(const QByteArray &className) { text += "{" + className + " "; }
+    void endRecord() { text += "} "; }
+    void beginList() { text += "["; }
+    void endList() { text += "] "; }
+    void key(const QByteArray &key) { text += key + "="; }
+    void nullValue() { text += "null "; }
+    void stringValue(const QByteArray &value) { text += "'" + value + "' "; }
+    void intValue(qint64 value) { text += QByteArray::number(value) + " "; }
+    void doubleValue(double value) { text += QByteArray::number(value) + "f "; }
+    void boolValue(bool value) { text += value ? "true " : "false "; }
+    void dateTimeValue(const QDateTime &value) { text += value.toString(Qt::ISODate).toUtf8() + " "; }
+
+    QByteArray text;
+};
+
+/*
+ * Record
+ */
+
+static void recordIteration()
+{
+    Record vendor;
+    vendor.setClassName("Vendor");
+    vendor["name"] = "Acme";
+
+    Record product;
+    product["vendor"] = vendor;
+    product["variants"] = QVariantList() << QVariant(vendor);
+
+    QVariant value = product;
+
+    // The temporary record is gone by the time the iterator is used.
+
+    Record::ConstIterator it = Record(value).begin();
+    CHECK(it.key() == "vendor" && isRecord(it.value()));
+
+    QVariantHash hash = product.toHash();
+    CHECK(hash["vendor"].toHash()["name"].toString() == "Acme");
+    CHECK(hash["vendor"].toHash()["QActiveResource Class"].toString() == "Vendor");
+    CHECK(hash["variants"].toList().value(0).toHash()["name"].toString() == "Acme");
+}
+
+/*
+ * Cache
+ */
+
+static void cacheNull()
+{
+    Cache cache = Resource(QUrl("http://localhost/"), "products").cache();
+
+    CHECK(cache.isNull());
+    CHECK(cache.hits() == 0 && cache.misses() == 0 && cache.size() == 0);
+
+    cache.setMaxAge(60);
+    cache.setDirectory(QString());
+    cache.clear();
+
+    CHECK(cache.maxAge() == 0 && cache.directory().isEmpty());
+}
+
+static void cacheRoundTrip()
+{
+    QHash<QByteArray, QByteArray> files;
+    files["/products.xml"] =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<products type=\"array\">\n"
+        "  <product>\n"
+        "    <id type=\"integer\">1</id>\n"
+        "    <title>Caf\xc3\xa9 \xe2\x82\xac</title>\n"
+        "    <price type=\"float\">19.5</price>\n"
+        "    <available type=\"boolean\">true</available>\n"
+        "    <created-at type=\"datetime\">2012-03-04T05:06:07Z</created-at>\n"
+        "    <vendor-id type=\"integer\" nil=\"true\"></vendor-id>\n"
+        "    <vendor><name>Acme</name></vendor>\n"
+        "    <variants type=\"array\">\n"
+        "      <variant><sku>a</sku><grams type=\"integer\">5</grams></variant>\n"
+        "      <variant><sku>b</sku><grams type=\"integer\">7</grams></variant>\n"
+        "    </variants>\n"
+        "    <images type=\"array\"/>\n"
+        "  </product>\n"
+        "  <product>\n"
+        "    <id type=\"integer\">2</id>\n"
+        "    <title></title>\n"
+        "  </product>\n"
+        "</products>\n";
+
+    Server server(files, "ETag: \"1\"\r\n");
+
+    if(!CHECK(server.port() != 0))
+    {
+        return;
+    }
+
+    server.start();
+
+    QDir directory(QDir::temp().filePath(
+        QString("qar-unit-%1").arg(QCoreApplication::applicationPid())));
+    directory.mkpath(".");
+
+    QUrl base(QString("http://127.0.0.1:%1/").arg(server.port()));
+
+    Resource first(base, "products");
+    Cache writer;
+    writer.setDirectory(directory.path());
+    first.setCache(writer);
+
+    RecordList stored = first.find();
+
+    CHECK(stored.size() == 2);
+    CHECK(server.requests() == 1);
+    CHECK(directory.entryList(QDir::Files).size() == 1);
+
+    // A new cache only has the saved file to go on.
+
+    Resource second(base, "products");
+    Cache reader;
+    reader.setDirectory(directory.path());
+    reader.setMaxAge(3600);
+    second.setCache(reader);
+
+    RecordList loaded = second.find();
+
+    CHECK(server.requests() == 1);
+    CHECK(reader.hits() == 1 && reader.misses() == 0);
+
+    if(CHECK(loaded.size() == stored.size()))
+    {
+        for(int i = 0; i < loaded.size(); i++)
+        {
+            CHECK(same(QVariant(loaded[i]), QVariant(stored[i])));
+        }
+    }
+
+    foreach(QString file, directory.entryList(QDir::Files))
+    {
+        directory.remove(file);
+    }
+
+    directory.rmdir(directory.path());
+}
+
+/*
+ * Builder
+ */
+
+static void builderIntegers()
+{
+    QHash<QByteArray, QByteArray> files;
+    files["/products.json"] = "[{\"id\": 1, \"stock\": 4294967296, \"change\": -8589934592}]";
+    files["/products.xml"] =
+        "<products type=\"array\"><product>"
+        "<id type=\"integer\">1</id><stock type=\"integer\">4294967296</stock>"
+        "</product></products>";
+
+    Server server(files);
+
+    if(!CHECK(server.port() != 0))
+    {
+        return;
+    }
+
+    server.start();
+
+    Resource resource(QUrl(QString("http://127.0.0.1:%1/").arg(server.port())), "products");
+
+    Recorder json;
+    resource.setFormat(JsonFormat);
+    resource.build(FindAll, QString(), ParamList(), &json);
+    CHECK(json.text == "{Product id=1 stock=4294967296 change=-8589934592 } ");
+
+    Recorder xml;
+    resource.setFormat(XmlFormat);
+    resource.build(FindAll, QString(), ParamList(), &xml);
+    CHECK(xml.text == "{Product id=1 stock=4294967296 } ");
+
+    RecordList records = resource.find();
+    CHECK(records.size() == 1 && records[0]["stock"].toLongLong() == Q_INT64_C(4294967296));
+}
+
+static void builderShapes()
+{
+    QHash<QByteArray, QByteArray> files;
+    files["/wrapped.xml"] =
+        "<result><products type=\"array\">"
+        "<product><id type=\"integer\">1</id></product>"
+        "<product><id type=\"integer\">2</id></product>"
+        "</products></result>";
+    files["/nested.xml"] =
+        "<products type=\"array\"><product>"
+        "<vendor><name>Acme</name></vendor>"
+        "<variants type=\"array\"><variant><sku>a</sku></variant></variants>"
+        "<note nil=\"true\"/>"
+        "</product></products>";
+
+    Server server(files);
+
+    if(!CHECK(server.port() != 0))
+    {
+        return;
+    }
+
+    server.start();
+
+    QUrl base(QString("http://127.0.0.1:%1/").arg(server.port()));
+
+    // A root record that only holds a list is unwrapped as with find().
+
+    Resource wrapped(base, "wrapped");
+    Recorder unwrapped;
+    wrapped.build(FindAll, QString(), ParamList(), &unwrapped);
+    CHECK(unwrapped.text == "{Product id=1 } {Product id=2 } ");
+    CHECK(wrapped.find().size() == 2);
+
+    Resource nested(base, "nested");
+    Recorder all;
+    nested.build(FindAll, QString(), ParamList(), &all);
+    CHECK(all.text == "{Product vendor={Vendor name='Acme' } "
+                      "variants=[{Variant sku='a' } ] note=null } ");
+
+    nested.setFields(QStringList() << "variants.sku");
+    Recorder projected;
+    nested.build(FindAll, QString(), ParamList(), &projected);
+    CHECK(projected.text == "{Product variants=[{Variant sku='a' } ] } ");
+}
+
+static void builderFeatures()
+{
+    QHash<QByteArray, QByteArray> files;
+    files["/products.xml"] =
+        "<products type=\"array\">"
+        "<product><id type=\"integer\">1</id></product>"
+        "<product><id type=\"integer\">2</id></product>"
+        "</products>";
+
+    Server server(files, "ETag: \"1\"\r\n");
+
+    if(!CHECK(server.port() != 0))
+    {
+        return;
+    }
+
+    server.start();
+
+    Resource resource(QUrl(QString("http://127.0.0.1:%1/").arg(server.port())), "products");
+
+    // Every page is the same, so the pages end with maxPages().
+
+    Pagination pagination;
+    pagination.setMaxPages(2);
+    resource.setPagination(pagination);
+
+    Recorder pages;
+    resource.build(FindAllPages, QString(), ParamList(), &pages);
+    CHECK(pages.text == "{Product id=1 } {Product id=2 } {Product id=1 } {Product id=2 } ");
+    CHECK(server.requests() == 2);
+
+    Cache cache;
+    cache.setMaxAge(3600);
+    resource.setCache(cache);
+
+    Recorder first;
+    resource.build(FindAll, QString(), ParamList(), &first);
+
+    Recorder cached;
+    resource.build(FindAll, QString(), ParamList(), &cached);
+
+    CHECK(server.requests() == 3);
+    CHECK(cache.hits() == 1);
+    CHECK(first.text == "{Product id=1 } {Product id=2 } " && cached.text == first.text);
+}
+
+/*
+ * Pages
+ */
+
+static void pagesLimit()
+{
+    QHash<QByteArray, QByteArray> files;
+    files["/products.xml"] =
+        "<products type=\"array\">"
+        "<product><id type=\"integer\">1</id></product>"
+        "<product><id type=\"integer\">2</id></product>"
+        "</products>";
+
+    Server server(files, "ETag: \"1\"\r\n");
+
+    if(!CHECK(server.port() != 0))
+    {
+        return;
+    }
+
+    server.start();
+
+    Resource resource(QUrl(QString("http://127.0.0.1:%1/").arg(server.port())), "products");
+
+    // The first page is shorter than the limit, so the second one is never
+    // requested.
+
+    Pagination pagination;
+    pagination.setLimit("per_page", 3);
+    resource.setPagination(pagination);
+
+    CHECK(resource.find(FindAllPages, QString(), ParamList()).size() == 2);
+    CHECK(server.requests() == 1);
+
+    Cache cache;
+    cache.setMaxAge(3600);
+    resource.setCache(cache);
+
+    CHECK(resource.find(FindAllPages, QString(), ParamList()).size() == 2);
+    CHECK(resource.find(FindAllPages, QString(), ParamList()).size() == 2);
+    CHECK(server.requests() == 2);
+    CHECK(cache.hits() == 1);
+}
+
+/*
+ * Batch
+ */
+
+static void batchPages()
+{
+    QHash<QByteArray, QByteArray> files;
+    files["/products.xml"] =
+        "<products type=\"array\">"
+        "<product><id type=\"integer\">1</id></product>"
+        "</products>";
+
+    Server server(files);
+
+    if(!CHECK(server.port() != 0))
+    {
+        return;
+    }
+
+    server.start();
+
+    Resource resource(QUrl(QString("http://127.0.0.1:%1/").arg(server.port())), "products");
+
+    // Every page is the same, so the pages end with maxPages().
+
+    Pagination pagination;
+    pagination.setMaxPages(3);
+    resource.setPagination(pagination);
+
+    Batch batch;
+    int all = batch.add(resource);
+    int pages = batch.add(resource, FindAllPages);
+    batch.exec();
+
+    CHECK(batch.isFinished(all) && batch.result(all).size() == 1);
+    CHECK(batch.isFinished(pages) && batch.result(pages).size() == 3);
+}
+
+/*
+ * Asynchronous finds
+ */
+
+/*!
+ * Runs the event loop until \a future has finished.
+ */
+
+static void waitFor(const QFuture<RecordList> &future)
+{
+    QEventLoop loop;
+
+    while(!future.isFinished())
+    {
+        loop.processEvents(QEventLoop::WaitForMoreEvents);
+    }
+}
+
+static void asyncFinds()
+{
+    QHash<QByteArray, QByteArray> files;
+    files["/products.xml"] =
+        "<products type=\"array\">"
+        "<product><id type=\"integer\">1</id></product>"
+        "</products>";
+
+    Server server(files);
+
+    if(!CHECK(server.port() != 0))
+    {
+        return;
+    }
+
+    server.start();
+
+    Resource resource(QUrl(QString("http://127.0.0.1:%1/").arg(server.port())), "products");
+
+    // Every page is the same, so the pages end with maxPages().
+
+    Pagination pagination;
+    pagination.setMaxPages(3);
+    resource.setPagination(pagination);
+
+    QFuture<RecordList> all = resource.findAsync();
+    QFuture<RecordList> pages = resource.findAsync(FindAllPages);
+
+    waitFor(all);
+    waitFor(pages);
+
+    CHECK(all.result().size() == 1);
+    CHECK(pages.result().size() == 3);
+    CHECK(server.requests() == 4);
+
+    // A canceled find finishes without waiting for its response.
+
+    QFuture<RecordList> canceled = resource.findAsync(FindAllPages);
+    canceled.cancel();
+    waitFor(canceled);
+
+    CHECK(canceled.isCanceled());
+}
+
+/*
+ * Lazy decoding
+ */
+
+/*!
+ * \return The records decoded from \a xml, lazily if \a lazy is true.
+ */
+
+static RecordList decodeXml(const QByteArray &xml, bool lazy,
+                            const QStringList &fields = QStringList())
+{
+    Parser parser(XmlFormat, "products");
+    parser.setLazy(lazy);
+    parser.setFields(fields);
+    return parser.decode(xml);
+}
+
+/*!
+ * \return True if the records decoded from \a xml are the same whether or not
+ * they're decoded lazily.
+ */
+
+static bool sameLazily(const QByteArray &xml, const QStringList &fields = QStringList())
+{
+    RecordList eager = decodeXml(xml, false, fields);
+    RecordList lazy = decodeXml(xml, true, fields);
+
+    if(eager.isEmpty() || eager.size() != lazy.size())
+    {
+        return false;
+    }
+
+    for(int i = 0; i < eager.size(); i++)
+    {
+        if(!same(eager[i], lazy[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static const char lazyDocument[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<!-- <products type=\"array\"><product> -->\n"
+    "<products type=\"array\">\n"
+    "  <product>\n"
+    "    <title>caf\xc3\xa9 \xf0\x9f\x98\x80</title>\n"
+    "    <note><![CDATA[<vendor> </variants>]]></note>\n"
+    "    <tags type=\"array\"/>\n"
+    "    <vendor><name>Acme</name><address><city>Paris</city><zip>75001</zip></address></vendor>\n"
+    "    <variants type=\"array\">\n"
+    "      <variant><sku>a</sku><stock><count type=\"integer\">3</count></stock></variant>\n"
+    "      <!-- </variants> -->\n"
+    "      <variant label='>'><sku>b</sku><stock/></variant>\n"
+    "    </variants>\n"
+    "    <empty type=\"array\"></empty>\n"
+    "  </product>\n"
+    "</products>\n";
+
+static void lazyShapes()
+{
+    QByteArray xml = lazyDocument;
+
+    CHECK(sameLazily(xml));
+
+    RecordList records = decodeXml(xml, true);
+
+    if(!CHECK(records.size() == 1))
+    {
+        return;
+    }
+
+    const Record product = records[0];
+    const Record::Subtree *vendor = product.subtree("vendor");
+
+    if(CHECK(vendor && !vendor->isDecoded()))
+    {
+        QByteArray text = "<vendor><name>Acme</name><address><city>Paris</city>"
+                          "<zip>75001</zip></address></vendor>";
+
+        CHECK(vendor->encodedSize() == text.size());
+        CHECK(Record(Record(product["vendor"])["address"])["city"].toString() == "Paris");
+        CHECK(vendor->isDecoded());
+    }
+
+    CHECK(!product.subtree("title"));
+    CHECK(product["tags"].type() == QVariant::List && product["tags"].toList().isEmpty());
+    CHECK(product["note"].toString() == "<vendor> </variants>");
+
+    QVariantList variants = product["variants"].toList();
+
+    if(CHECK(variants.size() == 2))
+    {
+        CHECK(Record(Record(variants[0])["stock"])["count"].toInt() == 3);
+        CHECK(Record(variants[1])["sku"].toString() == "b");
+    }
+}
+
+static void lazyProjection()
+{
+    QByteArray xml = lazyDocument;
+    QStringList fields = QStringList() << "vendor.address.city" << "variants.sku";
+
+    CHECK(sameLazily(xml, fields));
+
+    RecordList records = decodeXml(xml, true, fields);
+
+    if(!CHECK(records.size() == 1))
+    {
+        return;
+    }
+
+    const Record product = records[0];
+    const Record vendor = product["vendor"];
+
+    CHECK(product.size() == 2);
+    CHECK(vendor.size() == 1 && Record(vendor["address"]).size() == 1);
+    CHECK(Record(vendor["address"])["city"].toString() == "Paris");
+
+    QVariantList variants = product["variants"].toList();
+
+    if(CHECK(variants.size() == 2))
+    {
+        CHECK(Record(variants[0]).size() == 1 && Record(variants[0])["sku"].toString() == "a");
+    }
+}
+
+/*!
+ * Decodes a document whose subtrees use entities and default attributes from
+ * the internal subset, which contains '>', and namespaces declared outside
+ * of them.
+ */
+
+static void lazyDeclarations()
+{
+    QByteArray xml =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<!DOCTYPE products [\n"
+        "  <!ENTITY shop \"Acme > Paris\">\n"
+        "  <!-- <product> isn't declared -->\n"
+        "  <!ATTLIST count type CDATA \"integer\">\n"
+        "]>\n"
+        "<products type=\"array\" xmlns=\"urn:products\" xmlns:v=\"urn:vendors\">\n"
+        "  <product>\n"
+        "    <title>&shop;</title>\n"
+        "    <v:vendor><v:name>&shop;</v:name><v:address><v:city>Paris</v:city></v:address></v:vendor>\n"
+        "    <stock><count>3</count></stock>\n"
+        "  </product>\n"
+        "</products>\n";
+
+    CHECK(sameLazily(xml));
+
+    RecordList records = decodeXml(xml, true);
+
+    if(!CHECK(records.size() == 1))
+    {
+        return;
+    }
+
+    const Record product = records[0];
+
+    CHECK(product.subtree("vendor") && product.subtree("stock"));
+    CHECK(Record(product["vendor"])["name"].toString() == "Acme > Paris");
+    CHECK(Record(Record(product["vendor"])["address"])["city"].toString() == "Paris");
+    CHECK(Record(product["stock"])["count"].type() == QVariant::Int);
+}
+
+/*!
+ * Decodes a document that's larger than the chunks that Parser passes to the
+ * decoder, so that subtrees span chunks.
+ */
+
+static void lazyLarge()
+{
+    QByteArray xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<products type=\"array\">\n";
+
+    for(int i = 0; xml.size() < 3 * 1024 * 1024 / 2; i++)
+    {
+        QByteArray id = QByteArray::number(i);
+
+        xml += "  <product>\n"
+               "    <id type=\"integer\">" + id + "</id>\n"
+               "    <title>Caf\xc3\xa9 " + id + "</title>\n"
+               "    <vendor><name>Acme " + id + "</name></vendor>\n"
+               "    <variants type=\"array\">\n"
+               "      <variant><sku>" + id + "-a</sku></variant>\n"
+               "      <variant><sku>" + id + "-b</sku><options type=\"array\"/></variant>\n"
+               "    </variants>\n"
+               "  </product>\n";
+    }
+
+    xml += "</products>\n";
+
+    CHECK(sameLazily(xml));
+    CHECK(sameLazily(xml, QStringList() << "id" << "variants.sku"));
+}
+
+/*
+ * JSON
+ */
+
+static void jsonValues()
+{
+    Parser parser(JsonFormat, "products");
+    RecordList records = parser.decode(
+        "[{\"id\": 1, \"title\": \"Shirt\", \"price\": 19.5, \"available\": true, "
+        "\"discontinued\": false, \"vendor_id\": null, \"stock\": 4294967296, "
+        "\"change\": -12, \"created_at\": \"2012-03-04T05:06:07Z\"}]");
+
+    if(!CHECK(records.size() == 1))
+    {
+        return;
+    }
+
+    const Record record = records[0];
+
+    CHECK(record.className() == "Product");
+    CHECK(record["id"].type() == QVariant::Int && record["id"].toInt() == 1);
+    CHECK(record["title"].toString() == "Shirt");
+    CHECK(record["price"].type() == QVariant::Double && record["price"].toDouble() == 19.5);
+    CHECK(record["available"].type() == QVariant::Bool && record["available"].toBool());
+    CHECK(record["discontinued"].type() == QVariant::Bool && !record["discontinued"].toBool());
+    CHECK(record.contains("vendor_id") && record["vendor_id"].isNull());
+    CHECK(record["stock"].type() == QVariant::LongLong &&
+          record["stock"].toLongLong() == Q_INT64_C(4294967296));
+    CHECK(record["change"].toInt() == -12);
+    CHECK(record["created_at"].toDateTime() ==
+          QDateTime(QDate(2012, 3, 4), QTime(5, 6, 7), Qt::UTC));
+}
+
+static void jsonStrings()
+{
+    Parser parser(JsonFormat, "notes");
+    RecordList records = parser.decode(
+        "[{\"escaped\": \"a\\\"b\\\\c\\nd\\u00e9\\ud83d\\ude00\", \"raw\": \"caf\xc3\xa9\", "
+        "\"empty\": \"\"}]");
+
+    if(!CHECK(records.size() == 1))
+    {
+        return;
+    }
+
+    const Record record = records[0];
+
+    CHECK(record["escaped"].toString() ==
+          QString::fromUtf8("a\"b\\c\nd\xc3\xa9\xf0\x9f\x98\x80"));
+    CHECK(record["raw"].toString() == QString::fromUtf8("caf\xc3\xa9"));
+    CHECK(record.contains("empty") && record["empty"].toString().isEmpty());
+}
+
+static void jsonRoots()
+{
+    Parser parser(JsonFormat, "products");
+
+    RecordList records = parser.decode("{\"products\": [{\"id\": 1}, {\"id\": 2}]}");
+    CHECK(records.size() == 2 && records[1]["id"].toInt() == 2);
+
+    records = parser.decode("{\"product\": {\"id\": 3, \"title\": \"Hat\"}}");
+    CHECK(records.size() == 1 && records[0]["id"].toInt() == 3 &&
+          records[0]["title"].toString() == "Hat");
+
+    records = parser.decode("{\"id\": 4, \"title\": \"Cap\"}");
+    CHECK(records.size() == 1 && records[0]["id"].toInt() == 4);
+
+    CHECK(parser.decode("[]").isEmpty());
+    CHECK(parser.decode(" \n ").isEmpty());
+}
+
+static void jsonNesting()
+{
+    Parser parser(JsonFormat, "products");
+    RecordList records = parser.decode(
+        "[{\"id\": 1, \"vendor\": {\"name\": \"Acme\"}, "
+        "\"variants\": [{\"sku\": \"a\"}, {\"sku\": \"b\"}], "
+        "\"tags\": [\"x\", \"y\"], \"empty\": []}]");
+
+    if(!CHECK(records.size() == 1))
+    {
+        return;
+    }
+
+    const Record record = records[0];
+
+    CHECK(isRecord(record["vendor"]));
+    CHECK(Record(record["vendor"]).className() == "Vendor");
+    CHECK(Record(record["vendor"])["name"].toString() == "Acme");
+
+    QVariantList variants = record["variants"].toList();
+
+    if(CHECK(variants.size() == 2))
+    {
+        CHECK(isRecord(variants[0]) && Record(variants[0]).className() == "Variant");
+        CHECK(Record(variants[1])["sku"].toString() == "b");
+    }
+
+    CHECK(record["tags"].toList() == (QVariantList() << "x" << "y"));
+    CHECK(record["empty"].type() == QVariant::List && record["empty"].toList().isEmpty());
+}
+
+static void jsonErrors()
+{
+    Parser parser(JsonFormat, "products");
+
+    RecordList records = parser.decode("[{\"id\": 1}, {\"id\": ");
+    CHECK(!records.isEmpty() && records[0]["id"].toInt() == 1);
+
+    CHECK(parser.decode("nonsense").isEmpty());
+    CHECK(parser.decode("[{\"id\": tru}]").size() <= 1);
+}
+
+static void jsonHandler()
+{
+    Parser parser(JsonFormat, "products");
+    Counter counter(2);
+
+    parser.decode("[{\"id\": 1}, {\"id\": 2}, {\"id\": 3}]", &counter);
+    CHECK(counter.count == 2);
+}
+
+static void jsonProjection()
+{
+    Parser parser(JsonFormat, "products");
+    parser.setFields(QStringList() << "id" << "vendor.name" << "variants.sku");
+
+    QByteArray product =
+        "{\"id\": 1, \"notes\": \"a \\\"}\\\" ], {\", \"price\": 1.5, "
+        "\"vendor\": {\"name\": \"Acme\", \"address\": {\"city\": \"X\"}}, "
+        "\"variants\": [{\"sku\": \"a\", \"stock\": [1, [2], {\"n\": null}]}], "
+        "\"tags\": [\"x\", {\"y\": [true]}], \"empty\": {}}";
+
+    QList<QByteArray> documents;
+    documents << "[" + product + "]"
+              << "{\"products\": [" + product + "]}"
+              << "{\"product\": " + product + "}"
+              << "[{\"product\": " + product + "}]"
+              << product;
+
+    foreach(QByteArray document, documents)
+    {
+        RecordList records = parser.decode(document);
+
+        if(!CHECK(records.size() == 1))
+        {
+            continue;
+        }
+
+        const Record record = records[0];
+
+        CHECK(record.className() == "Product");
+        CHECK(record.size() == 3 && record["id"].toInt() == 1);
+
+        Record vendor(record["vendor"]);
+        CHECK(vendor.size() == 1 && vendor["name"].toString() == "Acme");
+
+        QVariantList variants = record["variants"].toList();
+
+        if(CHECK(variants.size() == 1))
+        {
+            Record variant(variants[0]);
+            CHECK(variant.size() == 1 && variant["sku"].toString() == "a");
+        }
+    }
+
+    // Skipping stops at the end of a truncated document.
+
+    CHECK(parser.decode("[{\"id\": 1, \"notes\": \"open\\").size() <= 1);
+    CHECK(parser.decode("[{\"id\": 1, \"tags\": [1, {\"a\": 2}").size() <= 1);
+}
+
+int main(int argc, char *argv[])
+{
+    // The event loop drives findAsync().
+
+    QCoreApplication application(argc, argv);
+
+    recordIteration();
+    cacheNull();
+    cacheRoundTrip();
+
+    builderIntegers();
+    builderShapes();
+    builderFeatures();
+
+    pagesLimit();
+    batchPages();
+    asyncFinds();
+
+    lazyShapes();
+    lazyProjection();
+    lazyDeclarations();
+    lazyLarge();
+
+    jsonValues();
+    jsonStrings();
+    jsonRoots();
+    jsonNesting();
+    jsonErrors();
+    jsonHandler();
+    jsonProjection();
+
+    if(failures > 0)
+    {
+        fprintf(stderr, "%i checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,15 @@
+TEMPLATE = app
+CONFIG -= app_bundle
+CONFIG += console
+TARGET = unit
+DEPENDPATH += .
+INCLUDEPATH += . ../..
+LIBS += -L../.. -lqactiveresource
+
+# Input
+HEADERS += ../Server.h
+SOURCES += unit.cpp
+
+check.depends = $(TARGET)
+check.commands = LD_LIBRARY_PATH=../..:$(LD_LIBRARY_PATH) ./$(TARGET)
+QMAKE_EXTRA_TARGETS += check